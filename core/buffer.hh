@@ -2,39 +2,56 @@
 
 #include <unistd.h>
 
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <string>
 
+#include "string.hh"
+
 namespace wxg {
 
 class buffer {
    private:
     const int MAX_READ = 4096;
-    const int DEFAULT_SIZE = 128;
 
-    unsigned char *originbuf_;
-    unsigned char *buf_;
+    /* storage is allocated on first write, see __expand */
+    unsigned char *originbuf_ = nullptr;
+    unsigned char *buf_ = nullptr;
 
     int misalign_ = 0;
     int off_ = 0;
     int totallen_ = 0;
 
    public:
-    buffer() {
-        totallen_ = DEFAULT_SIZE;
-        originbuf_ = new unsigned char[totallen_];
-        buf_ = originbuf_;
-    }
-    ~buffer() { delete originbuf_; }
+    buffer() {}
+    ~buffer() { std::free(originbuf_); }
+
+    buffer(const buffer &) = delete;
+    buffer &operator=(const buffer &) = delete;
 
     bool empty() const { return off_ == 0; }
-    unsigned char *get() const { return buf_; }
+    unsigned char *get() const {
+        static unsigned char nothing[1] = {0};
+        return buf_ ? buf_ : nothing;
+    }
     size_t length() const { return off_; }
+    size_t capacity() const { return totallen_; }
 
     void clear() {
         misalign_ = off_ = 0;
         buf_ = originbuf_;
+        if (totallen_ > 0) buf_[0] = '\0';
+    }
+
+    /*
+     * drop content and give the storage back to the allocator,
+     * next write allocates again
+     */
+    void reset() {
+        std::free(originbuf_);
+        originbuf_ = buf_ = nullptr;
+        misalign_ = off_ = totallen_ = 0;
     }
 
     int read(int fd, int count = -1) {
@@ -53,6 +70,7 @@ class buffer {
     }
 
     int write(int fd) {
+        if (off_ == 0) return 0;
         int n = ::write(fd, buf_, off_);
         if (n == -1 || n == 0) return n;
         __drain(n);
@@ -61,6 +79,7 @@ class buffer {
     }
 
     int push(void *data, int length) {
+        if (length <= 0) return 0;
         int need = off_ + misalign_ + length;
 
         if (totallen_ < need && __expand(length) == -1) return -1;
@@ -89,9 +108,10 @@ class buffer {
 
     int pop(void *data, int length) {
         if (length > off_) length = off_;
+        if (length <= 0) return 0;
         std::memcpy(data, buf_, length);
 
-        if (length > 0) __drain(length);
+        __drain(length);
 
         if (misalign_ + off_ < totallen_) buf_[off_] = '\0';
         return length;
@@ -125,6 +145,39 @@ class buffer {
         return line;
     }
 
+    /**
+     * find the first line without copying it, line refers to the buffer
+     * content and stays valid until the buffer is written or drained.
+     * return the bytes to drain including the line end, 0 if no whole
+     * line is buffered yet
+     */
+    int find_line(string_ref &line) const {
+        const char *data = (const char *)buf_;
+        int i;
+
+        for (i = 0; i < off_; i++) {
+            if (data[i] == '\r' || data[i] == '\n') break;
+        }
+
+        if (i == off_) return 0; /* not found */
+
+        int onemore = 0;
+        if (i + 1 < off_) {  // check \r\n \n\r
+            if ((data[i] == '\r' && data[i + 1] == '\n') ||
+                (data[i] == '\n' && data[i + 1] == '\r'))
+                onemore++;
+        } else if (data[i] == '\r') {
+            return 0; /* '\n' may arrive with the next read */
+        }
+
+        line = string_ref(data, i);
+        return i + onemore + 1;
+    }
+
+    void drain(int length) {
+        if (length > 0) __drain(length);
+    }
+
     unsigned char *find(const char *what, int length) const {
         int remain = off_;
         unsigned char *search = buf_, *p;
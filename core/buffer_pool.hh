@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "buffer.hh"
+
+namespace wxg {
+
+/*
+ * free list of buffers owned by one thread, not thread safe.
+ *
+ * buffers handed back keep their storage unless it grew beyond
+ * maxBlock, at most highwater buffers are kept, the rest are freed
+ */
+class buffer_pool {
+   private:
+    std::vector<std::unique_ptr<buffer>> free_;
+
+    size_t highwater = 1024;
+    size_t maxBlock = 16 * 1024;
+
+   public:
+    buffer_pool() {}
+    buffer_pool(size_t _highwater, size_t _maxBlock)
+        : highwater(_highwater), maxBlock(_maxBlock) {}
+    ~buffer_pool() {}
+
+    size_t size() const { return free_.size(); }
+
+    void set_highwater(size_t n) {
+        highwater = n;
+        if (free_.size() > highwater) free_.resize(highwater);
+    }
+    void set_max_block(size_t n) { maxBlock = n; }
+
+    std::unique_ptr<buffer> get() {
+        if (free_.empty()) return std::make_unique<buffer>();
+
+        auto buf = std::move(free_.back());
+        free_.pop_back();
+        return buf;
+    }
+
+    void put(std::unique_ptr<buffer> buf) {
+        if (!buf || free_.size() >= highwater) return;
+
+        buf->clear();
+        if (buf->capacity() > maxBlock) buf->reset();
+        free_.push_back(std::move(buf));
+    }
+};
+
+}  // namespace wxg
@@ -1,49 +1,254 @@
 #pragma once
 
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <deque>
 #include <memory>
 
 #include "buffer.hh"
+#include "file.hh"
+#include "buffer_pool.hh"
 
 namespace wxg {
 
+/*
+ * immutable bytes queued for output without copying, either a shared
+ * string or a file range sent with sendfile. mark is the position in the
+ * write buffer stream the segment follows
+ */
+struct output_segment {
+    std::shared_ptr<const std::string> data;
+    std::shared_ptr<const file> source;
+    size_t offset = 0;  // next byte of data or source to write
+    size_t end = 0;
+    size_t mark = 0;
+
+    inline size_t remaining() const { return end - offset; }
+};
+
 class connection {
    private:
-    std::unique_ptr<buffer> in = nullptr;
-    std::unique_ptr<buffer> out = nullptr;
+    /* buffers are taken from pool on first use */
+    mutable std::unique_ptr<buffer> in = nullptr;
+    mutable std::unique_ptr<buffer> out = nullptr;
+
+    std::deque<output_segment> segments;
+    size_t outWritten = 0;  // bytes written from out so far
+    size_t queued = 0;      // bytes of segments not written yet
+
+    static const int MAX_IOV = 16;
+    static const size_t MAX_SENDFILE = 1 << 20;  // per call, keeps loop fair
 
    public:
     int fd = -1;
     std::string address;
     unsigned short port;
 
-    connection() {
-        in = std::make_unique<buffer>();
-        out = std::make_unique<buffer>();
-    }
+    buffer_pool* pool = nullptr;
+
+    connection() {}
     ~connection() {}
 
-    inline wxg::buffer* get_read_buffer() const { return in.get(); }
-    inline wxg::buffer* get_write_buffer() const { return out.get(); }
+    inline wxg::buffer* get_read_buffer() const {
+        if (!in) in = acquire_buffer();
+        return in.get();
+    }
+    inline wxg::buffer* get_write_buffer() const {
+        if (!out) out = acquire_buffer();
+        return out.get();
+    }
+
+    inline bool has_input() const { return in && !in->empty(); }
+    inline bool has_output() const {
+        return (out && !out->empty()) || !segments.empty();
+    }
+
+    /* bytes waiting to be written, buffered and queued */
+    inline size_t output_length() const {
+        return (out ? out->length() : 0) + queued;
+    }
 
     /**
      * read data from socket to buffer
      */
-    inline int read() { return in->read(fd); }
+    inline int read() { return get_read_buffer()->read(fd); }
 
     /**
-     * write data to socket from buffer
+     * write data to socket from buffer and queued segments, in order
      */
-    inline int write() { return out->write(fd); }
+    int write() {
+        if (segments.empty()) {
+            int n = get_write_buffer()->write(fd);
+            if (n > 0) outWritten += n;
+            return n;
+        }
+
+        struct iovec iov[MAX_IOV];
+        int cnt = 0;
+        size_t pos = outWritten, outoff = 0;
+        bool all = true;
+        for (const auto& seg : segments) {
+            if (cnt + 2 > MAX_IOV) {
+                all = false;
+                break;
+            }
+            if (seg.mark > pos) {
+                iov[cnt].iov_base = get_write_buffer()->get() + outoff;
+                iov[cnt++].iov_len = seg.mark - pos;
+                outoff += seg.mark - pos;
+                pos = seg.mark;
+            }
+            if (seg.source) {  // a file range goes out on its own
+                all = false;
+                break;
+            }
+            iov[cnt].iov_base = (void*)(seg.data->data() + seg.offset);
+            iov[cnt++].iov_len = seg.remaining();
+        }
+        size_t outlen = out ? out->length() : 0;
+        if (all && outoff < outlen) {
+            iov[cnt].iov_base = out->get() + outoff;
+            iov[cnt++].iov_len = outlen - outoff;
+        }
+
+        ssize_t n;
+        if (cnt == 0) {
+            auto& seg = segments.front();
+            off_t off = seg.offset;
+            n = ::sendfile(fd, seg.source->fd, &off,
+                           std::min(seg.remaining(), size_t(MAX_SENDFILE)));
+        } else {
+            n = ::writev(fd, iov, cnt);
+        }
+        if (n > 0) consume(n);
+        return n;
+    }
 
     /**
      * push string to write buffer
      */
-    inline void push(const std::string& s) { out->push(s); }
+    inline void push(const std::string& s) { get_write_buffer()->push(s); }
 
     /**
      * push buffer content to write buffer
      */
-    inline void push(buffer* buf) { out->push(buf); }
+    inline void push(buffer* buf) { get_write_buffer()->push(buf); }
+
+    /**
+     * queue shared bytes after what is buffered so far, without copying
+     */
+    void push(const std::shared_ptr<const std::string>& data) {
+        if (!data || data->empty()) return;
+
+        output_segment seg;
+        seg.data = data;
+        seg.end = data->size();
+        seg.mark = outWritten + (out ? out->length() : 0);
+        segments.push_back(std::move(seg));
+        queued += data->size();
+    }
+
+    /**
+     * queue length bytes of f from offset, sent with sendfile
+     */
+    void push(const std::shared_ptr<const file>& f, off_t offset,
+              size_t length) {
+        if (!f || length == 0) return;
+
+        output_segment seg;
+        seg.source = f;
+        seg.offset = offset;
+        seg.end = offset + length;
+        seg.mark = outWritten + (out ? out->length() : 0);
+        segments.push_back(std::move(seg));
+        queued += length;
+    }
+
+    /* bytes of the write buffer ahead of the first queued segment */
+    inline size_t output_prefix() const {
+        size_t n = out ? out->length() : 0;
+        return segments.empty() ? n : segments.front().mark - outWritten;
+    }
+
+    /* drop n bytes of pending output without writing them */
+    inline void drop_output(size_t n) { consume(n); }
+
+    /**
+     * move n bytes of pending output to the output of dest, in order.
+     * buffered bytes are copied, segments are shared with dest
+     */
+    void move_output(connection* dest, size_t n) {
+        while (n > 0) {
+            size_t k = output_prefix();
+            if (k > 0) {
+                k = std::min(k, n);
+                dest->get_write_buffer()->push(out->get(), k);
+            } else {
+                auto& seg = segments.front();
+                k = std::min(seg.remaining(), n);
+                output_segment part = seg;
+                part.end = part.offset + k;
+                part.mark =
+                    dest->outWritten + dest->get_write_buffer()->length();
+                dest->segments.push_back(std::move(part));
+                dest->queued += k;
+            }
+            consume(k);
+            n -= k;
+        }
+    }
+
+    /**
+     * hand empty buffers back to the pool, used when the connection idles,
+     * with discard the content is dropped too
+     */
+    void release_buffers(bool discard = false) {
+        if (in && (discard || in->empty())) release_buffer(std::move(in));
+        if (out && (discard || out->empty())) release_buffer(std::move(out));
+        if (discard) {
+            segments.clear();
+            queued = 0;
+        }
+    }
+
+   private:
+    /* drop n written bytes from the front of buffer and segments */
+    void consume(size_t n) {
+        while (n > 0) {
+            if (segments.empty()) {
+                out->drain(n);
+                outWritten += n;
+                return;
+            }
+
+            auto& seg = segments.front();
+            size_t before = seg.mark - outWritten;
+            if (before > 0) {
+                size_t k = std::min(before, n);
+                out->drain(k);
+                outWritten += k;
+                n -= k;
+                continue;
+            }
+
+            size_t k = std::min(seg.remaining(), n);
+            seg.offset += k;
+            queued -= k;
+            n -= k;
+            if (seg.remaining() == 0) segments.pop_front();
+        }
+    }
+
+    std::unique_ptr<buffer> acquire_buffer() const {
+        if (pool) return pool->get();
+        return std::make_unique<buffer>();
+    }
+
+    void release_buffer(std::unique_ptr<buffer> buf) {
+        if (pool) pool->put(std::move(buf));
+    }
 };
 
 }  // namespace wxg
@@ -3,10 +3,13 @@
 #include <sys/epoll.h>
 #include <sys/resource.h>
 
-#include <iostream>
+#include <cerrno>
+#include <cstring>
 #include <unordered_map>
 #include <vector>
 
+#include "log.hh"
+
 namespace wxg {
 
 class epoll {
@@ -31,7 +34,8 @@ class epoll {
         if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
             size = rl.rlim_cur;
 
-        if ((epfd = epoll_create(1)) == -1) std::cerr << "epoll_create error\n";
+        if ((epfd = epoll_create(1)) == -1)
+            LOG_ERROR("epoll_create: %s", strerror(errno));
 
         epevents = new struct epoll_event[size];
     }
@@ -67,8 +71,7 @@ class epoll {
         if (event & WR) epev.events |= EPOLLOUT;
 
         if (epoll_ctl(epfd, op, fd, &epev) == -1) {
-            std::cerr << "epoll_ctl error:";
-            std::perror("");
+            LOG_WARN("epoll_ctl add of fd %d: %s", fd, strerror(errno));
             return -1;
         }
         events[fd] = event & RDWR;
@@ -94,8 +97,7 @@ class epoll {
         if (event & WR) epev.events |= EPOLLOUT;
 
         if (epoll_ctl(epfd, op, fd, &epev) == -1) {
-            std::cerr << "epoll_ctl error:";
-            std::perror("");
+            LOG_WARN("epoll_ctl remove of fd %d: %s", fd, strerror(errno));
             return -1;
         }
 
@@ -1,5 +1,10 @@
 #pragma once
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <fstream>
+#include <memory>
 #include <sstream>
 #include <string>
 
@@ -7,7 +12,7 @@ using std::string;
 
 namespace wxg {
 
-string read_file(string &path) {
+inline string read_file(const string &path) {
     std::stringstream ss;
     {
         std::ifstream ifs(path);
@@ -18,4 +23,35 @@ string read_file(string &path) {
     return ss.str();
 }
 
+/*
+ * regular file opened read only, closed with the last reference so
+ * queued output can still be sent from it after the handler returns
+ */
+class file {
+   public:
+    int fd = -1;
+    struct stat st;
+
+   public:
+    file() = default;
+    file(const file &) = delete;
+    file &operator=(const file &) = delete;
+    ~file() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    inline off_t size() const { return st.st_size; }
+
+    /* nullptr when path is missing or not a regular file */
+    static std::shared_ptr<const file> open(const string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+
+        auto f = std::make_shared<file>();
+        f->fd = fd;
+        if (fstat(fd, &f->st) == -1 || !S_ISREG(f->st.st_mode)) return nullptr;
+        return f;
+    }
+};
+
 }  // namespace wxg
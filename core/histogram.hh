@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace wxg {
+
+/*
+ * log-linear histogram of values such as nanoseconds, in the manner of
+ * HdrHistogram: each power of two range is split into SUB_BUCKETS linear
+ * buckets, so a value is kept to within 1/SUB_BUCKETS of itself in fixed
+ * memory whatever its size. values of MAX_BITS bits and more count as the
+ * largest.
+ *
+ * one thread records with relaxed loads and stores, others may read at
+ * any time and merge several into a histogram of their own
+ */
+class latency_histogram {
+   public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 40;  // 18 minutes of nanoseconds
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+   private:
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+
+   public:
+    latency_histogram() {
+        for (auto &c : counts) c.store(0, std::memory_order_relaxed);
+    }
+
+    static inline int bucket_of(uint64_t v) {
+        if (v >= (uint64_t(1) << MAX_BITS)) v = (uint64_t(1) << MAX_BITS) - 1;
+        if (v < uint64_t(SUB_BUCKETS)) return int(v);
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + int(v >> shift) - SUB_BUCKETS;
+    }
+
+    /* largest value counted in bucket i */
+    static inline uint64_t bucket_max(int i) {
+        if (i < SUB_BUCKETS) return i;
+        int shift = i / SUB_BUCKETS - 1;
+        uint64_t low = uint64_t(SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+        return low + (uint64_t(1) << shift) - 1;
+    }
+
+    /* from the recording thread only */
+    inline void record(uint64_t v) {
+        bump(counts[bucket_of(v)], 1);
+        bump(total, 1);
+        bump(sum_, v);
+        if (v > max_.load(std::memory_order_relaxed))
+            max_.store(v, std::memory_order_relaxed);
+    }
+
+    /* add the counts of h, this one must not be recorded into meanwhile */
+    void merge(const latency_histogram &h) {
+        for (int i = 0; i < BUCKETS; i++)
+            bump(counts[i], h.counts[i].load(std::memory_order_relaxed));
+        bump(total, h.count());
+        bump(sum_, h.sum());
+        if (h.max() > max()) max_.store(h.max(), std::memory_order_relaxed);
+    }
+
+    inline uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+    inline uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    inline uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    /*
+     * the value at quantile q, 0 < q <= 1, as the top of its bucket but
+     * not above the largest recorded. 0 when empty
+     */
+    uint64_t quantile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = uint64_t(q * n + 0.5);
+        if (rank < 1) rank = 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t top = bucket_max(i);
+                return top < max() ? top : max();
+            }
+        }
+        return max();
+    }
+
+   private:
+    static inline void bump(std::atomic<uint64_t> &c, uint64_t n) {
+        c.store(c.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+};
+
+}  // namespace wxg
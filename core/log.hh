@@ -0,0 +1,362 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace wxg {
+
+enum log_level_t {
+    LEVEL_DEBUG = 0,
+    LEVEL_INFO,
+    LEVEL_WARN,
+    LEVEL_ERROR,
+    LEVEL_NONE
+};
+
+/* levels below are compiled out, set with -DLIBIO_LOG_LEVEL=0 for debug */
+#ifndef LIBIO_LOG_LEVEL
+#define LIBIO_LOG_LEVEL 1
+#endif
+
+#define LIBIO_LOG(level, ...)                                             \
+    do {                                                                  \
+        if ((level) >= LIBIO_LOG_LEVEL && wxg::logger::enabled(level))    \
+            wxg::logger::print(level, __VA_ARGS__);                       \
+    } while (0)
+
+#define LOG_DEBUG(...) LIBIO_LOG(wxg::LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LIBIO_LOG(wxg::LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LIBIO_LOG(wxg::LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LIBIO_LOG(wxg::LEVEL_ERROR, __VA_ARGS__)
+
+/*
+ * printf style logging through per thread rings. a line is formatted on
+ * the calling thread into the next slot of its ring, a single producer
+ * single consumer queue, and a background writer collects the rings and
+ * writes each output in one write(2) per round. so once start ran, a
+ * reactor thread logging takes no lock and makes no syscall, a full ring
+ * drops the line and counts it instead of waiting.
+ *
+ * before start, or after stop, lines are written at once as before. the
+ * log goes to stderr unless set_output changed it, the access log, off
+ * by default, is another output fed the same way
+ */
+class logger {
+   public:
+    static const size_t SLOT_SIZE = 512;  // longer lines are cut
+    static const size_t SLOTS = 1024;     // per thread, a power of two
+
+    enum sink_t { LOG = 0, ACCESS, SINKS };
+
+   private:
+    struct slot {
+        uint32_t length;
+        uint32_t sink;
+        char text[SLOT_SIZE - 8];
+    };
+
+    struct ring {
+        std::atomic<uint64_t> head{0};  // written by the owning thread
+        std::atomic<uint64_t> tail{0};  // written by the writer
+        std::atomic<uint64_t> dropped{0};
+        slot slots[SLOTS];
+    };
+
+    struct registry {
+        std::mutex mutex;
+        std::vector<ring *> rings;  // kept after their threads end
+        std::atomic<int> level{LEVEL_INFO};
+        std::atomic<int> fds[SINKS];
+        std::atomic<bool> running{false};
+
+        std::mutex writerMutex;
+        std::condition_variable cv;
+        std::thread writer;
+        bool stopping = false;
+        uint64_t reportedDrops = 0;
+    };
+
+   public:
+    static inline bool enabled(log_level_t level) {
+        return level >= get_registry().level.load(std::memory_order_relaxed);
+    }
+    static void set_level(log_level_t level) { get_registry().level = level; }
+
+    /* fd of the log, and of the access log where -1 turns it off */
+    static void set_output(int fd) { get_registry().fds[LOG] = fd; }
+    static void set_access_log(int fd) { get_registry().fds[ACCESS] = fd; }
+    static inline bool access_enabled() {
+        return get_registry().fds[ACCESS].load(std::memory_order_relaxed) >= 0;
+    }
+
+    /* a line with time and level, use the LOG_ macros */
+    static void print(log_level_t level, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+    /* a line for the access log as it is, without the newline */
+    static void access(const char *fmt, ...)
+        __attribute__((format(printf, 1, 2)));
+
+    /* "10/Oct/2000:13:55:36 +0000" for now, the time of access logs */
+    static void clf_time(char *out, size_t size);
+
+    /* start the writer thread, it looks at the rings every flushMs */
+    static void start(int flushMs = 5);
+    /* write what is queued and stop the writer, also run at exit */
+    static void stop();
+
+    /* lines dropped on full rings since the start */
+    static uint64_t dropped();
+
+   private:
+    static registry &get_registry() {
+        static registry *r = [] {
+            registry *reg = new registry;  // used until the process ends
+            reg->fds[LOG] = 2;
+            reg->fds[ACCESS] = -1;
+            return reg;
+        }();
+        return *r;
+    }
+
+    static ring *get_ring() {
+        static thread_local ring *r = nullptr;
+        if (r) return r;
+
+        r = new ring;
+        registry &reg = get_registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.rings.push_back(r);
+        return r;
+    }
+
+    /* the slot to format into, nullptr when the ring is full */
+    static slot *claim(ring *r) {
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        if (head - r->tail.load(std::memory_order_acquire) >= SLOTS) {
+            r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &r->slots[head & (SLOTS - 1)];
+    }
+
+    static void commit(ring *r) {
+        r->head.store(r->head.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
+
+    static void write_all(int fd, const char *data, size_t length) {
+        while (length > 0) {
+            ssize_t n = ::write(fd, data, length);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            data += n;
+            length -= n;
+        }
+    }
+
+    /* end the line of n formatted bytes, cut to the slot */
+    static void finish(sink_t sink, slot *s, int n) {
+        size_t length = n < 0 ? 0 : n;
+        if (length >= sizeof(s->text)) length = sizeof(s->text) - 1;
+        s->text[length++] = '\n';
+        s->length = length;
+        s->sink = sink;
+    }
+
+    static int format(log_level_t level, char *out, size_t size,
+                      const char *fmt, va_list ap);
+    static size_t drain(std::string out[SINKS]);
+    static void run(int flushMs);
+};
+
+/*
+ * calendar date of a day count since 1970-01-01, see
+ * http://howardhinnant.github.io/date_algorithms.html, gmtime_r takes the
+ * timezone lock
+ */
+inline void civil_from_days(int64_t z, int *y, int *m, int *d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = unsigned(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *d = int(doy - (153 * mp + 2) / 5 + 1);
+    *m = int(mp < 10 ? mp + 3 : mp - 9);
+    *y = int(yoe + era * 400 + (*m <= 2));
+}
+
+inline int logger::format(log_level_t level, char *out, size_t size,
+                          const char *fmt, va_list ap) {
+    static const char *names[] = {"DEBUG", "INFO", "WARN", "ERROR", "NONE"};
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t secs = ts.tv_sec;
+    int y, mon, d;
+    civil_from_days(secs / 86400, &y, &mon, &d);
+    int sod = int(secs % 86400);
+
+    int n = snprintf(out, size, "%04d-%02d-%02d %02d:%02d:%02d.%06ld %s ", y,
+                     mon, d, sod / 3600, sod / 60 % 60, sod % 60,
+                     long(ts.tv_nsec / 1000), names[level]);
+    int m = vsnprintf(out + n, size - n, fmt, ap);
+    return m < 0 ? n : n + m;
+}
+
+inline void logger::print(log_level_t level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    registry &reg = get_registry();
+    if (!reg.running.load(std::memory_order_acquire)) {
+        slot s;
+        finish(LOG, &s, format(level, s.text, sizeof(s.text), fmt, ap));
+        write_all(reg.fds[LOG], s.text, s.length);
+        va_end(ap);
+        return;
+    }
+
+    ring *r = get_ring();
+    slot *s = claim(r);
+    if (s) {
+        finish(LOG, s, format(level, s->text, sizeof(s->text), fmt, ap));
+        commit(r);
+    }
+    va_end(ap);
+}
+
+inline void logger::access(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    registry &reg = get_registry();
+    bool running = reg.running.load(std::memory_order_acquire);
+    ring *r = running ? get_ring() : nullptr;
+    slot local;
+    slot *s = running ? claim(r) : &local;
+    if (s) {
+        finish(ACCESS, s, vsnprintf(s->text, sizeof(s->text), fmt, ap));
+        if (running)
+            commit(r);
+        else
+            write_all(reg.fds[ACCESS], s->text, s->length);
+    }
+    va_end(ap);
+}
+
+inline void logger::clf_time(char *out, size_t size) {
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    int64_t secs = ::time(nullptr);
+    int y, m, d;
+    civil_from_days(secs / 86400, &y, &m, &d);
+    int sod = int(secs % 86400);
+    snprintf(out, size, "%02d/%s/%04d:%02d:%02d:%02d +0000", d, months[m - 1],
+             y, sod / 3600, sod / 60 % 60, sod % 60);
+}
+
+/* move the queued lines of all rings to out, by sink */
+inline size_t logger::drain(std::string out[SINKS]) {
+    registry &reg = get_registry();
+    std::vector<ring *> rings;
+    {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        rings = reg.rings;
+    }
+
+    size_t lines = 0;
+    for (ring *r : rings) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        for (; tail < head; tail++, lines++) {
+            const slot &s = r->slots[tail & (SLOTS - 1)];
+            out[s.sink].append(s.text, s.length);
+        }
+        r->tail.store(tail, std::memory_order_release);
+    }
+    return lines;
+}
+
+inline uint64_t logger::dropped() {
+    registry &reg = get_registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    uint64_t n = 0;
+    for (ring *r : reg.rings) n += r->dropped.load(std::memory_order_relaxed);
+    return n;
+}
+
+inline void logger::run(int flushMs) {
+    registry &reg = get_registry();
+    std::string out[SINKS];
+    std::unique_lock<std::mutex> lock(reg.writerMutex);
+    while (true) {
+        bool stopping = reg.stopping;
+        lock.unlock();
+
+        size_t lines = drain(out);
+        uint64_t drops = dropped();
+        if (drops != reg.reportedDrops) {
+            char note[64];
+            snprintf(note, sizeof(note), "log: %llu lines dropped\n",
+                     (unsigned long long)(drops - reg.reportedDrops));
+            out[LOG].append(note);
+            reg.reportedDrops = drops;
+        }
+        for (int i = 0; i < SINKS; i++) {
+            if (out[i].empty()) continue;
+            write_all(reg.fds[i], out[i].data(), out[i].size());
+            out[i].clear();
+        }
+
+        lock.lock();
+        if (stopping) return;
+        // a busy round goes on at once, the rings may be filling up
+        if (lines == 0)
+            reg.cv.wait_for(lock, std::chrono::milliseconds(flushMs),
+                            [&reg]() { return reg.stopping; });
+    }
+}
+
+inline void logger::start(int flushMs) {
+    registry &reg = get_registry();
+    std::lock_guard<std::mutex> lock(reg.writerMutex);
+    if (reg.writer.joinable()) return;
+
+    static bool registered = false;
+    if (!registered) {
+        registered = true;
+        atexit(stop);
+    }
+    reg.stopping = false;
+    reg.writer = std::thread([flushMs]() { run(flushMs); });
+    reg.running.store(true, std::memory_order_release);
+}
+
+inline void logger::stop() {
+    registry &reg = get_registry();
+    {
+        std::lock_guard<std::mutex> lock(reg.writerMutex);
+        if (!reg.writer.joinable()) return;
+        // lines from here on are written at once, the writer drains the
+        // rest in its last round
+        reg.running.store(false, std::memory_order_release);
+        reg.stopping = true;
+    }
+    reg.cv.notify_all();
+    reg.writer.join();
+}
+
+}  // namespace wxg
@@ -85,10 +85,10 @@ class poll {
 
         int res = ::poll(fds, size, timeout);
 
-        if (res == 0 || res == -1) return res;
-
+        // nothing is left active from the last turn
         std::map<int, int>().swap(result);
         std::vector<int>().swap(activeFd);
+        if (res == 0 || res == -1) return res;
 
         int what, event, fd;
         for (i = 0; i < size; i++) {
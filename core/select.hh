@@ -24,8 +24,6 @@ class select {
 
     std::vector<int> activeFd;
 
-    static const int MAX_SELECT_FD = 1024;
-
    public:
     static const int RD = 0x1;
     static const int WR = 0x2;
@@ -69,30 +67,28 @@ class select {
         if (!newset) return -1;
         writeset_out = newset;
 
-        std::memset(readset_in + size, 0, n - size);
-        std::memset(writeset_in + size, 0, n - size);
+        // size and n are bytes, not fd_sets
+        std::memset((char *)readset_in + size, 0, n - size);
+        std::memset((char *)writeset_in + size, 0, n - size);
 
         size = n;
         return 0;
     }
 
-    /* type: RD WR RDWR */
+    /* type: RD WR RDWR, -1 for an fd that FD_SET cannot take */
     int add(int fd, int type) {
-        if (fd > MAX_SELECT_FD) {
-            cerr << "select add fd > " << MAX_SELECT_FD << endl;
+        if (fd < 0 || fd >= FD_SETSIZE) {
+            cerr << "select add fd " << fd << " >= " << FD_SETSIZE << endl;
             return -1;
         }
 
         if (highest_fd < fd) highest_fd = fd;
 
-        if (fd > size - 1) {  // need resize
-            size_t n = size;
-            if (n < sizeof(fd_mask)) n = sizeof(fd_mask);
-
+        if (fd >= size * 8) {  // need resize, size is in bytes
             int need = ((fd + NFDBITS) / NFDBITS) * sizeof(fd_mask);
-            while (need < size) need *= 2;
-
-            if (need != size) resize(need);
+            int n = size;
+            while (n < need) n *= 2;
+            resize(n);
         }
 
         if (type & RD) FD_SET(fd, readset_in);
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace wxg {
+
+/*
+ * sha-1 of short inputs such as the websocket handshake key, the whole
+ * message is hashed in one call
+ */
+class sha1 {
+   public:
+    static const size_t DIGEST = 20;
+
+    static void hash(const void *data, size_t length,
+                     unsigned char out[DIGEST]) {
+        uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                         0xC3D2E1F0};
+        auto p = static_cast<const unsigned char *>(data);
+
+        size_t full = length / 64 * 64;
+        for (size_t i = 0; i < full; i += 64) block(h, p + i);
+
+        // padding, a 1 bit, zeros and the bit length in the last block
+        unsigned char tail[128] = {0};
+        size_t rest = length - full;
+        std::memcpy(tail, p + full, rest);
+        tail[rest] = 0x80;
+        size_t n = rest + 9 > 64 ? 128 : 64;
+        uint64_t bits = (uint64_t)length * 8;
+        for (int i = 0; i < 8; i++) tail[n - 1 - i] = bits >> (8 * i);
+        for (size_t i = 0; i < n; i += 64) block(h, tail + i);
+
+        for (int i = 0; i < 5; i++) {
+            out[4 * i] = h[i] >> 24;
+            out[4 * i + 1] = h[i] >> 16;
+            out[4 * i + 2] = h[i] >> 8;
+            out[4 * i + 3] = h[i];
+        }
+    }
+
+    static std::string hash(const std::string &s) {
+        unsigned char out[DIGEST];
+        hash(s.data(), s.size(), out);
+        return std::string((const char *)out, DIGEST);
+    }
+
+   private:
+    static inline uint32_t rol(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    static void block(uint32_t h[5], const unsigned char *p) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+                   (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for (int i = 16; i < 80; i++)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+};
+
+}  // namespace wxg
@@ -15,6 +15,8 @@
 #include <iostream>
 #include <string>
 
+#include "log.hh"
+
 using std::cerr;
 using std::endl;
 
@@ -191,7 +193,8 @@ class tcp {
             ::accept(fd, (struct sockaddr *)&ss_client, &client_addrlen);
 
         if (sockfd == -1) {
-            if (errno != EAGAIN && errno != EINTR) perror(__func__);
+            if (errno != EAGAIN && errno != EINTR)
+                LOG_WARN("accept on fd %d: %s", fd, strerror(errno));
             return -1;
         }
 
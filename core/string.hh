@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <ostream>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -7,6 +10,255 @@
 
 namespace wxg {
 
+/*
+ * non-owning reference to a run of characters, the referenced storage
+ * must outlive it
+ */
+class string_ref {
+   private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+
+   public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    string_ref() {}
+    string_ref(const char *data, size_t size) : data_(data), size_(size) {}
+    string_ref(const char *s) : data_(s), size_(std::strlen(s)) {}
+    string_ref(const std::string &s) : data_(s.data()), size_(s.size()) {}
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+    size_t length() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const char *begin() const { return data_; }
+    const char *end() const { return data_ + size_; }
+
+    char operator[](size_t i) const { return data_[i]; }
+
+    std::string str() const { return std::string(data_, size_); }
+
+    string_ref substr(size_t pos, size_t n = npos) const {
+        if (pos > size_) pos = size_;
+        if (n > size_ - pos) n = size_ - pos;
+        return string_ref(data_ + pos, n);
+    }
+
+    size_t find(char c, size_t pos = 0) const {
+        if (pos >= size_) return npos;
+        auto p = (const char *)std::memchr(data_ + pos, c, size_ - pos);
+        return p ? p - data_ : npos;
+    }
+
+    bool starts_with(const string_ref &s) const {
+        return size_ >= s.size_ && std::memcmp(data_, s.data_, s.size_) == 0;
+    }
+
+    bool operator==(const string_ref &s) const {
+        return size_ == s.size_ && std::memcmp(data_, s.data_, size_) == 0;
+    }
+    bool operator!=(const string_ref &s) const { return !(*this == s); }
+};
+
+inline std::ostream &operator<<(std::ostream &os, const string_ref &s) {
+    return os.write(s.data(), s.size());
+}
+
+/* ascii case insensitive compare */
+inline bool equal_nocase(const string_ref &a, const string_ref &b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (::tolower((unsigned char)a[i]) != ::tolower((unsigned char)b[i]))
+            return false;
+    return true;
+}
+
+/* trim spaces and tabs from both ends */
+inline string_ref trim_ref(const string_ref &s) {
+    size_t b = 0, e = s.size();
+    while (b < e && (s[b] == ' ' || s[b] == '\t')) b++;
+    while (e > b && (s[e - 1] == ' ' || s[e - 1] == '\t')) e--;
+    return s.substr(b, e - b);
+}
+
+/*
+ * parse an unsigned number of base 10 or 16, the whole input must be
+ * digits, return -1 on error
+ */
+inline long to_long(const string_ref &s, int base = 10) {
+    if (s.empty() || s.size() > 15) return -1;
+    long n = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        int d;
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else
+            return -1;
+        n = n * base + d;
+    }
+    return n;
+}
+
+/* append decimal n to s, no temporary string */
+inline void append_int(std::string &s, long n) {
+    char tmp[24];
+    int i = sizeof(tmp);
+    bool neg = n < 0;
+    unsigned long u = neg ? -(unsigned long)n : n;
+    do {
+        tmp[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (neg) tmp[--i] = '-';
+    s.append(tmp + i, sizeof(tmp) - i);
+}
+
+/* decode %XX escapes in place, malformed escapes are kept */
+inline void percent_decode(std::string &s) {
+    size_t r = 0, w = 0, n = s.size();
+    auto hex = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    while (r < n) {
+        int h1, h2;
+        if (s[r] == '%' && r + 2 < n && (h1 = hex(s[r + 1])) >= 0 &&
+            (h2 = hex(s[r + 2])) >= 0) {
+            s[w++] = static_cast<char>(h1 * 16 + h2);
+            r += 3;
+        } else {
+            s[w++] = s[r++];
+        }
+    }
+    s.resize(w);
+}
+
+/* a comma separated header value such as Connection lists token */
+inline bool has_token(const string_ref &list, const string_ref &token) {
+    string_ref rest = list;
+    while (!rest.empty()) {
+        size_t k = rest.find(',');
+        if (equal_nocase(trim_ref(rest.substr(0, k)), token)) return true;
+        if (k == string_ref::npos) break;
+        rest = rest.substr(k + 1);
+    }
+    return false;
+}
+
+inline std::string base64_encode(const void *data, size_t length) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    auto p = static_cast<const unsigned char *>(data);
+    std::string out;
+    out.reserve((length + 2) / 3 * 4);
+
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+        uint32_t v = p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        out.push_back(table[v >> 18]);
+        out.push_back(table[(v >> 12) & 63]);
+        out.push_back(table[(v >> 6) & 63]);
+        out.push_back(table[v & 63]);
+    }
+    if (i < length) {
+        uint32_t v = p[i] << 16 | (i + 1 < length ? p[i + 1] << 8 : 0);
+        out.push_back(table[v >> 18]);
+        out.push_back(table[(v >> 12) & 63]);
+        out.push_back(i + 1 < length ? table[(v >> 6) & 63] : '=');
+        out.push_back('=');
+    }
+    return out;
+}
+
+/*
+ * decode base64 with either alphabet, the url safe one of rfc 4648 5
+ * included, padding is optional. false on any other character
+ */
+inline bool base64_decode(const string_ref &s, std::string &out) {
+    out.clear();
+    uint32_t v = 0;
+    int bits = 0;
+    size_t i = 0;
+    for (; i < s.size() && s[i] != '='; i++) {
+        char c = s[i];
+        int d;
+        if (c >= 'A' && c <= 'Z')
+            d = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            d = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            d = c - '0' + 52;
+        else if (c == '+' || c == '-')
+            d = 62;
+        else if (c == '/' || c == '_')
+            d = 63;
+        else
+            return false;
+
+        v = v << 6 | d;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(v >> bits));
+        }
+    }
+    for (; i < s.size(); i++)
+        if (s[i] != '=') return false;
+    return bits < 6;
+}
+
+/* well formed utf-8, no overlong forms, surrogates or values past 10FFFF */
+inline bool valid_utf8(const char *data, size_t length) {
+    auto p = reinterpret_cast<const unsigned char *>(data);
+    size_t i = 0;
+    while (i < length) {
+        // ascii runs 8 bytes at a time
+        while (i + 8 <= length) {
+            uint64_t v;
+            std::memcpy(&v, p + i, 8);
+            if (v & 0x8080808080808080ull) break;
+            i += 8;
+        }
+        if (i == length) break;
+
+        unsigned char c = p[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t n;
+        unsigned char lo = 0x80, hi = 0xBF;  // range of the second byte
+        if (c >= 0xC2 && c <= 0xDF)
+            n = 1;
+        else if (c >= 0xE0 && c <= 0xEF) {
+            n = 2;
+            if (c == 0xE0) lo = 0xA0;
+            if (c == 0xED) hi = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 3;
+            if (c == 0xF0) lo = 0x90;
+            if (c == 0xF4) hi = 0x8F;
+        } else
+            return false;
+
+        if (i + n >= length) return false;  // cut short
+        if (p[i + 1] < lo || p[i + 1] > hi) return false;
+        for (size_t k = 2; k <= n; k++)
+            if ((p[i + k] & 0xC0) != 0x80) return false;
+        i += n + 1;
+    }
+    return true;
+}
+
 inline std::vector<std::string> split(const std::string &s, char delimiter) {
     std::vector<std::string> tokens;
     std::string token;
@@ -1,4 +1,5 @@
 #include "lock.hh"
+#include "trace.hh"
 
 #include <atomic>
 #include <condition_variable>
@@ -121,7 +122,9 @@ class thread_pool {
             while (true) {
                 while (isPop) {
                     std::unique_ptr<Task> t_(t);  // t will be deleted at return
+                    trace::emit(TRACE_TASK, TRACE_BEGIN, -1, i);
                     (*t)();
+                    trace::emit(TRACE_TASK, TRACE_END, -1, i);
                     if (*this->flags[i])
                         return;
                     else
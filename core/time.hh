@@ -1,7 +1,12 @@
 #pragma once
 
 #include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
+#include <cstdint>
 #include <ctime>
 #include <functional>
 #include <map>
@@ -23,13 +28,18 @@ using Compare = std::function<bool(timer *, timer *)>;
 
 class time {
    public:
+    // ids break ties, timers due at the same time are all kept
     std::set<timer *, Compare> timers =
         std::set<timer *, Compare>([](timer *t1, timer *t2) {
+            if (timercmp(&t1->timeout, &t2->timeout, ==))
+                return t1->id < t2->id;
             return timercmp(&t1->timeout, &t2->timeout, <);
         });
     std::map<int, timer *> idtimer;
     int __maxid = 0;
 
+    timer *running = nullptr;  // callback in progress
+
     time() {}
 
    public:
@@ -49,16 +59,41 @@ class time {
         return timeout > 0 ? timeout : 0;
     }
 
-    static std::string get_date() {
-        char date[50];
-        struct tm cur, *cur_p;
+    /* http date of now, formatted at most once per second per thread */
+    static const std::string &get_date() {
+        thread_local std::string cached;
+        thread_local time_t last = 0;
+
         time_t t = std::time(nullptr);
+        if (t == last && !cached.empty()) return cached;
+
+        cached = format_date(t);
+        last = t;
+        return cached;
+    }
+
+    /* http date of t, empty on error */
+    static std::string format_date(time_t t) {
+        char date[50];
+        struct tm cur;
         gmtime_r(&t, &cur);
-        cur_p = &cur;
-        if (strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", cur_p) !=
+        if (strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &cur) ==
             0)
-            return std::string(date);
-        return "";
+            return "";
+        return date;
+    }
+
+    /* seconds of an http date in any of the three allowed forms, -1 if bad */
+    static time_t parse_date(const std::string &s) {
+        static const char *formats[] = {"%a, %d %b %Y %H:%M:%S GMT",
+                                        "%A, %d-%b-%y %H:%M:%S GMT",
+                                        "%a %b %d %H:%M:%S %Y"};
+        for (auto f : formats) {
+            struct tm t = {};
+            const char *end = strptime(s.c_str(), f, &t);
+            if (end && *end == '\0') return timegm(&t);
+        }
+        return -1;
     }
 
     void set_persistent(int id) {
@@ -80,6 +115,7 @@ class time {
     int set_timer(int sec, int usec, bool persistent, F &&f, Args &&... args) {
         int id = __get_id();
         auto ti = new timer;
+        ti->id = id;
         idtimer[id] = ti;
 
         timerclear(&ti->tv);
@@ -102,23 +138,29 @@ class time {
     void remove(int id) {
         if (!idtimer.count(id)) return;
         auto ti = idtimer[id];
+        if (ti == running) {  // freed when its callback returns
+            ti->persistent = false;
+            return;
+        }
         timers.erase(ti);
         idtimer.erase(id);
         delete ti;
     }
 
+    /* callbacks may add and remove timers, the own one included */
     void process() {
         if (empty()) return;
         struct timeval now;
         gettimeofday(&now, nullptr);
 
-        auto i = timers.begin();
-        while (i != timers.end()) {
-            auto ti = *i;
+        while (!timers.empty()) {
+            auto ti = *timers.begin();
             if (timercmp(&ti->timeout, &now, >)) break;
-            i = timers.erase(i);
+            timers.erase(timers.begin());
 
+            running = ti;
             ti->callback();
+            running = nullptr;
 
             if (!ti->persistent) {
                 idtimer.erase(ti->id);
@@ -138,4 +180,62 @@ class time {
     }
 };
 
+/*
+ * cheap monotonic timestamps for measuring latency. ticks are rdtsc
+ * cycles where the time stamp counter is invariant, scaled to nanoseconds
+ * by a calibration against CLOCK_MONOTONIC on first use, and
+ * CLOCK_MONOTONIC nanoseconds anywhere else
+ */
+class cycle_clock {
+   private:
+    struct calibration {
+        bool tsc = false;
+        double nsPerTick = 1.0;
+    };
+
+   public:
+    static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        if (scale().tsc) return __rdtsc();
+#endif
+        return monotonic_ns();
+    }
+
+    static inline uint64_t to_ns(uint64_t ticks) {
+        return uint64_t(ticks * scale().nsPerTick);
+    }
+
+    static inline uint64_t monotonic_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+   private:
+    static const calibration &scale() {
+        static const calibration c = calibrate();
+        return c;
+    }
+
+    static calibration calibrate() {
+        calibration c;
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned a, b, ecx, edx;
+        if (!__get_cpuid(0x80000007, &a, &b, &ecx, &edx) || !(edx & (1 << 8)))
+            return c;  // the counter may stop or change rate
+
+        // spin 2ms, once per process
+        uint64_t t0 = monotonic_ns(), c0 = __rdtsc(), t1, c1;
+        do {
+            t1 = monotonic_ns();
+            c1 = __rdtsc();
+        } while (t1 - t0 < 2000000);
+        if (c1 <= c0) return c;
+        c.tsc = true;
+        c.nsPerTick = double(t1 - t0) / double(c1 - c0);
+#endif
+        return c;
+    }
+};
+
 }  // namespace wxg
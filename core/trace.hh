@@ -0,0 +1,276 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "time.hh"
+
+namespace wxg {
+
+enum trace_event_t {
+    TRACE_LISTEN = 0,  // blocked in the io multiplexer, a = ready fds
+    TRACE_TIMERS,
+    TRACE_READ,     // read callback of fd
+    TRACE_WRITE,    // write callback of fd
+    TRACE_TASK,     // a thread_pool task
+    TRACE_ACCEPT,   // a connection arrived on its thread
+    TRACE_PARSE,    // first byte to request parsed, on fd
+    TRACE_HANDLER,  // a = route id
+    TRACE_RESPONSE,  // response queued to written, on fd
+    TRACE_CLOSE,
+    TRACE_EVENTS
+};
+
+enum trace_phase_t { TRACE_BEGIN = 0, TRACE_END, TRACE_INSTANT };
+
+/*
+ * per thread ring of compact binary trace records, for reconstructing
+ * what the threads did around a latency spike.
+ *
+ * emitting is a relaxed load of the switch when tracing is off, and a
+ * timestamp and four relaxed stores into the ring of the thread when it
+ * is on, there are no locks or allocations after the first record of a
+ * thread. the newest SIZE records of each thread are kept and can be
+ * dumped at any time, from any thread, in the chrome trace event format
+ * that chrome://tracing and perfetto load
+ */
+class trace {
+   public:
+    static const size_t SIZE = 8192;  // records per thread, a power of two
+
+   private:
+    struct record {
+        std::atomic<uint64_t> ticks;
+        std::atomic<uint64_t> what;  // event, phase and fd
+        std::atomic<uint64_t> a;
+        std::atomic<uint64_t> b;
+    };
+
+    struct ring {
+        int tid = 0;
+        std::string name;
+        std::atomic<uint64_t> head{0};
+        record records[SIZE];
+    };
+
+    struct registry {
+        std::mutex mutex;
+        std::vector<ring *> rings;  // kept after their threads end
+        std::atomic<bool> enabled{false};
+        int wakefd = -1;  // written by the dump signal handler
+    };
+
+   public:
+    static inline bool on() {
+        return get_registry().enabled.load(std::memory_order_relaxed);
+    }
+    static void enable(bool on) { get_registry().enabled = on; }
+
+    static inline void emit(trace_event_t event, trace_phase_t phase, int fd,
+                            uint64_t a = 0, uint64_t b = 0) {
+        if (!on()) return;
+        ring *r = get_ring();
+        uint64_t i = r->head.load(std::memory_order_relaxed);
+        record &rec = r->records[i & (SIZE - 1)];
+        rec.ticks.store(cycle_clock::now(), std::memory_order_relaxed);
+        rec.what.store(uint64_t(event) | uint64_t(phase) << 16 |
+                           uint64_t(uint32_t(fd)) << 32,
+                       std::memory_order_relaxed);
+        rec.a.store(a, std::memory_order_relaxed);
+        rec.b.store(b, std::memory_order_relaxed);
+        r->head.store(i + 1, std::memory_order_release);
+    }
+
+    /* name of the calling thread in dumps, kept if tracing is enabled later */
+    static void set_thread_name(const std::string &name) {
+        snprintf(thread_name(), NAME_SIZE, "%s", name.c_str());
+        ring *r = current_ring();
+        if (!r) return;
+        std::lock_guard<std::mutex> lock(get_registry().mutex);
+        r->name = name;
+    }
+
+    /* all rings as a chrome trace json object */
+    static std::string dump();
+
+    /*
+     * write dump() to path whenever sig arrives. the handler only wakes a
+     * thread, which does the work outside of signal context
+     */
+    static void dump_on_signal(int sig, const std::string &path);
+
+   private:
+    static registry &get_registry() {
+        static registry *r = new registry;  // used until the process ends
+        return *r;
+    }
+
+    static const int NAME_SIZE = 32;
+
+    static char *thread_name() {
+        static thread_local char name[NAME_SIZE] = "";
+        return name;
+    }
+
+    static ring *&current_ring() {
+        static thread_local ring *r = nullptr;
+        return r;
+    }
+
+    /* the ring of the calling thread, created by its first record */
+    static ring *get_ring() {
+        ring *&r = current_ring();
+        if (r) return r;
+
+        r = new ring;
+        for (auto &rec : r->records) rec.ticks.store(0);
+        registry &reg = get_registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        r->tid = reg.rings.size() + 1;
+        r->name = thread_name()[0] ? thread_name()
+                                   : "thread " + std::to_string(r->tid);
+        reg.rings.push_back(r);
+        return r;
+    }
+
+    static void on_signal(int sig) {
+        char c = 0;
+        ssize_t n = ::write(get_registry().wakefd, &c, 1);
+        (void)n;
+    }
+};
+
+inline std::string trace::dump() {
+    static const char *names[] = {"listen",  "timers",   "read",  "write",
+                                  "task",    "accept",   "parse", "handler",
+                                  "response", "close"};
+    // spans that cross callbacks are async, matched by fd
+    static const bool async[] = {false, false, false, false, false,
+                                 false, true,  false, true,  false};
+
+    struct copy {
+        uint64_t ticks, what, a, b;
+    };
+    struct thread_copy {
+        ring *r;
+        int tid;
+        std::string name;
+        std::vector<copy> recs;
+    };
+
+    registry &reg = get_registry();
+    std::vector<thread_copy> threads;
+    {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        for (ring *r : reg.rings) threads.push_back({r, r->tid, r->name, {}});
+    }
+
+    uint64_t origin = UINT64_MAX;
+    for (size_t t = 0; t < threads.size(); t++) {
+        ring *r = threads[t].r;
+        auto &recs = threads[t].recs;
+        uint64_t end = r->head.load(std::memory_order_acquire);
+        uint64_t begin = end > SIZE ? end - SIZE : 0;
+        for (uint64_t i = begin; i < end; i++) {
+            const record &rec = r->records[i & (SIZE - 1)];
+            recs.push_back({rec.ticks.load(std::memory_order_relaxed),
+                            rec.what.load(std::memory_order_relaxed),
+                            rec.a.load(std::memory_order_relaxed),
+                            rec.b.load(std::memory_order_relaxed)});
+        }
+
+        // the oldest ones may have been overwritten while they were copied,
+        // the slot of head itself may be half written
+        uint64_t after = r->head.load(std::memory_order_acquire);
+        size_t lost = after + 1 > begin + SIZE ? after + 1 - begin - SIZE : 0;
+        recs.erase(recs.begin(), recs.begin() + std::min(lost, recs.size()));
+        for (const copy &c : recs)
+            if (c.ticks && c.ticks < origin) origin = c.ticks;
+    }
+
+    std::string out = "{\"traceEvents\":[";
+    char tmp[320];
+    for (size_t t = 0; t < threads.size(); t++) {
+        const thread_copy &tc = threads[t];
+        snprintf(tmp, sizeof(tmp),
+                 "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":%d,\"args\":{\"name\":\"",
+                 t ? "," : "", tc.tid);
+        out.append(tmp);
+        // the name is the caller's, quoted as a json string
+        for (unsigned char ch : tc.name) {
+            if (ch == '"' || ch == '\\') {
+                out.push_back('\\');
+                out.push_back(ch);
+            } else if (ch < 0x20) {
+                snprintf(tmp, sizeof(tmp), "\\u%04x", ch);
+                out.append(tmp);
+            } else {
+                out.push_back(ch);
+            }
+        }
+        out.append("\"}}");
+
+        for (const copy &c : tc.recs) {
+            int event = c.what & 0xffff, phase = (c.what >> 16) & 0xff;
+            int fd = int32_t(c.what >> 32);
+            if (event >= TRACE_EVENTS || c.ticks < origin) continue;
+
+            const char *ph;
+            if (phase == TRACE_INSTANT)
+                ph = "i";
+            else if (async[event])
+                ph = phase == TRACE_BEGIN ? "b" : "e";
+            else
+                ph = phase == TRACE_BEGIN ? "B" : "E";
+            snprintf(tmp, sizeof(tmp),
+                     ",{\"name\":\"%s\",\"cat\":\"libio\",\"ph\":\"%s\","
+                     "\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"id\":%d%s,"
+                     "\"args\":{\"fd\":%d,\"a\":%llu,\"b\":%llu}}",
+                     names[event], ph,
+                     cycle_clock::to_ns(c.ticks - origin) / 1000.0, tc.tid,
+                     fd, phase == TRACE_INSTANT ? ",\"s\":\"t\"" : "", fd,
+                     (unsigned long long)c.a, (unsigned long long)c.b);
+            out.append(tmp);
+        }
+    }
+    out.append("]}");
+    return out;
+}
+
+inline void trace::dump_on_signal(int sig, const std::string &path) {
+    registry &reg = get_registry();
+    int fds[2];
+    if (reg.wakefd >= 0 || pipe2(fds, O_CLOEXEC) == -1) return;
+    reg.wakefd = fds[1];
+
+    std::thread([fds, path]() {
+        char c;
+        while (::read(fds[0], &c, 1) == 1) {
+            std::string s = dump();
+            FILE *f = fopen(path.c_str(), "w");
+            if (!f) continue;
+            fwrite(s.data(), 1, s.size(), f);
+            fclose(f);
+        }
+    }).detach();
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, nullptr);
+}
+
+}  // namespace wxg
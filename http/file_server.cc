@@ -0,0 +1,534 @@
+#include "file_server.hh"
+#include "http_connection.hh"
+#include "http_thread.hh"
+
+#include <core/thread.hh>
+#include <core/time.hh>
+
+#include <zlib.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace wxg {
+
+/* what a thread keeps for one file_server */
+struct file_cache {
+    // sidecars apart, looking one up never evicts the entry it goes with
+    std::unordered_map<std::string, cached_file> files[2];
+    cached_file uncached[2];
+
+    std::unordered_map<std::string, cached_file> gzipped;
+    size_t gzippedBytes = 0;
+    std::unordered_set<std::string> compressing;  // handed to the compressor
+};
+
+file_server::file_server(const std::string& root)
+    : root(root), compressor(std::make_unique<thread_pool>(1)) {
+    static std::atomic<int> ids{0};
+    id = ids++;
+    types = {{"html", "text/html; charset=utf-8"},
+             {"css", "text/css; charset=utf-8"},
+             {"xml", "text/xml; charset=utf-8"},
+             {"txt", "text/plain; charset=utf-8"},
+             {"png", "image/png"},
+             {"jpg", "image/jpeg"},
+             {"mp4", "video/mp4"},
+             {"js", "application/javascript"}};
+}
+
+file_server::~file_server() {}
+
+file_cache& file_server::local() const {
+    static thread_local std::unordered_map<int, std::unique_ptr<file_cache>>
+        caches;
+    auto& c = caches[id];
+    if (!c) c = std::make_unique<file_cache>();
+    return *c;
+}
+
+void file_server::set_type(const std::string& ext, const std::string& type) {
+    types[ext] = type;
+}
+
+const std::string& file_server::content_type(const std::string& path) const {
+    static const std::string fallback = "text/html; charset=utf-8";
+
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+        return fallback;
+    auto it = types.find(path.substr(dot + 1));
+    return it == types.end() ? fallback : it->second;
+}
+
+/* a path must not climb out of root */
+static bool safe_path(const std::string& path) {
+    size_t i = 0;
+    while (i < path.size()) {
+        size_t end = path.find('/', i);
+        if (end == std::string::npos) end = path.size();
+        if (end - i == 2 && path[i] == '.' && path[i + 1] == '.') return false;
+        i = end + 1;
+    }
+    return true;
+}
+
+static bool same_file(const struct stat& a, const struct stat& b) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev &&
+           a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+static void set_validators(cached_file& c, const std::string& etag) {
+    c.etag = etag;
+    c.modified = time::format_date(c.f->st.st_mtime);
+    c.notModified = "ETag: " + c.etag + "\r\nLast-Modified: " + c.modified +
+                    "\r\nVary: Accept-Encoding\r\n\r\n";
+}
+
+const cached_file* file_server::lookup(const std::string& path,
+                                       const char* encoding) const {
+    file_cache& local = this->local();
+    auto& cache = local.files[encoding != nullptr];
+
+    time_t now = std::time(nullptr);
+    auto it = cache.find(path);
+    if (it != cache.end()) {
+        cached_file& c = it->second;
+        if (c.checked == now) return c.f ? &c : nullptr;
+
+        struct stat st;
+        if (c.f && stat(path.c_str(), &st) == 0 && same_file(st, c.f->st)) {
+            c.checked = now;
+            return &c;
+        }
+        cache.erase(it);
+    }
+
+    auto f = file::open(path);
+    if (!f && !encoding) return nullptr;
+
+    cached_file* c = &local.uncached[encoding != nullptr];
+    if (maxCached > 0) {
+        if (cache.size() >= maxCached) cache.erase(cache.begin());
+        c = &cache[path];
+    } else if (!f) {
+        return nullptr;
+    }
+
+    c->checked = now;
+    c->f = std::move(f);
+    if (!c->f) return nullptr;  // a missing sidecar is checked once a second
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"", (long)c->f->st.st_ino,
+             (long)c->f->st.st_size, (long)c->f->st.st_mtime);
+    c->encoding = encoding;
+    set_validators(*c, etag);
+    return c;
+}
+
+/* q value of coding in an Accept-Encoding list, 0 when not acceptable */
+static double accepts(const string_ref& list, const string_ref& coding) {
+    double any = 0;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == string_ref::npos) comma = list.size();
+        string_ref item = trim_ref(list.substr(pos, comma - pos));
+        pos = comma + 1;
+
+        size_t semi = item.find(';');
+        string_ref name = trim_ref(item.substr(0, semi));
+        double q = 1;
+        if (semi != string_ref::npos) {
+            string_ref param = trim_ref(item.substr(semi + 1));
+            if (param.starts_with("q=") && param.size() < 16) {
+                char value[16];
+                std::memcpy(value, param.data() + 2, param.size() - 2);
+                value[param.size() - 2] = '\0';
+                q = std::strtod(value, nullptr);
+            }
+        }
+
+        if (equal_nocase(name, coding)) return q;
+        if (name == "*") any = q;
+    }
+    return any;
+}
+
+static bool compressible(const std::string& type) {
+    string_ref t(type);
+    return t.starts_with("text/") || t.starts_with("application/javascript") ||
+           t.starts_with("application/json") ||
+           t.starts_with("application/xml") || t.starts_with("image/svg");
+}
+
+/* deflate stream of a thread, reset between files */
+struct deflater {
+    z_stream zs;
+    int level = -1;
+
+    ~deflater() {
+        if (level >= 0) deflateEnd(&zs);
+    }
+
+    bool reset(int l) {
+        if (level == l) return deflateReset(&zs) == Z_OK;
+        if (level >= 0) deflateEnd(&zs);
+        level = -1;
+        zs = z_stream();
+        if (deflateInit2(&zs, l, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+            Z_OK)
+            return false;
+        level = l;
+        return true;
+    }
+};
+
+static std::shared_ptr<std::string> gzip_file(const file& f, int level) {
+    thread_local deflater d;
+    thread_local std::string in;
+
+    in.resize(f.size());
+    for (size_t done = 0; done < in.size();) {
+        ssize_t n = pread(f.fd, &in[done], in.size() - done, done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return nullptr;
+        done += n;
+    }
+
+    if (!d.reset(level)) return nullptr;
+    auto out = std::make_shared<std::string>();
+    out->resize(deflateBound(&d.zs, in.size()));
+    d.zs.next_in = (Bytef*)in.data();
+    d.zs.avail_in = in.size();
+    d.zs.next_out = (Bytef*)&(*out)[0];
+    d.zs.avail_out = out->size();
+    if (deflate(&d.zs, Z_FINISH) != Z_STREAM_END) return nullptr;
+    out->resize(d.zs.total_out);
+    return out;
+}
+
+/*
+ * keep the gzip'ed body of f under path, in the loop of the thread that
+ * asked for it. an incompressible file, or one whose body is over the
+ * limit, is remembered as such and served as is
+ */
+static void store_gzipped(file_cache& local, const std::string& path,
+                          const std::shared_ptr<const file>& f,
+                          const std::string& etag,
+                          std::shared_ptr<std::string> data, size_t limit) {
+    local.compressing.erase(path);
+    if (data && data->size() > limit) data = nullptr;
+
+    auto& cache = local.gzipped;
+    auto it = cache.find(path);
+    if (it != cache.end()) {
+        if (it->second.data) local.gzippedBytes -= it->second.data->size();
+        cache.erase(it);
+    }
+
+    size_t bytes = data ? data->size() : 0;
+    while (!cache.empty() && local.gzippedBytes + bytes > limit) {
+        auto victim = cache.begin();
+        if (victim->second.data)
+            local.gzippedBytes -= victim->second.data->size();
+        cache.erase(victim);
+    }
+    cached_file& z = cache[path];
+    local.gzippedBytes += bytes;
+
+    z.f = f;
+    z.data = std::move(data);
+    if (!z.data) return;
+
+    z.encoding = "gzip";
+    std::string tag = etag;
+    tag.insert(tag.size() - 1, "-gz");
+    set_validators(z, tag);
+}
+
+const cached_file* file_server::compressed(http_connection* conn,
+                                           const std::string& path,
+                                           const cached_file& c) const {
+    file_cache& local = this->local();
+    auto it = local.gzipped.find(path);
+    if (it != local.gzipped.end()) {
+        if (same_file(it->second.f->st, c.f->st))
+            return it->second.data ? &it->second : nullptr;
+        if (it->second.data) local.gzippedBytes -= it->second.data->size();
+        local.gzipped.erase(it);
+    }
+
+    // reading and deflating stay off the loop, one job per path at a time
+    if (!local.compressing.insert(path).second) return nullptr;
+
+    auto f = c.f;
+    std::string etag = c.etag;
+    int level = gzipLevel;
+    size_t limit = compressCacheBytes;
+    http_thread* thread = conn->thread;
+    file_cache* cache = &local;
+    compressor->push([=]() {
+        auto data = gzip_file(*f, level);
+        if (data && data->size() >= (size_t)f->size()) data = nullptr;
+        thread->run_in_loop([=]() {
+            store_gzipped(*cache, path, f, etag, data, limit);
+        });
+    });
+    return nullptr;
+}
+
+const cached_file* file_server::negotiate(request* req, http_connection* conn,
+                                          const std::string& path,
+                                          const cached_file& c,
+                                          const std::string& type) const {
+    const std::string& accept = req->get_header("Accept-Encoding");
+    if (accept.empty()) return &c;
+
+    double br = accepts(accept, "br"), gz = accepts(accept, "gzip");
+    const cached_file* z = nullptr;
+    if (br > 0 && br >= gz) z = lookup(path + ".br", "br");
+    if (!z && gz > 0) z = lookup(path + ".gz", "gzip");
+    if (!z && gz > 0 && gzipLevel > 0 && compressible(type) &&
+        (size_t)c.f->size() >= minCompress &&
+        (size_t)c.f->size() <= maxCompress)
+        z = compressed(conn, path, c);
+    if (!z && br > 0 && br < gz) z = lookup(path + ".br", "br");
+    return z ? z : &c;
+}
+
+/* weak comparison against a list of entity tags */
+static bool etag_match(const string_ref& list, const std::string& etag) {
+    if (trim_ref(list) == "*") return true;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == string_ref::npos) comma = list.size();
+        string_ref tag = trim_ref(list.substr(pos, comma - pos));
+        pos = comma + 1;
+        if (tag.starts_with("W/")) tag = tag.substr(2);
+        if (tag == etag) return true;
+    }
+    return false;
+}
+
+/* If-None-Match wins over If-Modified-Since when both are sent */
+bool file_server::not_modified(request* req, const cached_file& c) const {
+    const std::string& tags = req->get_header("If-None-Match");
+    if (!tags.empty()) return etag_match(tags, c.etag);
+
+    const std::string& since = req->get_header("If-Modified-Since");
+    if (since.empty()) return false;
+    if (since == c.modified) return true;
+
+    time_t t = time::parse_date(since);
+    return t != -1 && c.f->st.st_mtime <= t;
+}
+
+void file_server::send_not_modified(http_connection* conn,
+                                    const cached_file& c) const {
+    thread_local std::string head;
+    thread_local std::string date;
+
+    const std::string& now = time::get_date();
+    if (date != now) {
+        date = now;
+        head = "HTTP/1.1 304 Not Modified\r\nDate: " + date + "\r\n";
+    }
+    // closing after a Connection: close request or an error
+    static const std::string keepAlive = "Connection: keep-alive\r\n";
+    static const std::string close = "Connection: close\r\n";
+    const std::string& connection = conn->status == CLOSING ? close : keepAlive;
+    conn->send_data(head.data(), head.size());
+    conn->send_data(connection.data(), connection.size());
+    conn->send_data(c.notModified.data(), c.notModified.size());
+}
+
+void file_server::serve(request* req, http_connection* conn,
+                        const std::string& path) const {
+    std::string full = root + path;
+    const cached_file* c = safe_path(path) ? lookup(full) : nullptr;
+    if (!c) {
+        conn->send_reply(HTTP_NOTFOUND, "Not Found");
+        return;
+    }
+
+    const std::string& type = content_type(path);
+    c = negotiate(req, conn, full, *c, type);
+    if (not_modified(req, *c)) {
+        send_not_modified(conn, *c);
+        return;
+    }
+
+    const auto& f = c->f;
+    off_t size = c->size();
+    bool head = req->type == HEAD;
+
+    // a body compressed here is always sent whole
+    if (c->data) {
+        auto r = conn->thread->get_response();
+        r->set_response(HTTP_OK, "OK");
+        r->set_header("Content-Length", std::to_string(size));
+        r->set_header("Content-Type", type);
+        r->set_header("Content-Encoding", c->encoding);
+        r->set_header("Vary", "Accept-Encoding");
+        r->set_header("ETag", c->etag);
+        r->set_header("Last-Modified", c->modified);
+        conn->send_request(r.get());
+        conn->thread->release_request(std::move(r));
+        if (!head) conn->send_data(c->data);
+        return;
+    }
+
+    thread_local std::vector<byte_range> ranges;
+    int status = 0;
+    const std::string& range = req->get_header("Range");
+    if (!range.empty()) {
+        // a stale If-Range asks for the whole new file instead
+        const std::string& cond = req->get_header("If-Range");
+        if (cond.empty() || cond == c->etag || cond == c->modified)
+            status = parse_range(range, size, ranges);
+    }
+
+    auto r = conn->thread->get_response();
+    if (status == -1) {
+        r->set_response(HTTP_RANGENOTSATISFIABLE, "Range Not Satisfiable");
+        r->set_header("Content-Range", "bytes */" + std::to_string(size));
+        conn->send_request(r.get());
+        conn->thread->release_request(std::move(r));
+        return;
+    }
+    if (status == 1 && ranges.size() > 1) {
+        conn->thread->release_request(std::move(r));
+        send_ranges(conn, *c, type, ranges, head);
+        return;
+    }
+
+    byte_range whole = {0, size - 1};
+    const byte_range& part = status == 1 ? ranges[0] : whole;
+
+    if (status == 1) {
+        r->set_response(HTTP_PARTIAL, "Partial Content");
+        r->set_header("Content-Range", "bytes " + std::to_string(part.first) +
+                                           "-" + std::to_string(part.last) +
+                                           "/" + std::to_string(size));
+    } else {
+        r->set_response(HTTP_OK, "OK");
+    }
+    r->set_header("Content-Length", std::to_string(part.length()));
+    r->set_header("Content-Type", type);
+    if (c->encoding) r->set_header("Content-Encoding", c->encoding);
+    r->set_header("Vary", "Accept-Encoding");
+    r->set_header("Accept-Ranges", "bytes");
+    r->set_header("ETag", c->etag);
+    r->set_header("Last-Modified", c->modified);
+    conn->send_request(r.get());
+    conn->thread->release_request(std::move(r));
+
+    if (!head) conn->send_file(f, part.first, part.length());
+}
+
+/*
+ * every part is its headers followed by the range, the total length is
+ * known up front so the response is not chunked
+ */
+void file_server::send_ranges(http_connection* conn, const cached_file& c,
+                              const std::string& type,
+                              const std::vector<byte_range>& ranges,
+                              bool head) const {
+    const auto& f = c.f;
+    thread_local unsigned long sequence = 0;
+    char boundary[24];
+    snprintf(boundary, sizeof(boundary), "%020lu", ++sequence);
+
+    std::string size = std::to_string(f->size());
+    std::vector<std::string> parts(ranges.size());
+    size_t length = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        std::string& p = parts[i];
+        p.append("\r\n--").append(boundary).append("\r\n");
+        p.append("Content-Type: ").append(type).append("\r\n");
+        p.append("Content-Range: bytes ");
+        append_int(p, ranges[i].first);
+        p.push_back('-');
+        append_int(p, ranges[i].last);
+        p.append("/").append(size).append("\r\n\r\n");
+        length += p.size() + ranges[i].length();
+    }
+    std::string last = std::string("\r\n--") + boundary + "--\r\n";
+    length += last.size();
+
+    auto r = conn->thread->get_response();
+    r->set_response(HTTP_PARTIAL, "Partial Content");
+    r->set_header("Content-Length", std::to_string(length));
+    r->set_header("Content-Type",
+                  std::string("multipart/byteranges; boundary=") + boundary);
+    if (c.encoding) r->set_header("Content-Encoding", c.encoding);
+    r->set_header("Vary", "Accept-Encoding");
+    r->set_header("Accept-Ranges", "bytes");
+    r->set_header("ETag", c.etag);
+    r->set_header("Last-Modified", c.modified);
+    conn->send_request(r.get());
+    conn->thread->release_request(std::move(r));
+    if (head) return;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        conn->send_data(parts[i].data(), parts[i].size());
+        conn->send_file(f, ranges[i].first, ranges[i].length());
+    }
+    conn->send_data(last.data(), last.size());
+}
+
+int file_server::parse_range(const string_ref& value, off_t size,
+                             std::vector<byte_range>& ranges) {
+    ranges.clear();
+
+    string_ref v = trim_ref(value);
+    if (!v.starts_with("bytes=")) return 0;
+    v = v.substr(6);
+
+    int specs = 0;
+    size_t pos = 0;
+    while (pos < v.size()) {
+        size_t comma = v.find(',', pos);
+        if (comma == string_ref::npos) comma = v.size();
+        string_ref spec = trim_ref(v.substr(pos, comma - pos));
+        pos = comma + 1;
+        if (spec.empty()) continue;
+        if (++specs > MAX_RANGES) return 0;
+
+        size_t dash = spec.find('-');
+        if (dash == string_ref::npos) return 0;
+        string_ref a = trim_ref(spec.substr(0, dash));
+        string_ref b = trim_ref(spec.substr(dash + 1));
+
+        byte_range range;
+        if (a.empty()) {  // suffix: the last b bytes
+            long n = to_long(b);
+            if (n < 0) return 0;
+            if (n == 0 || size == 0) continue;
+            range.first = n >= size ? 0 : size - n;
+            range.last = size - 1;
+        } else {
+            range.first = to_long(a);
+            range.last = b.empty() ? range.first : to_long(b);
+            if (range.first < 0 || range.last < range.first) return 0;
+            if (range.first >= size) continue;
+            if (b.empty() || range.last >= size) range.last = size - 1;
+        }
+        ranges.push_back(range);
+    }
+
+    if (specs == 0) return 0;
+    return ranges.empty() ? -1 : 1;
+}
+
+}  // namespace wxg
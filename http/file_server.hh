@@ -0,0 +1,138 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <core/file.hh>
+#include <core/string.hh>
+
+#include "http.hh"
+
+namespace wxg {
+
+class request;
+class http_connection;
+class thread_pool;
+struct file_cache;
+
+/* inclusive byte range of a file */
+struct byte_range {
+    off_t first;
+    off_t last;
+
+    inline off_t length() const { return last - first + 1; }
+};
+
+/*
+ * an open file with its validators, formatted once when it is opened.
+ * notModified is the tail of the 304 response after Date and Connection.
+ * a file compressed on the fly keeps its source in f and the body in data
+ */
+struct cached_file {
+    std::shared_ptr<const file> f;
+    std::shared_ptr<const std::string> data;
+    const char* encoding = nullptr;  // Content-Encoding, null for identity
+    std::string etag;
+    std::string modified;
+    std::string notModified;
+    time_t checked = 0;  // last stat of the path
+
+    inline off_t size() const { return data ? data->size() : f->size(); }
+};
+
+/*
+ * static files under a root directory. a Range request is answered with
+ * 206, one range straight from the file with sendfile, several ranges as
+ * multipart/byteranges whose parts are sendfile segments too.
+ *
+ * every thread keeps its own cache of open files with their validators
+ * for each file_server, a path is stat'ed again at most once a second. a
+ * conditional request matching the cache is answered with a pre-serialized
+ * 304 without touching the file.
+ *
+ * with Accept-Encoding a .br or .gz file next to the requested one is
+ * sent instead. without one, text is gzip'ed on a thread of the server's
+ * own and sent as is until the result is back in a per-thread cache of at
+ * most compressCacheBytes
+ */
+class file_server {
+   private:
+    std::string root;
+    std::map<std::string, std::string> types;
+    size_t maxCached = 256;
+    int id;  // key of the per-thread caches
+
+    int gzipLevel = 6;
+    size_t minCompress = 256;
+    size_t maxCompress = 1 << 20;
+    size_t compressCacheBytes = 16 << 20;
+    std::unique_ptr<thread_pool> compressor;
+
+   public:
+    static const int MAX_RANGES = 16;  // more are served as the whole file
+
+   public:
+    file_server(const std::string& root);
+    ~file_server();
+
+    /* content type by file extension, without the dot */
+    void set_type(const std::string& ext, const std::string& type);
+
+    /* open files kept per thread, 0 disables the cache */
+    void set_cache_size(size_t n) { maxCached = n; }
+
+    /*
+     * zlib level for on the fly compression, 0 disables it. compressed
+     * bodies are cached up to cacheBytes per thread
+     */
+    void set_compression(int level, size_t cacheBytes) {
+        gzipLevel = level;
+        compressCacheBytes = cacheBytes;
+    }
+
+    /* send the file at path under root, 404 when it is missing */
+    void serve(request* req, http_connection* conn,
+               const std::string& path) const;
+
+    /*
+     * parse a Range header value for a file of size bytes, 1 with the
+     * satisfiable ranges filled in, 0 when the header is to be ignored,
+     * -1 when no range is satisfiable
+     */
+    static int parse_range(const string_ref& value, off_t size,
+                           std::vector<byte_range>& ranges);
+
+   private:
+    const std::string& content_type(const std::string& path) const;
+    /* caches of this file_server on the calling thread */
+    file_cache& local() const;
+
+    /*
+     * cache entry of path, opened or refreshed as needed. a sidecar is
+     * looked up with its encoding, it is remembered when missing too
+     */
+    const cached_file* lookup(const std::string& path,
+                              const char* encoding = nullptr) const;
+    /* representation for the Accept-Encoding of req, c for identity */
+    const cached_file* negotiate(request* req, http_connection* conn,
+                                 const std::string& path, const cached_file& c,
+                                 const std::string& type) const;
+    /*
+     * c compressed with gzip, null when that does not pay or is not done
+     * yet. a miss hands the file to the compressor, the result goes to the
+     * cache of the thread of conn
+     */
+    const cached_file* compressed(http_connection* conn,
+                                  const std::string& path,
+                                  const cached_file& c) const;
+    bool not_modified(request* req, const cached_file& c) const;
+    void send_not_modified(http_connection* conn, const cached_file& c) const;
+
+    void send_ranges(http_connection* conn, const cached_file& c,
+                     const std::string& type,
+                     const std::vector<byte_range>& ranges, bool head) const;
+};
+
+}  // namespace wxg
@@ -0,0 +1,445 @@
+#include "hpack.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace wxg {
+
+/* rfc 7541 appendix a */
+static const char *const STATIC_TABLE[61][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+};
+
+/* rfc 7541 appendix b, the last code is EOS */
+static const uint32_t HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+static const uint8_t HUFFMAN_BITS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+/*
+ * decoding walks the code tree 4 bits at a time. a state is an inner
+ * node of the tree, for each state and nibble the table holds the node
+ * reached, the symbol completed on the way and whether the bits so far
+ * could be padding. no code is shorter than 5 bits, so a nibble
+ * completes at most one symbol
+ */
+struct huffman_step {
+    uint8_t next;
+    uint8_t symbol;
+    uint8_t flags;
+};
+
+enum { STEP_EMIT = 1, STEP_ACCEPT = 2, STEP_FAIL = 4 };
+
+struct huffman_machine {
+    huffman_step steps[256][16];
+
+    huffman_machine() {
+        // inner nodes, a child below 0 is the leaf of symbol -child - 1
+        int child[256][2];
+        int ones[256];  // length of the all 1s path to a node, or -1
+        int nodes = 1;
+        std::memset(child, 0, sizeof(child));
+        ones[0] = 0;
+
+        for (int sym = 0; sym < 257; sym++) {
+            int node = 0;
+            for (int i = HUFFMAN_BITS[sym] - 1; i >= 0; i--) {
+                int bit = HUFFMAN_CODES[sym] >> i & 1;
+                if (i == 0) {
+                    child[node][bit] = -sym - 1;
+                    break;
+                }
+                if (child[node][bit] == 0) {
+                    ones[nodes] = bit && ones[node] >= 0 ? ones[node] + 1 : -1;
+                    child[node][bit] = nodes++;
+                }
+                node = child[node][bit];
+            }
+        }
+
+        for (int state = 0; state < nodes; state++) {
+            for (int nibble = 0; nibble < 16; nibble++) {
+                huffman_step &step = steps[state][nibble];
+                step = huffman_step{0, 0, 0};
+                int node = state;
+                for (int i = 3; i >= 0; i--) {
+                    int next = child[node][nibble >> i & 1];
+                    if (next >= 0) {
+                        node = next;
+                        continue;
+                    }
+                    if (next == -257) step.flags |= STEP_FAIL;
+                    step.symbol = -next - 1;
+                    step.flags |= STEP_EMIT;
+                    node = 0;
+                }
+                step.next = node;
+                if (ones[node] >= 0 && ones[node] < 8)
+                    step.flags |= STEP_ACCEPT;
+            }
+        }
+    }
+};
+
+bool huffman::decode(const unsigned char *p, size_t n, std::string &out) {
+    static const huffman_machine machine;
+
+    int state = 0;
+    bool accept = true;
+    for (size_t i = 0; i < n; i++) {
+        for (int nibble : {p[i] >> 4, p[i] & 15}) {
+            const huffman_step &step = machine.steps[state][nibble];
+            if (step.flags & STEP_FAIL) return false;
+            if (step.flags & STEP_EMIT) out.push_back((char)step.symbol);
+            state = step.next;
+            accept = step.flags & STEP_ACCEPT;
+        }
+    }
+    return accept;
+}
+
+size_t huffman::encoded_length(const string_ref &s) {
+    size_t bits = 0;
+    for (char c : s) bits += HUFFMAN_BITS[(unsigned char)c];
+    return (bits + 7) / 8;
+}
+
+void huffman::encode(const string_ref &s, std::string &out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (char c : s) {
+        unsigned char sym = c;
+        acc = acc << HUFFMAN_BITS[sym] | HUFFMAN_CODES[sym];
+        bits += HUFFMAN_BITS[sym];
+        while (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    if (bits > 0)  // padded with the high bits of EOS
+        out.push_back((char)(acc << (8 - bits) | 0xFF >> bits));
+}
+
+const std::pair<std::string, std::string> *hpack_table::get(
+    size_t index) const {
+    static const std::deque<std::pair<std::string, std::string>> fixed = [] {
+        std::deque<std::pair<std::string, std::string>> t;
+        for (auto &e : STATIC_TABLE) t.emplace_back(e[0], e[1]);
+        return t;
+    }();
+
+    if (index == 0) return nullptr;
+    if (index <= STATIC_ENTRIES) return &fixed[index - 1];
+    index -= STATIC_ENTRIES + 1;
+    return index < entries.size() ? &entries[index] : nullptr;
+}
+
+void hpack_table::evict(size_t room) {
+    while (!entries.empty() && size_ + room > maxSize) {
+        auto &e = entries.back();
+        size_ -= e.first.size() + e.second.size() + ENTRY_OVERHEAD;
+        entries.pop_back();
+    }
+}
+
+void hpack_table::add(const string_ref &name, const string_ref &value) {
+    size_t n = name.size() + value.size() + ENTRY_OVERHEAD;
+    evict(n);
+    if (n > maxSize) return;  // too large, the table is empty now
+
+    entries.emplace_front(name.str(), value.str());
+    size_ += n;
+}
+
+void hpack_table::set_max_size(size_t n) {
+    maxSize = n;
+    evict(0);
+}
+
+size_t hpack_table::find(const string_ref &name, const string_ref &value,
+                         bool &valueToo) const {
+    size_t nameOnly = 0;
+    valueToo = false;
+    for (size_t i = 0; i < STATIC_ENTRIES; i++) {
+        if (name != STATIC_TABLE[i][0]) continue;
+        if (value == STATIC_TABLE[i][1]) {
+            valueToo = true;
+            return i + 1;
+        }
+        if (!nameOnly) nameOnly = i + 1;
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (name != entries[i].first) continue;
+        if (value == entries[i].second) {
+            valueToo = true;
+            return STATIC_ENTRIES + 1 + i;
+        }
+        if (!nameOnly) nameOnly = STATIC_ENTRIES + 1 + i;
+    }
+    return nameOnly;
+}
+
+/* integer with an n bit prefix, rfc 7541 5.1. -1 when cut off or huge */
+static long read_int(const unsigned char *&p, const unsigned char *end,
+                     int n) {
+    if (p == end) return -1;
+    long mask = (1 << n) - 1;
+    long v = *p++ & mask;
+    if (v < mask) return v;
+
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (p == end) return -1;
+        unsigned char b = *p++;
+        v += (long)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    return -1;
+}
+
+static void write_int(std::string &out, int first, int n, size_t v) {
+    size_t mask = (1 << n) - 1;
+    if (v < mask) {
+        out.push_back((char)(first | v));
+        return;
+    }
+    out.push_back((char)(first | mask));
+    for (v -= mask; v >= 0x80; v >>= 7)
+        out.push_back((char)((v & 0x7F) | 0x80));
+    out.push_back((char)v);
+}
+
+int hpack_decoder::read_string(const unsigned char *&p,
+                               const unsigned char *end, std::string &out) {
+    if (p == end) return -1;
+    bool coded = *p & 0x80;
+    long n = read_int(p, end, 7);
+    if (n < 0 || n > end - p) return -1;
+
+    out.clear();
+    if (coded) {
+        if (!huffman::decode(p, n, out)) return -1;
+    } else {
+        out.assign((const char *)p, n);
+    }
+    p += n;
+    return 0;
+}
+
+int hpack_decoder::decode(const unsigned char *p, size_t n,
+                          const FieldHandler &field) {
+    const unsigned char *end = p + n;
+    bool fields = false;  // size updates only come first
+    size_t listSize = 0;
+    auto emit = [&](const std::string &name, const std::string &value) {
+        listSize += name.size() + value.size() + hpack_table::ENTRY_OVERHEAD;
+        if (!maxListSize || listSize <= maxListSize) field(name, value);
+        fields = true;
+    };
+
+    while (p < end) {
+        unsigned char b = *p;
+
+        if (b & 0x80) {  // indexed
+            auto e = table.get(read_int(p, end, 7));
+            if (!e) return -1;
+            emit(e->first, e->second);
+            continue;
+        }
+
+        if ((b & 0xE0) == 0x20) {  // dynamic table size update
+            long size = read_int(p, end, 5);
+            if (fields || size < 0 || (size_t)size > maxTableSize) return -1;
+            table.set_max_size(size);
+            continue;
+        }
+
+        // literal, added to the table with 01, else with 0000 or 0001
+        bool add = (b & 0xC0) == 0x40;
+        long index = read_int(p, end, add ? 6 : 4);
+        if (index < 0) return -1;
+        if (index > 0) {
+            auto e = table.get(index);
+            if (!e) return -1;
+            name = e->first;
+        } else if (read_string(p, end, name) == -1) {
+            return -1;
+        }
+        if (read_string(p, end, value) == -1) return -1;
+
+        if (add) table.add(name, value);
+        emit(name, value);
+    }
+    return maxListSize && listSize > maxListSize ? -2 : 0;
+}
+
+void hpack_encoder::set_max_table_size(size_t n) {
+    n = std::min(n, (size_t)4096);
+    if (n == table.max_size()) return;
+    table.set_max_size(n);
+    sizeChanged = true;
+}
+
+void hpack_encoder::begin(std::string &out) {
+    if (!sizeChanged) return;
+    write_int(out, 0x20, 5, table.max_size());
+    sizeChanged = false;
+}
+
+bool hpack_encoder::indexable(const string_ref &name) {
+    static const char *const volatiles[] = {
+        "content-length", "content-range", "date", "etag", "last-modified",
+        "set-cookie", "age"};
+    for (auto v : volatiles)
+        if (name == v) return false;
+    return true;
+}
+
+void hpack_encoder::write_string(std::string &out, const string_ref &s) {
+    size_t coded = huffman::encoded_length(s);
+    if (coded < s.size()) {
+        write_int(out, 0x80, 7, coded);
+        huffman::encode(s, out);
+    } else {
+        write_int(out, 0, 7, s.size());
+        out.append(s.data(), s.size());
+    }
+}
+
+void hpack_encoder::encode(std::string &out, const string_ref &name,
+                           const string_ref &value) {
+    bool valueToo;
+    size_t index = table.find(name, value, valueToo);
+    if (valueToo) {
+        write_int(out, 0x80, 7, index);
+        return;
+    }
+
+    bool add = indexable(name);
+    write_int(out, add ? 0x40 : 0, add ? 6 : 4, index);
+    if (!index) write_string(out, name);
+    write_string(out, value);
+    if (add) table.add(name, value);
+}
+
+}  // namespace wxg
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+
+#include <core/string.hh>
+
+namespace wxg {
+
+/* a decoded field, name and value are only valid during the call */
+using FieldHandler =
+    std::function<void(const std::string &name, const std::string &value)>;
+
+/* the canonical code of rfc 7541 appendix b */
+class huffman {
+   public:
+    /* false on a code for EOS or padding that is not a short run of 1s */
+    static bool decode(const unsigned char *p, size_t n, std::string &out);
+
+    static size_t encoded_length(const string_ref &s);
+    static void encode(const string_ref &s, std::string &out);
+};
+
+/*
+ * static table followed by the dynamic one, rfc 7541 2.3. index 1 is
+ * the first static entry, STATIC_ENTRIES + 1 the newest dynamic one
+ */
+class hpack_table {
+   private:
+    std::deque<std::pair<std::string, std::string>> entries;  // newest first
+    size_t size_ = 0;
+    size_t maxSize = 4096;
+
+   public:
+    static const size_t STATIC_ENTRIES = 61;
+    static const size_t ENTRY_OVERHEAD = 32;
+
+    /* null for an index out of both tables */
+    const std::pair<std::string, std::string> *get(size_t index) const;
+
+    void add(const string_ref &name, const string_ref &value);
+    void set_max_size(size_t n);
+    inline size_t max_size() const { return maxSize; }
+
+    /*
+     * index of an entry with name and value, else of one with name and
+     * valueToo false, 0 for none
+     */
+    size_t find(const string_ref &name, const string_ref &value,
+                bool &valueToo) const;
+
+   private:
+    void evict(size_t room);
+};
+
+class hpack_decoder {
+   private:
+    hpack_table table;
+    size_t maxTableSize = 4096;  // limit we announced
+    size_t maxListSize = 0;      // 0 for no limit
+    std::string name, value;
+
+   public:
+    /*
+     * limit of a decoded header list, names and values with 32 bytes of
+     * overhead each as in SETTINGS_MAX_HEADER_LIST_SIZE
+     */
+    inline void set_max_list_size(size_t n) { maxListSize = n; }
+
+    /*
+     * decode one complete header block, -1 on a compression error. a
+     * list over the limit is decoded to the end to keep the table in
+     * step, fields past the limit are dropped and -2 is returned
+     */
+    int decode(const unsigned char *p, size_t n, const FieldHandler &field);
+
+   private:
+    int read_string(const unsigned char *&p, const unsigned char *end,
+                    std::string &out);
+};
+
+/*
+ * fields go out indexed when the table has them, as literals added to
+ * the dynamic table otherwise. values that change from one message to
+ * the next are never added, they would only push out the others
+ */
+class hpack_encoder {
+   private:
+    hpack_table table;
+    bool sizeChanged = false;
+
+   public:
+    /* SETTINGS_HEADER_TABLE_SIZE of the peer, at most 4096 is used */
+    void set_max_table_size(size_t n);
+
+    /* start a header block */
+    void begin(std::string &out);
+    void encode(std::string &out, const string_ref &name,
+                const string_ref &value);
+
+   private:
+    static bool indexable(const string_ref &name);
+    static void write_string(std::string &out, const string_ref &s);
+};
+
+}  // namespace wxg
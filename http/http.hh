@@ -2,17 +2,26 @@
 
 namespace wxg {
 
+enum request_type_t { GET = 0, POST, HEAD };
+
 /* Response codes */
 
 enum http_code_t {
+    HTTP_SWITCHING = 101,
     HTTP_OK = 200,
     HTTP_NOCONTENT = 204,
+    HTTP_PARTIAL = 206,
     HTTP_MOVEPERM = 301,
     HTTP_MOVETEMP = 302,
     HTTP_NOTMODIFIED = 304,
     HTTP_BADREQUEST = 400,
     HTTP_NOTFOUND = 404,
-    HTTP_SERVUNAVAIL = 503
+    HTTP_RANGENOTSATISFIABLE = 416,
+    HTTP_UPGRADEREQUIRED = 426,
+    HTTP_NOTIMPLEMENTED = 501,
+    HTTP_BADGATEWAY = 502,
+    HTTP_SERVUNAVAIL = 503,
+    HTTP_GATEWAYTIMEOUT = 504
 };
 
 }  // namespace wxg
@@ -0,0 +1,844 @@
+#include "http2.hh"
+#include "http_connection.hh"
+#include "http_thread.hh"
+
+#include <core/string.hh>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace wxg {
+
+const char http2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+static const int64_t MAX_WINDOW = 0x7FFFFFFF;
+
+static inline uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* fields of http/1.1 connection management, not allowed in http/2 */
+static bool connection_field(const string_ref &name) {
+    return equal_nocase(name, "connection") ||
+           equal_nocase(name, "keep-alive") ||
+           equal_nocase(name, "proxy-connection") ||
+           equal_nocase(name, "transfer-encoding") ||
+           equal_nocase(name, "upgrade");
+}
+
+static bool has_upper(const std::string &s) {
+    for (char c : s)
+        if (c >= 'A' && c <= 'Z') return true;
+    return false;
+}
+
+http2_session::~http2_session() {
+    // the stream connections must not call back into a session gone
+    for (auto &e : streams)
+        if (e.second->conn) e.second->conn->stream = nullptr;
+}
+
+void http2_session::start(request *upgrade, const std::string &settings) {
+    unsigned char p[9 + 18 + 13];
+    unsigned char *q = p;
+
+    // our settings, then the connection window beyond the default
+    q[0] = q[1] = 0;
+    q[2] = 18;
+    q[3] = H2_SETTINGS;
+    q[4] = 0;
+    put32(q + 5, 0);
+    q += 9;
+    q[0] = 0;
+    q[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(q + 2, MAX_STREAMS);
+    q[6] = 0;
+    q[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32(q + 8, STREAM_WINDOW);
+    q[12] = 0;
+    q[13] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(q + 14, MAX_HEADER_LIST);
+    q += 18;
+    q[0] = q[1] = 0;
+    q[2] = 4;
+    q[3] = H2_WINDOW_UPDATE;
+    q[4] = 0;
+    put32(q + 5, 0);
+    put32(q + 9, CONNECTION_WINDOW - 65535);
+    conn->get_write_buffer()->push(p, sizeof(p));
+    conn->get_reactor()->add_write(conn->fd);
+    recvWindow = CONNECTION_WINDOW;
+
+    if (!upgrade) return;
+
+    // the upgrade request is stream 1, half closed already
+    if (apply_settings((const unsigned char *)settings.data(),
+                       settings.size()) == -1)
+        return;
+    lastStream = 1;
+    http2_stream *s = open_stream(1);
+    auto req = conn->thread->get_request();
+    req->type = upgrade->type;
+    req->target = upgrade->target;
+    req->uri = upgrade->uri;
+    req->query = upgrade->query;
+    req->set_protocol(2, 0);
+    for (const auto &kv : upgrade->get_headers())
+        if (!connection_field(kv.first) &&
+            !equal_nocase(kv.first, "HTTP2-Settings"))
+            req->add_header(kv.first, kv.second);
+
+    s->head = req->type == HEAD;
+    s->conn->incoming = std::move(req);
+    remote_end(s);
+}
+
+void http2_session::parse(buffer *in) {
+    finished.clear();
+
+    if (!prefaceRead) {
+        size_t n = std::min(in->length(), PREFACE_LENGTH);
+        if (std::memcmp(in->get(), PREFACE, n) != 0) {
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (n < PREFACE_LENGTH) return;
+        in->drain(PREFACE_LENGTH);
+        prefaceRead = true;
+    }
+
+    while (conn->status == CONNECTED && in->length() >= 9) {
+        const unsigned char *p = in->get();
+        size_t n = p[0] << 16 | p[1] << 8 | p[2];
+        if (n > MAX_FRAME) {
+            fail(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (in->length() < 9 + n) break;
+
+        if (frame(p[3], p[4], get32(p + 5) & 0x7FFFFFFF, p + 9, n) == -1)
+            return;
+        in->drain(9 + n);
+    }
+
+    if (conn->has_output()) conn->get_reactor()->add_write(conn->fd);
+    conn->release_idle_buffers();
+}
+
+/* -1 after a connection error, parsing stops */
+int http2_session::frame(int type, int flags, uint32_t id,
+                         const unsigned char *p, size_t n) {
+    if (headerStream && (type != H2_CONTINUATION || id != headerStream))
+        return fail(H2_PROTOCOL_ERROR);
+
+    switch (type) {
+        case H2_DATA:
+            return on_data(flags, id, p, n);
+        case H2_HEADERS:
+            return on_headers(flags, id, p, n);
+        case H2_PRIORITY:
+            if (!id) return fail(H2_PROTOCOL_ERROR);
+            return n == 5 ? 0 : fail(H2_FRAME_SIZE_ERROR);
+        case H2_RST_STREAM: {
+            if (!id || id > lastStream) return fail(H2_PROTOCOL_ERROR);
+            if (n != 4) return fail(H2_FRAME_SIZE_ERROR);
+            http2_stream *s = find(id);
+            if (s) finish(s);
+            return 0;
+        }
+        case H2_SETTINGS:
+            if (id) return fail(H2_PROTOCOL_ERROR);
+            if (flags & FLAG_ACK) return n ? fail(H2_FRAME_SIZE_ERROR) : 0;
+            if (n % 6) return fail(H2_FRAME_SIZE_ERROR);
+            if (apply_settings(p, n) == -1) return -1;
+            push_frame_head(0, H2_SETTINGS, FLAG_ACK, 0);
+            return 0;
+        case H2_PUSH_PROMISE:  // clients do not push
+            return fail(H2_PROTOCOL_ERROR);
+        case H2_PING:
+            if (id) return fail(H2_PROTOCOL_ERROR);
+            if (n != 8) return fail(H2_FRAME_SIZE_ERROR);
+            if (!(flags & FLAG_ACK)) {
+                push_frame_head(8, H2_PING, FLAG_ACK, 0);
+                conn->get_write_buffer()->push((void *)p, 8);
+            }
+            return 0;
+        case H2_GOAWAY:
+            if (id) return fail(H2_PROTOCOL_ERROR);
+            if (n < 8) return fail(H2_FRAME_SIZE_ERROR);
+            goaway = true;
+            if (streams.empty()) shutdown();
+            return 0;
+        case H2_WINDOW_UPDATE:
+            return on_window_update(id, p, n);
+        case H2_CONTINUATION:
+            if (!headerStream) return fail(H2_PROTOCOL_ERROR);
+            if (block.size() + n > MAX_HEADER_BLOCK)
+                return fail(H2_ENHANCE_YOUR_CALM);
+            block.append((const char *)p, n);
+            return flags & FLAG_END_HEADERS ? headers_done() : 0;
+        default:  // unknown frames are ignored
+            return 0;
+    }
+}
+
+int http2_session::apply_settings(const unsigned char *p, size_t n) {
+    for (size_t i = 0; i + 6 <= n; i += 6) {
+        uint32_t v = get32(p + i + 2);
+        switch (p[i] << 8 | p[i + 1]) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                encoder.set_max_table_size(v);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if (v > 1) return fail(H2_PROTOCOL_ERROR);
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (v > MAX_WINDOW) return fail(H2_FLOW_CONTROL_ERROR);
+                int64_t delta = (int64_t)v - peerWindow;
+                peerWindow = v;
+                for (auto &e : streams) {
+                    e.second->sendWindow += delta;
+                    if (e.second->sendWindow > MAX_WINDOW)
+                        return fail(H2_FLOW_CONTROL_ERROR);
+                    if (delta > 0) schedule(e.second.get());
+                }
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (v < 16384 || v > 16777215) return fail(H2_PROTOCOL_ERROR);
+                peerMaxFrame = v;
+                break;
+            default:  // unknown settings are ignored
+                break;
+        }
+    }
+    return 0;
+}
+
+int http2_session::on_headers(int flags, uint32_t id, const unsigned char *p,
+                              size_t n) {
+    if (!id || !(id & 1)) return fail(H2_PROTOCOL_ERROR);
+
+    size_t pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (n < 1) return fail(H2_FRAME_SIZE_ERROR);
+        pad = *p++;
+        n--;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (n < 5) return fail(H2_FRAME_SIZE_ERROR);
+        p += 5;
+        n -= 5;
+    }
+    if (pad > n) return fail(H2_PROTOCOL_ERROR);
+
+    block.assign((const char *)p, n - pad);
+    headerStream = id;
+    headerFlags = flags;
+    return flags & FLAG_END_HEADERS ? headers_done() : 0;
+}
+
+/* a header block is complete, a new request or the trailers of one */
+int http2_session::headers_done() {
+    uint32_t id = headerStream;
+    bool end = headerFlags & FLAG_END_STREAM;
+    headerStream = 0;
+
+    static const FieldHandler ignore = [](const std::string &,
+                                          const std::string &) {};
+    auto p = (const unsigned char *)block.data();
+
+    http2_stream *s = find(id);
+    if (s || id <= lastStream || goaway || streams.size() >= MAX_STREAMS) {
+        // decoded all the same, the table changes with every block
+        int res = decoder.decode(p, block.size(), ignore);
+        if (res == -1) return fail(H2_COMPRESSION_ERROR);
+
+        if (!s && id > lastStream) {
+            lastStream = id;
+            push_rst(id, H2_REFUSED_STREAM);
+        } else if (s && (!end || s->remoteClosed)) {
+            reset(s, H2_PROTOCOL_ERROR);
+        } else if (s && res == -2) {
+            reset(s, H2_ENHANCE_YOUR_CALM);
+        } else if (s) {  // trailers are not passed on
+            s->remoteClosed = true;
+            if (!s->dispatched && s->held.empty() && !s->conn->readPaused)
+                remote_end(s);
+        }
+        return 0;
+    }
+
+    lastStream = id;
+    s = open_stream(id);
+    auto req = conn->thread->get_request();
+    int res = build_request(req.get());
+    if (res == -1) {
+        conn->thread->release_request(std::move(req));
+        return fail(H2_COMPRESSION_ERROR);
+    }
+    if (res == 0 || res == -2) {
+        conn->thread->release_request(std::move(req));
+        reset(s, res == 0 ? H2_PROTOCOL_ERROR : H2_ENHANCE_YOUR_CALM);
+        return 0;
+    }
+
+    http_connection *c = s->conn.get();
+    s->head = req->type == HEAD;
+    c->incoming = std::move(req);
+    if (res == 2) {  // a method the routes do not know
+        s->dispatched = true;
+        s->remoteClosed = end;
+        c->send_reply(HTTP_NOTIMPLEMENTED, "Not Implemented",
+                      "501 Not Implemented");
+        return 0;
+    }
+
+    if (end) {
+        remote_end(s);
+    } else {
+        c->incoming->status = READING_BODY;
+        c->start_request(c->incoming.get());
+    }
+    return 0;
+}
+
+/*
+ * the request of the header block, 1 when it is complete, 2 for an
+ * unsupported method, 0 when malformed, -2 when the decoded list is over
+ * MAX_HEADER_LIST and -1 on a compression error
+ */
+int http2_session::build_request(request *req) {
+    std::string method, scheme, path, authority, cookie;
+    bool regular = false, malformed = false;
+
+    int res = decoder.decode(
+        (const unsigned char *)block.data(), block.size(),
+        [&](const std::string &name, const std::string &value) {
+            if (!name.empty() && name[0] == ':') {
+                std::string *slot = name == ":method"      ? &method
+                                    : name == ":scheme"    ? &scheme
+                                    : name == ":path"      ? &path
+                                    : name == ":authority" ? &authority
+                                                           : nullptr;
+                if (!slot || regular || !slot->empty())
+                    malformed = true;
+                else
+                    *slot = value;
+                return;
+            }
+
+            regular = true;
+            if (connection_field(name) || has_upper(name)) {
+                malformed = true;
+            } else if (name == "cookie") {  // crumbs are joined again
+                if (!cookie.empty()) cookie.append("; ");
+                cookie.append(value);
+            } else {
+                req->add_header(name, value);
+            }
+        });
+    if (res < 0) return res;
+    if (malformed || method.empty() || scheme.empty() || path.empty())
+        return 0;
+
+    if (!cookie.empty()) req->add_header("cookie", cookie);
+    if (!authority.empty() && req->get_header("host").empty())
+        req->add_header("host", authority);
+    req->set_protocol(2, 0);
+
+    req->target = path;
+    size_t q = path.find('?');
+    req->uri.assign(path, 0, q);
+    if (q != std::string::npos) req->query.assign(path, q + 1, std::string::npos);
+    percent_decode(req->uri);
+
+    if (method == "GET")
+        req->type = GET;
+    else if (method == "POST")
+        req->type = POST;
+    else if (method == "HEAD")
+        req->type = HEAD;
+    else
+        return 2;
+    return 1;
+}
+
+int http2_session::on_data(int flags, uint32_t id, const unsigned char *p,
+                           size_t n) {
+    if (!id) return fail(H2_PROTOCOL_ERROR);
+    if ((int64_t)n > recvWindow) return fail(H2_FLOW_CONTROL_ERROR);
+
+    // the connection window is given back at once, streams hold theirs
+    recvWindow -= n;
+    recvUnacked += n;
+    if (recvUnacked >= CONNECTION_WINDOW / 2) {
+        push_window_update(0, recvUnacked);
+        recvWindow += recvUnacked;
+        recvUnacked = 0;
+    }
+
+    http2_stream *s = find(id);
+    if (!s) {  // frames still in flight to a closed stream are dropped
+        return id > lastStream ? fail(H2_PROTOCOL_ERROR) : 0;
+    }
+    if (s->remoteClosed) {
+        reset(s, H2_STREAM_CLOSED);
+        return 0;
+    }
+    if ((int64_t)n > s->recvWindow) {
+        reset(s, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    s->recvWindow -= n;
+
+    const char *data = (const char *)p;
+    size_t length = n;
+    if (flags & FLAG_PADDED) {
+        if (n < 1 || p[0] >= n) return fail(H2_PROTOCOL_ERROR);
+        data++;
+        length -= 1 + p[0];
+    }
+    received(s, n - length);  // padding
+
+    if (s->dispatched)  // answered already, the body is of no use
+        received(s, length);
+    else if (s->conn->readPaused || !s->held.empty())
+        s->held.push((void *)data, length);
+    else
+        body(s, data, length);
+
+    if ((flags & FLAG_END_STREAM) && find(id) == s) {
+        s->remoteClosed = true;
+        if (!s->dispatched && s->held.empty() && !s->conn->readPaused)
+            remote_end(s);
+    }
+    return 0;
+}
+
+int http2_session::on_window_update(uint32_t id, const unsigned char *p,
+                                    size_t n) {
+    if (n != 4) return fail(H2_FRAME_SIZE_ERROR);
+    uint32_t increment = get32(p) & 0x7FFFFFFF;
+
+    if (!id) {
+        if (!increment) return fail(H2_PROTOCOL_ERROR);
+        sendWindow += increment;
+        if (sendWindow > MAX_WINDOW) return fail(H2_FLOW_CONTROL_ERROR);
+        if (!ready.empty()) conn->get_reactor()->add_write(conn->fd);
+        return 0;
+    }
+
+    http2_stream *s = find(id);
+    if (!s) return id > lastStream ? fail(H2_PROTOCOL_ERROR) : 0;
+    if (!increment) {
+        reset(s, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    s->sendWindow += increment;
+    if (s->sendWindow > MAX_WINDOW) {
+        reset(s, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    schedule(s);
+    return 0;
+}
+
+http2_stream *http2_session::find(uint32_t id) {
+    auto it = streams.find(id);
+    return it == streams.end() ? nullptr : it->second.get();
+}
+
+http2_stream *http2_session::open_stream(uint32_t id) {
+    auto s = std::make_unique<http2_stream>();
+    s->id = id;
+    s->session = this;
+    s->sendWindow = peerWindow;
+    s->recvWindow = STREAM_WINDOW;
+    s->conn = conn->thread->make_stream_connection(s.get(), conn);
+
+    http2_stream *p = s.get();
+    streams[id] = std::move(s);
+    return p;
+}
+
+void http2_session::body(http2_stream *s, const char *data, size_t n) {
+    uint32_t id = s->id;
+    s->conn->incoming->push_body(data, n);
+    if (find(id) == s) received(s, n);
+}
+
+/* n bytes of the stream are consumed, the peer may send more */
+void http2_session::received(http2_stream *s, size_t n) {
+    s->recvUnacked += n;
+    if (s->remoteClosed || s->recvUnacked < (uint32_t)STREAM_WINDOW / 2)
+        return;
+
+    push_window_update(s->id, s->recvUnacked);
+    s->recvWindow += s->recvUnacked;
+    s->recvUnacked = 0;
+}
+
+/* the request is complete, it goes to its route */
+void http2_session::remote_end(http2_stream *s) {
+    s->remoteClosed = true;
+    s->dispatched = true;
+
+    http_connection *c = s->conn.get();
+    c->handle_request(c->incoming.get());
+    // unless the handler closed the stream and the request went with it
+    if (c->incoming) c->thread->release_request(std::move(c->incoming));
+}
+
+void http2_session::resume(http2_stream *s) {
+    uint32_t id = s->id;
+    if (!s->held.empty()) {
+        // a handler pausing again gets the rest with the next resume
+        std::string data((const char *)s->held.get(), s->held.length());
+        s->held.clear();
+        body(s, data.data(), data.size());
+        if (find(id) != s) return;
+    }
+
+    if (s->remoteClosed && !s->dispatched && s->held.empty() &&
+        !s->conn->readPaused)
+        remote_end(s);
+}
+
+void http2_session::output_added(http2_stream *s) { schedule(s); }
+
+void http2_session::close_stream(http2_stream *s) {
+    if (s->phase == http2_stream::UNTIL_CLOSE) {  // closing ends the body
+        s->closing = true;
+        schedule(s);
+        return;
+    }
+    reset(s, H2_CANCEL);
+}
+
+void http2_session::schedule(http2_stream *s) {
+    if (!s->scheduled) {
+        s->scheduled = true;
+        ready.push_back(s->id);
+    }
+    conn->get_reactor()->add_write(conn->fd);
+}
+
+/*
+ * streams take turns, one frame each, until enough is waiting for the
+ * socket. a stream stays in the queue while only the connection window
+ * holds it back
+ */
+void http2_session::fill() {
+    finished.clear();
+
+    while (!ready.empty() && conn->output_length() < OUTPUT_BYTES) {
+        uint32_t id = ready.front();
+        ready.pop_front();
+        http2_stream *s = find(id);
+        if (!s) continue;
+        s->scheduled = false;
+
+        int res = send_stream(s);
+        if (find(id) != s) continue;
+        if (res == -1) {
+            s->scheduled = true;
+            ready.push_front(id);
+            break;
+        }
+        if (res == 1 && !s->scheduled) {
+            s->scheduled = true;
+            ready.push_back(id);
+        }
+    }
+}
+
+/*
+ * frame what the stream has, 1 after a frame, 0 while waiting for output
+ * or the stream window and -1 for the connection window
+ */
+int http2_session::send_stream(http2_stream *s) {
+    http_connection *c = s->conn.get();
+    size_t before = c->output_length();
+    int res = 0;
+
+    switch (s->phase) {
+        case http2_stream::HEAD:
+            res = send_head(s);
+            break;
+        case http2_stream::LENGTH: {
+            size_t n = std::min((size_t)s->left, before);
+            long k = n ? send_body(s, n, (long)n == s->left) : 0;
+            if (k <= 0) {
+                res = k;
+                break;
+            }
+            s->left -= k;
+            if (s->left == 0) local_end(s);
+            res = 1;
+            break;
+        }
+        case http2_stream::CHUNKED:
+            res = send_chunked(s);
+            break;
+        case http2_stream::UNTIL_CLOSE:
+            if (before > 0) {
+                long k = send_body(s, before, false);
+                res = k > 0 ? 1 : k;
+            } else if (s->closing) {
+                push_frame_head(0, H2_DATA, FLAG_END_STREAM, s->id);
+                local_end(s);
+            }
+            break;
+        default:
+            break;
+    }
+
+    // a producer waiting for its output to drain writes more now
+    if (c->stream == s && c->output_length() < before) c->output_drained();
+    return res;
+}
+
+/* HEADERS for the response head at the front of the stream output */
+int http2_session::send_head(http2_stream *s) {
+    http_connection *c = s->conn.get();
+    size_t n = c->output_prefix();
+    if (n == 0) return 0;
+
+    auto p = (const char *)c->get_write_buffer()->get();
+    auto e = (const char *)memmem(p, n, "\r\n\r\n", 4);
+    if (!e) return 0;
+
+    headBuf.clear();
+    headBuf.push((void *)p, e + 4 - p);
+    c->drop_output(e + 4 - p);
+
+    auto r = conn->thread->get_response();
+    r->stopAtBody = true;
+    parse_status_t status = r->parse(&headBuf);
+    if (status != HEADERSREAD && status != ALLREAD) {
+        conn->thread->release_request(std::move(r));
+        reset(s, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    if (r->response_code < 200) {  // interim responses are dropped
+        conn->thread->release_request(std::move(r));
+        return 1;
+    }
+
+    bool end = s->head || status == ALLREAD || r->body_remaining() == 0;
+    if (end) {
+        s->phase = http2_stream::DONE;
+    } else if (r->body_until_close()) {
+        s->phase = http2_stream::UNTIL_CLOSE;
+    } else if (r->body_remaining() > 0) {
+        s->phase = http2_stream::LENGTH;
+        s->left = r->body_remaining();
+    } else {
+        s->phase = http2_stream::CHUNKED;
+        s->left = 0;
+    }
+
+    name.clear();
+    append_int(name, r->response_code);
+    encoded.clear();
+    encoder.begin(encoded);
+    encoder.encode(encoded, ":status", name);
+    for (const auto &kv : r->get_headers()) {
+        if (kv.second.empty() || connection_field(kv.first)) continue;
+        name = kv.first;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        encoder.encode(encoded, name, kv.second);
+    }
+    conn->thread->release_request(std::move(r));
+
+    // a block larger than a frame goes on in CONTINUATION frames
+    size_t off = 0;
+    int type = H2_HEADERS;
+    do {
+        size_t k = std::min(encoded.size() - off, (size_t)peerMaxFrame);
+        int flags = off + k == encoded.size() ? FLAG_END_HEADERS : 0;
+        if (end && type == H2_HEADERS) flags |= FLAG_END_STREAM;
+        push_frame_head(k, type, flags, s->id);
+        conn->get_write_buffer()->push((void *)(encoded.data() + off), k);
+        off += k;
+        type = H2_CONTINUATION;
+    } while (off < encoded.size());
+
+    if (end) local_end(s);
+    return 1;
+}
+
+/* the chunk framing is dropped, chunk data goes out as DATA */
+int http2_session::send_chunked(http2_stream *s) {
+    http_connection *c = s->conn.get();
+
+    while (s->left == 0) {
+        size_t n = c->output_prefix();
+        auto p = (const char *)c->get_write_buffer()->get();
+        if (s->chunkEnd) {
+            if (n < 2) return 0;
+            c->drop_output(2);
+            s->chunkEnd = false;
+            continue;
+        }
+
+        auto e = (const char *)memmem(p, n, "\r\n", 2);
+        if (!e) return 0;
+        string_ref line(p, e - p);
+        size_t ext = line.find(';');
+        long size = to_long(trim_ref(line.substr(0, ext)), 16);
+        if (size < 0) {
+            reset(s, H2_INTERNAL_ERROR);
+            return 0;
+        }
+
+        if (size == 0) {  // the last chunk, trailers are dropped
+            auto t = (const char *)memmem(p, n, "\r\n\r\n", 4);
+            if (!t) return 0;
+            c->drop_output(t + 4 - p);
+            push_frame_head(0, H2_DATA, FLAG_END_STREAM, s->id);
+            local_end(s);
+            return 1;
+        }
+
+        c->drop_output(e + 2 - p);
+        s->left = size;
+        s->chunkEnd = true;
+    }
+
+    size_t n = std::min((size_t)s->left, c->output_length());
+    long k = n ? send_body(s, n, false) : 0;
+    if (k <= 0) return k;
+    s->left -= k;
+    return 1;
+}
+
+/*
+ * one DATA frame with up to n bytes of the stream output, END_STREAM
+ * when last and all n fit. the bytes sent, 0 when the stream window is
+ * closed and -1 when the connection window is
+ */
+long http2_session::send_body(http2_stream *s, size_t n, bool last) {
+    if (sendWindow <= 0) return -1;
+    if (s->sendWindow <= 0) return 0;
+
+    size_t k = std::min(n, (size_t)std::min(sendWindow, s->sendWindow));
+    k = std::min(k, std::min((size_t)peerMaxFrame, MAX_DATA_FRAME));
+    push_frame_head(k, H2_DATA, last && k == n ? FLAG_END_STREAM : 0, s->id);
+    s->conn->move_output(conn, k);
+    sendWindow -= k;
+    s->sendWindow -= k;
+    return k;
+}
+
+/* the response is complete, so is the stream */
+void http2_session::local_end(http2_stream *s) {
+    s->phase = http2_stream::DONE;
+    // what is left of the request body is not needed
+    if (!s->remoteClosed) push_rst(s->id, H2_NO_ERROR);
+    finish(s);
+}
+
+void http2_session::push_frame_head(size_t length, int type, int flags,
+                                    uint32_t id) {
+    unsigned char h[9];
+    h[0] = length >> 16;
+    h[1] = length >> 8;
+    h[2] = length;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, id);
+    conn->get_write_buffer()->push(h, 9);
+}
+
+void http2_session::push_window_update(uint32_t id, uint32_t increment) {
+    unsigned char p[4];
+    put32(p, increment);
+    push_frame_head(4, H2_WINDOW_UPDATE, 0, id);
+    conn->get_write_buffer()->push(p, 4);
+    conn->get_reactor()->add_write(conn->fd);
+}
+
+void http2_session::push_rst(uint32_t id, h2_error_t code) {
+    unsigned char p[4];
+    put32(p, code);
+    push_frame_head(4, H2_RST_STREAM, 0, id);
+    conn->get_write_buffer()->push(p, 4);
+    conn->get_reactor()->add_write(conn->fd);
+}
+
+void http2_session::reset(http2_stream *s, h2_error_t code) {
+    push_rst(s->id, code);
+    finish(s);
+}
+
+/* the stream is gone, its connection goes back to the thread pool */
+void http2_session::finish(http2_stream *s) {
+    auto it = streams.find(s->id);
+    if (it == streams.end()) return;
+    auto owned = std::move(it->second);
+    streams.erase(it);
+
+    auto c = std::move(owned->conn);
+    c->reset_state();
+    c->stream = nullptr;
+    conn->thread->release_stream_connection(std::move(c));
+    finished.push_back(std::move(owned));
+
+    if (goaway && streams.empty()) shutdown();
+}
+
+void http2_session::cancel() {
+    ready.clear();
+    while (!streams.empty()) finish(streams.begin()->second.get());
+}
+
+/* connection error, rfc 7540 5.4.1 */
+int http2_session::fail(h2_error_t code) {
+    if (conn->status == CONNECTED) {
+        unsigned char p[8];
+        put32(p, lastStream);
+        put32(p + 4, code);
+        push_frame_head(8, H2_GOAWAY, 0, 0);
+        conn->get_write_buffer()->push(p, 8);
+    }
+    goaway = true;
+    shutdown();
+    return -1;
+}
+
+/* close the tcp connection once the output is out */
+void http2_session::shutdown() {
+    if (conn->status != CONNECTED) return;
+    conn->status = CLOSING;
+    conn->get_reactor()->remove_read(conn->fd);
+    conn->get_reactor()->add_write(conn->fd);
+}
+
+}  // namespace wxg
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <core/buffer.hh>
+
+#include "hpack.hh"
+
+namespace wxg {
+
+class http_connection;
+class http2_session;
+class request;
+
+enum h2_frame_t {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9
+};
+
+/* rfc 7540 7 */
+enum h2_error_t {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+/*
+ * one request and its response. handlers get conn, an http_connection
+ * without a socket whose output the session turns into frames
+ */
+struct http2_stream {
+    /* how far the http/1.1 response in the output of conn is framed */
+    enum phase_t { HEAD = 0, LENGTH, CHUNKED, UNTIL_CLOSE, DONE };
+
+    uint32_t id = 0;
+    http2_session *session = nullptr;
+    std::unique_ptr<http_connection> conn;
+
+    int64_t sendWindow = 0;
+    int32_t recvWindow = 0;
+    uint32_t recvUnacked = 0;  // delivered, not announced with WINDOW_UPDATE
+
+    phase_t phase = HEAD;
+    long left = 0;  // of the body or the current chunk
+    bool chunkEnd = false;  // "\r\n" after the chunk ahead
+
+    bool head = false;  // request for a HEAD, the body is dropped
+    bool remoteClosed = false;
+    bool dispatched = false;  // the complete request went to its handler
+    bool closing = false;     // conn closed, a body until close is over
+    bool scheduled = false;
+    buffer held;  // body received while the handler paused reading
+};
+
+/*
+ * cleartext http/2 on an http_connection, rfc 7540, by prior knowledge
+ * or after an Upgrade: h2c request. owned by the connection and living
+ * in the same reactor.
+ *
+ * requests are dispatched to the server routes like http/1.1 ones, each
+ * stream has its own http_connection for the handlers. what they write
+ * there, the usual response with a Content-Length or chunked body, is
+ * framed here: the head is HPACK encoded into HEADERS and the body goes
+ * out as DATA within the send windows of the stream and the connection.
+ * body bytes are moved as they are, shared strings and file ranges stay
+ * segments written with writev and sendfile.
+ *
+ * the receive windows are replenished as bodies reach their handlers, a
+ * handler that pauses reading stops the peer once the stream window is
+ * used up. there is no server push and priorities are ignored
+ */
+class http2_session {
+   private:
+    http_connection *conn = nullptr;
+
+    hpack_decoder decoder;
+    hpack_encoder encoder;
+    std::string block;    // header block being received
+    std::string encoded;  // and the one being sent
+    std::string name;
+
+    std::unordered_map<uint32_t, std::unique_ptr<http2_stream>> streams;
+    std::deque<uint32_t> ready;  // streams with output to frame
+    // freed on the next event, handlers up the stack may still use them
+    std::vector<std::unique_ptr<http2_stream>> finished;
+
+    bool prefaceRead = false;
+    uint32_t lastStream = 0;   // highest stream the peer opened
+    uint32_t headerStream = 0;  // a header block continues on this stream
+    uint8_t headerFlags = 0;
+
+    int64_t sendWindow = 65535;
+    int32_t recvWindow = 0;
+    uint32_t recvUnacked = 0;
+    uint32_t peerWindow = 65535;  // initial window of new streams
+    uint32_t peerMaxFrame = 16384;
+    bool goaway = false;  // no more streams, close when the last is done
+
+    buffer headBuf;  // response head taken from a stream
+
+   public:
+    static const char PREFACE[];
+    static const size_t PREFACE_LENGTH = 24;
+
+    static const size_t MAX_STREAMS = 100;
+    static const size_t MAX_FRAME = 16384;     // largest frame we accept
+    static const size_t MAX_DATA_FRAME = 65536;  // largest we send
+    static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+    static const size_t MAX_HEADER_LIST = 64 * 1024;  // decoded
+    static const int32_t STREAM_WINDOW = 256 * 1024;
+    static const int32_t CONNECTION_WINDOW = 1 << 20;
+    // framed ahead of the socket, the rest waits in the streams
+    static const size_t OUTPUT_BYTES = 256 * 1024;
+
+   public:
+    http2_session(http_connection *c) : conn(c) {
+        decoder.set_max_list_size(MAX_HEADER_LIST);
+    }
+    ~http2_session();
+
+    /*
+     * send our settings. after an upgrade, with the HTTP2-Settings of
+     * the request, the request is answered on stream 1
+     */
+    void start(request *upgrade = nullptr, const std::string &settings = "");
+
+    /* parse the preface and frames in the read buffer */
+    void parse(buffer *in);
+    /* frame stream output into the connection, from its write handler */
+    void fill();
+    /* the connection closed, drop every stream */
+    void cancel();
+
+    /* from the http_connection of a stream */
+    void output_added(http2_stream *s);
+    void resume(http2_stream *s);
+    void close_stream(http2_stream *s);
+
+   private:
+    int frame(int type, int flags, uint32_t id, const unsigned char *p,
+              size_t n);
+    int on_headers(int flags, uint32_t id, const unsigned char *p, size_t n);
+    int headers_done();
+    int on_data(int flags, uint32_t id, const unsigned char *p, size_t n);
+    int on_window_update(uint32_t id, const unsigned char *p, size_t n);
+    int apply_settings(const unsigned char *p, size_t n);
+
+    http2_stream *find(uint32_t id);
+    http2_stream *open_stream(uint32_t id);
+    int build_request(request *req);
+    void body(http2_stream *s, const char *data, size_t n);
+    void remote_end(http2_stream *s);
+    void received(http2_stream *s, size_t n);
+
+    void schedule(http2_stream *s);
+    int send_stream(http2_stream *s);
+    int send_head(http2_stream *s);
+    int send_chunked(http2_stream *s);
+    long send_body(http2_stream *s, size_t n, bool last);
+    void local_end(http2_stream *s);
+
+    void push_frame_head(size_t length, int type, int flags, uint32_t id);
+    void push_window_update(uint32_t id, uint32_t increment);
+    void push_rst(uint32_t id, h2_error_t code);
+    void reset(http2_stream *s, h2_error_t code);
+    void finish(http2_stream *s);
+    int fail(h2_error_t code);
+    void shutdown();
+};
+
+}  // namespace wxg
@@ -0,0 +1,359 @@
+#include "http_client.hh"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace wxg {
+
+http_client::~http_client() {
+    auto timers = reactor_->get_time_manager();
+    auto drop = [&](std::deque<std::unique_ptr<client_call>>& calls) {
+        for (auto& c : calls)
+            if (c->timerId >= 0) timers->remove(c->timerId);
+    };
+
+    for (auto& h : hosts) {
+        drop(h.second->waiting);
+        for (auto& conn : h.second->conns) {
+            drop(conn->inflight);
+            reactor_->remove_read_handler(conn->fd);
+            reactor_->remove_write_handler(conn->fd);
+            ::close(conn->fd);
+        }
+    }
+    if (reapTimer >= 0) timers->remove(reapTimer);
+    reap();
+}
+
+void http_client::send(const std::string& address, unsigned short port,
+                       request* req, ResponseHandler&& handler,
+                       int timeout) {
+    client_host* h = get_host(address, port);
+
+    auto c = std::make_unique<client_call>();
+    c->handler = std::move(handler);
+    c->host = h;
+    c->head = req->type == HEAD;
+    c->idempotent = req->type == GET || req->type == HEAD;
+    if (req->get_header("Host").empty()) req->set_header("Host", h->hostHeader);
+
+    if (!h->resolved) {
+        finish(std::move(c), nullptr, CLIENT_CONNECT);
+        return;
+    }
+
+    if (timeout < 0) timeout = timeoutMs;
+    if (timeout > 0) {
+        client_call* p = c.get();
+        c->timerId = reactor_->get_time_manager()->set_timer(
+            timeout / 1000, timeout % 1000 * 1000, false, [this, p]() {
+                p->timerId = -1;
+                on_timeout(p);
+            });
+    }
+
+    // queued calls go first
+    client_connection* conn = h->waiting.empty() ? choose(h, c.get()) : nullptr;
+    if (conn) {
+        req->send_to(conn->get_write_buffer());
+        start(conn, std::move(c));
+        return;
+    }
+    if (h->conns.empty() && h->waiting.empty()) {
+        finish(std::move(c), nullptr, CLIENT_CONNECT);
+        return;
+    }
+
+    req->send_to(&c->data);
+    h->waiting.push_back(std::move(c));
+}
+
+size_t http_client::connections(const std::string& address,
+                                unsigned short port) const {
+    auto it = hosts.find(address + ":" + std::to_string(port));
+    return it == hosts.end() ? 0 : it->second->conns.size();
+}
+
+client_host* http_client::get_host(const std::string& address,
+                                   unsigned short port) {
+    std::string key = address + ":" + std::to_string(port);
+    auto& h = hosts[key];
+    if (h) return h.get();
+
+    h = std::make_unique<client_host>();
+    h->address = address;
+    h->port = port;
+    h->hostHeader = port == 80 ? address : key;
+
+    std::memset(&h->addr, 0, sizeof(h->addr));
+    h->addr.sin_family = AF_INET;
+    h->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &h->addr.sin_addr) == 1) {
+        h->resolved = true;
+    } else {
+        // names are resolved once, blocking
+        struct addrinfo hints, *res = nullptr;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (::getaddrinfo(address.c_str(), nullptr, &hints, &res) == 0) {
+            h->addr.sin_addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+            h->resolved = true;
+            freeaddrinfo(res);
+        }
+    }
+    return h.get();
+}
+
+/*
+ * an idle connection, else a new one, else the least loaded one that
+ * can take another pipelined call
+ */
+client_connection* http_client::choose(client_host* h, const client_call* c) {
+    client_connection* best = nullptr;
+    for (auto& conn : h->conns) {
+        if (conn->closing) continue;
+        size_t n = conn->inflight.size();
+        if (n == 0) return conn.get();
+        if (!c->idempotent || n >= maxPipeline) continue;
+        if (!best || n < best->inflight.size()) best = conn.get();
+    }
+
+    if (h->conns.size() < maxConnections) {
+        client_connection* conn = open(h);
+        if (conn) return conn;
+    }
+    return best;
+}
+
+client_connection* http_client::open(client_host* h) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_WARN("socket: %s", strerror(errno));
+        return nullptr;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(fd, (struct sockaddr*)&h->addr, sizeof(h->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    auto conn = std::make_unique<client_connection>();
+    conn->fd = fd;
+    conn->address = h->address;
+    conn->port = h->port;
+    conn->pool = &buffers;
+    conn->host = h;
+
+    client_connection* p = conn.get();
+    reactor_->set_read_handler(fd, [this, p]() { on_read(p); });
+    reactor_->set_write_handler(fd, [this, p]() { on_write(p); });
+
+    h->conns.push_back(std::move(conn));
+    return p;
+}
+
+void http_client::dispatch(client_host* h) {
+    while (!h->waiting.empty()) {
+        client_connection* conn = choose(h, h->waiting.front().get());
+        if (!conn && !h->conns.empty()) return;
+
+        auto c = std::move(h->waiting.front());
+        h->waiting.pop_front();
+        if (conn)
+            start(conn, std::move(c));
+        else
+            finish(std::move(c), nullptr, CLIENT_CONNECT);
+    }
+}
+
+void http_client::start(client_connection* conn,
+                        std::unique_ptr<client_call> c) {
+    c->conn = conn;
+    if (!c->data.empty()) {
+        conn->get_write_buffer()->push(&c->data);
+        c->data.reset();
+    }
+    conn->inflight.push_back(std::move(c));
+    if (conn->connected) reactor_->add_write(conn->fd);
+}
+
+void http_client::on_write(client_connection* conn) {
+    if (!conn->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+            err != 0) {
+            close(conn, CLIENT_CONNECT);
+            return;
+        }
+        conn->connected = true;
+    }
+
+    if (conn->has_output()) {
+        int n = conn->write();
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            close(conn, CLIENT_CLOSED);
+            return;
+        }
+    }
+    if (!conn->has_output()) reactor_->remove_write(conn->fd);
+}
+
+void http_client::on_read(client_connection* conn) {
+    int n = conn->read();
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR) close(conn, CLIENT_CLOSED);
+        return;
+    }
+
+    while (!conn->inflight.empty() && conn->has_input()) {
+        if (!conn->response) {
+            conn->response = get_response();
+            conn->response->stopAtBody = conn->inflight.front()->head;
+        }
+
+        auto status = conn->response->parse(conn->get_read_buffer());
+        if (status == ALLREAD || status == HEADERSREAD) {
+            complete(conn, CLIENT_OK);
+            if (conn->closing) return;
+        } else if (status == CORRUPTED) {
+            close(conn, CLIENT_CORRUPTED);
+            return;
+        } else {
+            break;
+        }
+    }
+
+    if (n == 0) {
+        // a body without length ends with the connection
+        if (conn->response && conn->response->body_until_close())
+            complete(conn, CLIENT_OK);
+        if (!conn->closing) close(conn, CLIENT_CLOSED);
+        return;
+    }
+
+    if (conn->inflight.empty()) {
+        if (conn->has_input())  // nothing was asked for
+            close(conn, CLIENT_CORRUPTED);
+        else
+            conn->release_buffers();
+    }
+}
+
+void http_client::on_timeout(client_call* c) {
+    client_connection* conn = c->conn;
+    auto& calls = conn ? conn->inflight : c->host->waiting;
+
+    for (auto it = calls.begin(); it != calls.end(); ++it) {
+        if (it->get() != c) continue;
+
+        auto p = std::move(*it);
+        calls.erase(it);
+        // later responses can not be told apart from this one any more
+        if (conn) close(conn, CLIENT_CLOSED);
+        finish(std::move(p), nullptr, CLIENT_TIMEOUT);
+        return;
+    }
+}
+
+/* response of the front call is complete */
+void http_client::complete(client_connection* conn, client_error_t error) {
+    auto c = std::move(conn->inflight.front());
+    conn->inflight.pop_front();
+    auto r = std::move(conn->response);
+
+    const std::string& connection = r->get_header("Connection");
+    bool keepalive = !r->body_until_close() &&
+                     (r->minor == 1 ? !equal_nocase(connection, "close")
+                                    : equal_nocase(connection, "keep-alive"));
+    if (!keepalive) conn->closing = true;  // the handler can not reuse it
+
+    finish(std::move(c), r.get(), error);
+    release_response(std::move(r));
+
+    if (conn->closing)
+        close(conn, CLIENT_CLOSED);
+    else
+        dispatch(conn->host);
+}
+
+void http_client::finish(std::unique_ptr<client_call> c, request* response,
+                         client_error_t error) {
+    if (c->timerId >= 0) reactor_->get_time_manager()->remove(c->timerId);
+
+    auto handler = std::move(c->handler);
+    c.reset();
+    if (handler) handler(response, error);
+}
+
+/*
+ * the connection leaves its host, its calls fail, a connect error fails
+ * them all with CLIENT_CONNECT. the fd is closed on the next turn of the
+ * loop so its number is not reused while the reactor still knows it
+ */
+void http_client::close(client_connection* conn, client_error_t error) {
+    if (conn->closing && !conn->host) return;
+
+    conn->closing = true;
+    reactor_->remove_read_handler(conn->fd);
+    reactor_->remove_write_handler(conn->fd);
+    if (conn->response) release_response(std::move(conn->response));
+
+    client_host* h = conn->host;
+    conn->host = nullptr;
+    for (auto it = h->conns.begin(); it != h->conns.end(); ++it) {
+        if (it->get() != conn) continue;
+        retired.push_back(std::move(*it));
+        h->conns.erase(it);
+        break;
+    }
+    if (reapTimer < 0)
+        reapTimer = reactor_->get_time_manager()->set_timer(0, [this]() {
+            reapTimer = -1;
+            reap();
+        });
+
+    auto calls = std::move(conn->inflight);
+    conn->inflight.clear();
+    for (auto& c : calls) {
+        finish(std::move(c), nullptr, error);
+        if (error != CLIENT_CONNECT) error = CLIENT_CLOSED;
+    }
+
+    dispatch(h);
+}
+
+void http_client::reap() {
+    for (auto& conn : retired) {
+        ::close(conn->fd);
+        conn->release_buffers(true);
+    }
+    retired.clear();
+}
+
+std::unique_ptr<request> http_client::get_response() {
+    std::unique_ptr<request> r;
+    if (freeResponses.empty()) {
+        r = std::make_unique<request>();
+    } else {
+        r = std::move(freeResponses.back());
+        freeResponses.pop_back();
+    }
+    r->kind = RESPONSE;
+    return r;
+}
+
+void http_client::release_response(std::unique_ptr<request> r) {
+    r->reset();
+    freeResponses.push_back(std::move(r));
+}
+
+}  // namespace wxg
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <core/buffer_pool.hh>
+#include <core/connection.hh>
+#include <core/epoll.hh>
+#include <model/reactor.hh>
+
+#include "request.hh"
+
+namespace wxg {
+
+enum client_error_t {
+    CLIENT_OK = 0,
+    CLIENT_CONNECT,   // the upstream could not be reached
+    CLIENT_TIMEOUT,   // no complete response within the timeout
+    CLIENT_CLOSED,    // connection closed before the response completed
+    CLIENT_CORRUPTED  // response could not be parsed
+};
+
+/*
+ * called once per request on the reactor thread. response is null unless
+ * error is CLIENT_OK and is only valid during the call
+ */
+using ResponseHandler =
+    std::function<void(request *response, client_error_t error)>;
+
+class http_client;
+class client_connection;
+struct client_host;
+
+/* a request from send until its handler ran */
+struct client_call {
+    ResponseHandler handler;
+    client_host *host = nullptr;
+    client_connection *conn = nullptr;  // null while queued
+
+    buffer data;  // serialized request while queued
+    bool head = false;
+    bool idempotent = true;
+    int timerId = -1;
+};
+
+/*
+ * keep-alive connection to one host. calls are written in order and
+ * their responses come back in the same order
+ */
+class client_connection : public connection {
+   public:
+    client_host *host = nullptr;
+    std::deque<std::unique_ptr<client_call>> inflight;
+    std::unique_ptr<request> response;  // of inflight.front()
+
+    bool connected = false;
+    bool closing = false;  // takes no more calls
+};
+
+struct client_host {
+    std::string address;
+    unsigned short port = 0;
+    std::string hostHeader;
+    struct sockaddr_in addr;
+    bool resolved = false;
+
+    std::vector<std::unique_ptr<client_connection>> conns;
+    std::deque<std::unique_ptr<client_call>> waiting;
+};
+
+/*
+ * non-blocking http/1.1 client driven by a reactor. every host gets a
+ * pool of keep-alive connections, requests are spread over idle ones
+ * first, new ones up to maxConnections next, and pipelined up to
+ * maxPipeline deep on the least loaded after that. only GET and HEAD are
+ * pipelined, other methods wait for an idle connection
+ */
+class http_client {
+   private:
+    reactor<epoll> *reactor_ = nullptr;
+
+    std::unordered_map<std::string, std::unique_ptr<client_host>> hosts;
+
+    size_t maxConnections = 8;
+    size_t maxPipeline = 4;
+    int timeoutMs = 30000;
+
+    buffer_pool buffers;
+    std::vector<std::unique_ptr<request>> freeResponses;
+
+    // closed connections, freed on the next turn of the loop
+    std::vector<std::unique_ptr<client_connection>> retired;
+    int reapTimer = -1;
+
+   public:
+    http_client(reactor<epoll> *r) : reactor_(r) {}
+    ~http_client();
+
+    /* connections per host and requests in flight per connection */
+    void set_max_connections(size_t n) { maxConnections = n ? n : 1; }
+    void set_max_pipeline(size_t n) { maxPipeline = n ? n : 1; }
+    /* default time from send to the complete response */
+    void set_timeout(int ms) { timeoutMs = ms; }
+
+    /*
+     * send req, built with set_request, to address:port. a Host header is
+     * added when missing. timeoutMs < 0 takes the default, 0 none
+     */
+    void send(const std::string &address, unsigned short port, request *req,
+              ResponseHandler &&handler, int timeoutMs = -1);
+
+    /* connections open to address:port */
+    size_t connections(const std::string &address, unsigned short port) const;
+
+   private:
+    client_host *get_host(const std::string &address, unsigned short port);
+    client_connection *choose(client_host *h, const client_call *c);
+    client_connection *open(client_host *h);
+
+    void dispatch(client_host *h);
+    void start(client_connection *conn, std::unique_ptr<client_call> c);
+
+    void on_read(client_connection *conn);
+    void on_write(client_connection *conn);
+    void on_timeout(client_call *c);
+
+    void complete(client_connection *conn, client_error_t error);
+    void finish(std::unique_ptr<client_call> c, request *response,
+                client_error_t error);
+    void close(client_connection *conn, client_error_t error);
+    void reap();
+
+    std::unique_ptr<request> get_response();
+    void release_response(std::unique_ptr<request> r);
+};
+
+}  // namespace wxg
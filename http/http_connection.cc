@@ -3,25 +3,37 @@
 #include "http_thread.hh"
 
 #include <core/buffer.hh>
+#include <core/log.hh>
+#include <core/string.hh>
+
+#include <fcntl.h>
+
+#include <cstdio>
+#include <cstring>
 
 namespace wxg {
 
 http_connection::http_connection(http_thread* _thread, int _fd,
                                  const std::string& _addr, unsigned short _port)
     : thread(_thread) {
+    pool = thread ? thread->get_buffer_pool() : nullptr;
     fd = _fd;
     address = _addr;
     port = _port;
     status = CONNECTED;
 
     if (!thread || fd <= 0) {
-        cerr << __func__ << " : error" << endl;
+        LOG_ERROR("%s: no thread or fd %d", __func__, fd);
         exit(-1);
     }
 
     setup_new_events();
 }
 
+http_connection::http_connection(http_thread* _thread) : thread(_thread) {
+    pool = thread ? thread->get_buffer_pool() : nullptr;
+}
+
 http_connection::~http_connection() { close(); }
 
 /*
@@ -29,79 +41,160 @@ http_connection::~http_connection() { close(); }
  * when reuse a connection, need to init again, because fd changed
  */
 void http_connection::setup_new_events() {
+    auto server = thread->get_server();
+    paused = false;
+    websock.reset();
+    h2.reset();
+    stream = nullptr;
+    acceptedAt = readAt = startedAt = queuedAt = 0;
+    set_output_watermarks(server->outputHighWatermark,
+                          server->outputLowWatermark);
+
     get_reactor()->set_read_handler(fd, [this]() {
+        if (splice_pending()) {
+            splice_body();
+            return;
+        }
+
         int n = read();
 
         if (n == -1) {
             if (errno != EAGAIN && errno != EINTR) {
-                perror("connection read");
+                LOG_DEBUG("read error on fd %d: %s", fd, strerror(errno));
                 get_reactor()->remove_read(fd);
             }
         } else if (n == 0) {  // EOF
             get_reactor()->remove_read(fd);
             status = CLOSING;
+            get_reactor()->add_write(fd);  // close once output is flushed
         } else {
+            thread->get_metrics()->add(METRIC_BYTES_IN, n);
+            readAt = cycle_clock::now();
             parse_request();
         }
     });
     get_reactor()->remove_read(fd);
 
     get_reactor()->set_write_handler(fd, [this]() {
-        if (get_write_buffer()->empty()) {
+        if (h2) h2->fill();
+        if (!has_output() && relaying()) {
+            relay_pump();
+            return;
+        }
+        if (!has_output()) {
             get_reactor()->remove_write(fd);
-            if (status == CLOSING) close();
+            if (status == CLOSING)
+                close();
+            else
+                release_idle_buffers();
             return;
         }
 
         int n = write();
         if (n == -1) {
             if (errno != EAGAIN && errno != EINTR && errno != EINPROGRESS) {
-                cerr << "fixme: write error" << endl;
+                LOG_DEBUG("write error on fd %d: %s", fd, strerror(errno));
                 get_reactor()->remove_write(fd);
                 status = CLOSING;
             }
         } else if (n == 0) {
-            cerr << "error write eof" << endl;
+            LOG_DEBUG("write eof on fd %d", fd);
             get_reactor()->remove_write(fd);
             status = CLOSING;
         } else {
+            thread->get_metrics()->add(METRIC_BYTES_OUT, n);
+            if (queuedAt && !has_output()) written();
+            output_drained();
         }
     });
     get_reactor()->remove_write(fd);
 }
 
+void http_connection::setup_stream(http2_stream* s,
+                                   const http_connection* parent) {
+    auto server = thread->get_server();
+    stream = s;
+    fd = -1;
+    address = parent->address;
+    port = parent->port;
+    status = CONNECTED;
+    paused = readPaused = false;
+    websock.reset();
+    h2.reset();
+    set_output_watermarks(server->outputHighWatermark,
+                          server->outputLowWatermark);
+}
+
 reactor<epoll>* http_connection::get_reactor() const {
     return thread->get_reactor();
 }
 
+/*
+ * a spliced body leaves nothing in the read buffer, the request still has
+ * to be parsed to completion
+ */
+bool http_connection::parse_ready() const {
+    return has_input() || (incoming && incoming->body_remaining() == 0);
+}
+
+/* the client speaks http/2 without asking first */
+static bool http2_preface(buffer* in) {
+    return in->length() >= 16 &&
+           std::memcmp(in->get(), http2_session::PREFACE, 16) == 0;
+}
+
 void http_connection::parse_request() {
-    if (get_read_buffer()->empty()) {
+    if (paused || readPaused) return;
+    if (websock) {
+        websock->parse(get_read_buffer());
+        return;
+    }
+    if (h2) {
+        h2->parse(get_read_buffer());
+        return;
+    }
+
+    if (!parse_ready()) {
         if (status == CONNECTED) get_reactor()->add_read(fd);
+        release_idle_buffers();
         return;
     }
 
     bool processing = true;
-
-    while (processing && !get_read_buffer()->empty()) {
-        if (requests.empty()) {
-            auto req = std::make_unique<request>();
-            req->kind = REQUEST;
-            requests.push(std::move(req));
+    parsing = true;
+
+    while (processing && parse_ready() && !paused && !readPaused && !websock &&
+           !h2) {
+        if (!incoming && http2_preface(get_read_buffer()) &&
+            thread->get_server()->http2) {  // prior knowledge
+            h2 = std::make_unique<http2_session>(this);
+            h2->start();
+            break;
+        }
+        if (!incoming) {
+            incoming = thread->get_request();
+            incoming->stopAtBody = true;
+            startedAt = readAt;
+            trace::emit(TRACE_PARSE, TRACE_BEGIN, fd);
         }
 
         processing = false;
-        parse_status_t res = requests.front()->parse(get_read_buffer());
+        parse_status_t res = incoming->parse(get_read_buffer());
         switch (res) {
+            case HEADERSREAD:
+                start_request(incoming.get());
+                processing = true;
+                break;
             case ALLREAD:
-                handle_request(requests.front().get());
-                requests.pop();
+                handle_request(incoming.get());
+                thread->release_request(std::move(incoming));
                 processing = true;
-                break;  // now incoming request will be destroyed
+                break;  // now incoming request goes back to the pool
             case NEEDMORE:
-                get_reactor()->add_read(fd);
+                if (!paused) get_reactor()->add_read(fd);
                 break;
             case CORRUPTED:;
-                cerr << "corrupted" << endl;
+                thread->get_metrics()->add(METRIC_PARSE_ERRORS);
                 shutdown(fd, SHUT_RD);
                 get_reactor()->remove_read_handler(fd);
                 status = CLOSING;
@@ -109,74 +202,458 @@ void http_connection::parse_request() {
                 break;
             case CANCELD:
             default:
-                cerr << "unknow error" << endl;
+                LOG_WARN("unknown parse status %d on fd %d", res, fd);
                 shutdown(fd, SHUT_RD);
                 get_reactor()->remove_read_handler(fd);
                 status = CLOSING;
                 break;
         }
-        if (!get_write_buffer()->empty()) get_reactor()->add_write(fd);
+        if (has_output()) get_reactor()->add_write(fd);
+    }
+
+    parsing = false;
+    if ((websock || h2) && has_input())
+        parse_request();  // frames right behind the upgrade
+    else
+        release_idle_buffers();
+}
+
+/*
+ * headers of a request with a body are parsed, a streaming route takes
+ * over the body from here
+ */
+void http_connection::start_request(request* req) {
+    incomingRoute =
+        thread->get_server()->routes.lookup(req->type, req->uri, &req->params);
+    started = true;
+
+    if (!incomingRoute || !incomingRoute->streaming()) return;
+
+    req->set_body_sink([this](const char* data, size_t length) {
+        if (incomingRoute->body) incomingRoute->body(incoming.get(), this,
+                                                     data, length);
+    });
+    if (incomingRoute->headers) incomingRoute->headers(req, this);
+}
+
+void http_connection::pause_reading() {
+    readPaused = true;
+    if (!stream) get_reactor()->remove_read(fd);
+}
+
+void http_connection::resume_reading() {
+    if (!readPaused) return;
+
+    readPaused = false;
+    if (stream) {
+        stream->session->resume(stream);
+        return;
+    }
+    if (status == CONNECTED && !paused) get_reactor()->add_read(fd);
+    if (!parsing) parse_request();
+}
+
+int http_connection::splice_body_to(int out) {
+    if (!incoming || incoming->status != READING_BODY || out < 0) return -1;
+
+    open_pipe();
+
+    bodyFd = out;
+    // bytes already read go through the sink, the rest is spliced
+    incoming->set_body_sink([this](const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = ::write(bodyFd, data, length);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                LOG_WARN("body write: %s", strerror(errno));
+                return;
+            }
+            data += n;
+            length -= n;
+        }
+    });
+    return 0;
+}
+
+bool http_connection::open_pipe() {
+    if (pipefd[0] >= 0) return true;
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) == 0) return true;
+
+    LOG_WARN("pipe2: %s", strerror(errno));
+    pipefd[0] = pipefd[1] = -1;
+    return false;
+}
+
+int http_connection::relay_from(int from, size_t length, RelayHandler&& done) {
+    if (from < 0 || fd <= 0 || relaying()) return -1;
+
+    relayFd = from;
+    relayLeft = length;
+    relayPiped = 0;
+    relaycb = std::move(done);
+    relay_pump();
+    return 0;
+}
+
+/*
+ * buffered output goes first. then fill the pipe from relayFd and empty
+ * it into the socket, waiting on whichever side is not ready, only one
+ * of the two is watched at a time so neither spins
+ */
+void http_connection::relay_pump() {
+    if (!relaying()) return;
+    if (has_output()) {
+        get_reactor()->remove_read(relayFd);
+        get_reactor()->add_write(fd);
+        return;
+    }
+    if (!open_pipe()) {
+        relay_done(false);
+        return;
+    }
+
+    const size_t PIPE_BYTES = 64 * 1024;
+    while (relayLeft > 0) {
+        if (relayPiped < relayLeft && relayPiped < PIPE_BYTES) {
+            ssize_t n = ::splice(
+                relayFd, nullptr, pipefd[1], nullptr,
+                std::min(relayLeft - relayPiped, PIPE_BYTES - relayPiped),
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relayPiped += n;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                relay_done(false);  // the source ended early
+                return;
+            }
+        }
+
+        if (relayPiped == 0) {  // wait for the source
+            get_reactor()->remove_write(fd);
+            get_reactor()->add_read(relayFd);
+            return;
+        }
+
+        ssize_t m = ::splice(pipefd[0], nullptr, fd, nullptr, relayPiped,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (m > 0) {
+            relayPiped -= m;
+            relayLeft -= m;
+            thread->get_metrics()->add(METRIC_BYTES_OUT, m);
+        } else if (m == -1 && (errno == EAGAIN || errno == EINTR)) {
+            get_reactor()->remove_read(relayFd);  // wait for the socket
+            get_reactor()->add_write(fd);
+            return;
+        } else {
+            relay_done(false);
+            return;
+        }
     }
+
+    // the write handler closes or idles the connection as usual
+    get_reactor()->add_write(fd);
+    if (queuedAt) written();
+    relay_done(true);
+}
+
+void http_connection::relay_done(bool ok) {
+    auto done = std::move(relaycb);
+    relaycb = nullptr;
+    relayFd = -1;
+    relayLeft = relayPiped = 0;
+
+    if (!ok) {
+        // the pipe may hold bytes of the broken body
+        if (pipefd[0] >= 0) {
+            ::close(pipefd[0]);
+            ::close(pipefd[1]);
+            pipefd[0] = pipefd[1] = -1;
+        }
+        status = CLOSING;
+        get_reactor()->remove_read(fd);
+        get_reactor()->add_write(fd);
+    }
+    if (done) done(ok);
+}
+
+bool http_connection::splice_pending() const {
+    return bodyFd >= 0 && pipefd[0] >= 0 && incoming && !has_input() &&
+           incoming->body_remaining() > 0 && !readPaused;
+}
+
+void http_connection::splice_body() {
+    long left = incoming->body_remaining();
+
+    while (left > 0) {
+        ssize_t n = ::splice(fd, nullptr, pipefd[1], nullptr,
+                             std::min(left, 64L * 1024),
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {  // EOF or error, the body can not complete
+            if (n == -1)
+                LOG_DEBUG("splice from fd %d: %s", fd, strerror(errno));
+            get_reactor()->remove_read(fd);
+            status = CLOSING;
+            get_reactor()->add_write(fd);
+            return;
+        }
+
+        for (ssize_t m = n; m > 0;) {
+            ssize_t k = ::splice(pipefd[0], nullptr, bodyFd, nullptr, m,
+                                 SPLICE_F_MOVE);
+            if (k == -1 && errno == EINTR) continue;
+            if (k <= 0) {
+                LOG_WARN("splice to body fd: %s", strerror(errno));
+                get_reactor()->remove_read(fd);
+                status = CLOSING;
+                get_reactor()->add_write(fd);
+                return;
+            }
+            m -= k;
+        }
+
+        incoming->body_consumed(n);
+        left -= n;
+        thread->get_metrics()->add(METRIC_BYTES_IN, n);
+    }
+
+    parse_request();
+}
+
+/*
+ * a keep-alive connection waiting for the next request holds no buffer
+ */
+void http_connection::release_idle_buffers() {
+    if (status == CONNECTED && !incoming && !has_input() &&
+        !has_output())
+        release_buffers();
 }
 
 void http_connection::send_reply(http_code_t code, const std::string& reason,
                                  const std::string& content) {
-    if (content.empty()) return send_reply(code, reason, nullptr);
-    wxg::buffer buf;
-    buf.push(content);
-    send_reply(code, reason, &buf);
+    auto r = thread->get_response();
+    r->get_buffer()->push(content);
+    r->set_response(code, reason);
+    send_request(r.get());
+    thread->release_request(std::move(r));
 }
 
 void http_connection::send_reply(http_code_t code, const std::string& reason,
                                  buffer* content) {
-    wxg::request r;
-    r.set_response(code, reason, content);
-    send_request(&r);
+    auto r = thread->get_response();
+    r->set_response(code, reason, content);
+    send_request(r.get());
+    thread->release_request(std::move(r));
 }
 
 void http_connection::send_request(request* req) {
     req->send_to(get_write_buffer());
-    get_reactor()->add_write(fd);
+    output_added();
+}
+
+void http_connection::send_data(const char* data, size_t length) {
+    get_write_buffer()->push((void*)data, length);
+    output_added();
+}
+
+void http_connection::send_data(const std::shared_ptr<const std::string>& data) {
+    push(data);
+    output_added();
+}
+
+void http_connection::send_file(const std::shared_ptr<const file>& f,
+                                off_t offset, size_t length) {
+    push(f, offset, length);
+    output_added();
+}
+
+stream_writer* http_connection::start_stream(http_code_t code,
+                                             const std::string& reason) {
+    if (!writer) writer = std::make_unique<stream_writer>(this);
+    writer->start(code, reason);
+    return writer.get();
+}
+
+websocket* http_connection::upgrade_websocket(request* req,
+                                              const std::string& protocol) {
+    if (!websock) websock = std::make_unique<websocket>(this);
+    if (websock->start(req, protocol) == -1) {
+        websock.reset();
+        return nullptr;
+    }
+    return websock.get();
 }
 
 void http_connection::send_chunk_start(http_code_t code,
                                        const std::string& reason) {
-    wxg::request r;
-    r.set_response(code, reason);
-    r.set_header("Transfer-Encoding", "chunked");
-    send_request(&r);
+    start_stream(code, reason)->set_coalesce(0, 0);
 }
 
 void http_connection::send_chunk(wxg::buffer* buf) {
-    std::stringstream ss;
-    ss << std::hex << buf->length();
-    push(ss.str() + "\r\n");
-    push(buf);
-    push("\r\n");
-    get_reactor()->add_write(fd);
+    if (writer && writer->active()) {
+        writer->write(buf);
+        return;
+    }
+
+    // the head was sent by hand, frame the chunk here
+    if (buf->empty()) return;
+    char head[24];
+    int n = std::snprintf(head, sizeof(head), "%zx\r\n", buf->length());
+    get_write_buffer()->push(head, n);
+    get_write_buffer()->push(buf);
+    get_write_buffer()->push((void*)"\r\n", 2);
+    output_added();
 }
 
 void http_connection::send_chunk_end() {
-    push("0\r\n\r\n");
-    get_reactor()->add_write(fd);
+    if (writer && writer->active()) {
+        writer->end();
+        return;
+    }
+
+    get_write_buffer()->push((void*)"0\r\n\r\n", 5);
+    output_added();
+}
+
+void http_connection::set_output_watermarks(size_t high, size_t low) {
+    highWatermark = high;
+    lowWatermark = low < high ? low : high / 2;
+}
+
+void http_connection::set_watermark_handler(WatermarkHandler&& handler) {
+    watermarkcb = handler;
+}
+
+void http_connection::output_added() {
+    if (stream)
+        stream->session->output_added(stream);
+    else
+        get_reactor()->add_write(fd);
+
+    if (paused || highWatermark == 0 || output_length() < highWatermark)
+        return;
+
+    paused = true;
+    if (!stream) get_reactor()->remove_read(fd);
+    if (watermarkcb) watermarkcb(this, true);
+}
+
+void http_connection::output_drained() {
+    if (output_length() > lowWatermark) return;
+
+    if (paused) {
+        paused = false;
+        if (status == CONNECTED && !readPaused && !stream)
+            get_reactor()->add_read(fd);
+        if (watermarkcb) watermarkcb(this, false);
+
+        // pipelined requests left in the read buffer
+        if (status == CONNECTED && has_input()) parse_request();
+    }
+
+    if (writer) writer->drained();
 }
 
 void http_connection::close() {
+    if (stream) {  // resets the stream, the connection carries on
+        stream->session->close_stream(stream);
+        return;
+    }
+
     if (fd > 0) {
+        trace::emit(TRACE_CLOSE, TRACE_INSTANT, fd);
+        // the poller must forget fd too, its number comes back with the
+        // next accept and may land on this thread again
+        get_reactor()->remove_read(fd);
+        get_reactor()->remove_write(fd);
         get_reactor()->erase(fd);
         shutdown(fd, SHUT_WR);
         ::close(fd);
 
-        thread->release_connection(fd);
+        int closed = fd;
         fd = -1;
+        reset_state();
+
+        // may hand this connection to the pool, so it comes last
+        thread->release_connection(closed);
+    }
+}
+
+/* drop whatever a closed connection or stream was doing */
+void http_connection::reset_state() {
+    release_buffers(true);
+    status = CLOSED;
+    paused = false;
+    watermarkcb = nullptr;
+    if (writer) writer->cancel();
+    if (websock) websock->cancel();
+    if (h2) h2->cancel();
+    relayFd = -1;
+    relayLeft = relayPiped = 0;
+    relaycb = nullptr;
+    if (incoming) thread->release_request(std::move(incoming));
+    incomingRoute = nullptr;
+    started = readPaused = false;
+    bodyFd = -1;
+    if (pipefd[0] >= 0) {
+        ::close(pipefd[0]);
+        ::close(pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
+    }
 
-        get_write_buffer()->clear();
-        get_read_buffer()->clear();
-        status = CLOSED;
-        std::queue<std::unique_ptr<request>>().swap(requests);
+    if (closecb) {
+        auto cb = std::move(closecb);
+        closecb = nullptr;
+        cb(this);
     }
 }
 
+/*
+ * answer Upgrade: h2c with 101 and go on in http/2, the request becomes
+ * stream 1. -1 to serve it as http/1.1 without usable HTTP2-Settings
+ */
+int http_connection::upgrade_http2(request* req) {
+    std::string settings;
+    if (!has_token(req->get_header("Connection"), "HTTP2-Settings") ||
+        !base64_decode(req->get_header("HTTP2-Settings"), settings) ||
+        settings.size() % 6 != 0)
+        return -1;
+
+    static const char head[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    send_data(head, sizeof(head) - 1);
+    h2 = std::make_unique<http2_session>(this);
+    h2->start(req, settings);
+    return 0;
+}
+
+/*
+ * a combined log format line for req, status and bytes are of the
+ * response queued by the handler, "-" for one sent later
+ */
+static void access_log(const http_connection* conn, const request* req,
+                       const buffer* out, size_t outBefore, size_t bytes) {
+    static const char* methods[] = {"GET", "POST", "HEAD"};
+    char status[4] = "-", length[24] = "-";
+    if (out && out->length() >= outBefore + 12 &&
+        std::memcmp(out->get() + outBefore, "HTTP/", 5) == 0)
+        std::memcpy(status, out->get() + outBefore + 9, 3);
+
+    if (bytes) snprintf(length, sizeof(length), "%zu", bytes);
+
+    char when[32];
+    logger::clf_time(when, sizeof(when));
+    const std::string& referer = req->get_header("Referer");
+    const std::string& agent = req->get_header("User-Agent");
+    logger::access("%s - - [%s] \"%s %s HTTP/%d.%d\" %s %s \"%s\" \"%s\"",
+                   conn->address.c_str(), when, methods[req->type],
+                   (req->target.empty() ? req->uri : req->target).c_str(),
+                   req->major, req->minor, status, length,
+                   referer.empty() ? "-" : referer.c_str(),
+                   agent.empty() ? "-" : agent.c_str());
+}
+
 void http_connection::handle_request(request* req) {
     if (!req) return;
 
@@ -187,28 +664,70 @@ void http_connection::handle_request(request* req) {
     }
 
     auto server = thread->get_server();
+    thread->get_metrics()->add(METRIC_REQUESTS);
 
-    if (server->requestHandlers.count(req->uri)) {
-        server->requestHandlers.at(req->uri)(req, this);
+    if (!stream && server->http2 && req->type != POST &&
+        has_token(req->get_header("Upgrade"), "h2c") && upgrade_http2(req) == 0)
         return;
+
+    const route* matched =
+        started ? incomingRoute
+                : server->routes.lookup(req->type, req->uri, &req->params);
+    incomingRoute = nullptr;
+    bodyFd = -1;
+
+    route_latencies* latencies = thread->get_latencies();
+    int id = matched ? matched->id : 0;
+    uint64_t parsed = cycle_clock::now();
+    if (!stream) trace::emit(TRACE_PARSE, TRACE_END, fd);
+    if (!stream && startedAt) {
+        if (acceptedAt)
+            latencies->record(id, LATENCY_ACCEPT,
+                              cycle_clock::to_ns(startedAt - acceptedAt));
+        latencies->record(id, LATENCY_READ,
+                          cycle_clock::to_ns(parsed - startedAt));
     }
+    acceptedAt = 0;
 
-    for (const auto& kv : server->requestHandlers) {
-        auto v1 = split(kv.first, '/');
-        auto v2 = split(req->uri, '/');
+    bool logged = logger::access_enabled();
+    size_t outBefore = logged ? get_write_buffer()->length() : 0;
+    size_t queuedBefore = logged ? output_length() : 0;
 
-        if (v1.size() != v2.size()) continue;
+    trace::emit(TRACE_HANDLER, TRACE_BEGIN, fd, id);
+    dispatch(req, matched);
+    trace::emit(TRACE_HANDLER, TRACE_END, fd, id);
 
-        bool flag = true;
-        for (size_t i = 0; i < v1.size(); i++)
-            if (v1[i] != v2[i] && v1[i] != "*") {
-                flag = false;
-                break;
-            }
-        if (flag) {
-            kv.second(req, this);
-            return;
-        }
+    if (logged) {
+        size_t queued = output_length();
+        access_log(this, req, get_write_buffer(), outBefore,
+                   queued > queuedBefore ? queued - queuedBefore : 0);
+    }
+
+    uint64_t handled = cycle_clock::now();
+    latencies->record(id, LATENCY_HANDLER,
+                      cycle_clock::to_ns(handled - parsed));
+    // pipelined responses are timed from the first of them
+    if (!stream && !queuedAt && has_output()) {
+        queuedAt = handled;
+        queuedRoute = id;
+        trace::emit(TRACE_RESPONSE, TRACE_BEGIN, fd, id);
+    }
+}
+
+void http_connection::dispatch(request* req, const route* matched) {
+    auto server = thread->get_server();
+
+    if (matched && matched->streaming()) {
+        if (!started && matched->headers) matched->headers(req, this);
+        started = false;
+        if (matched->complete) matched->complete(req, this);
+        return;
+    }
+    started = false;
+
+    if (matched) {
+        matched->handler(req, this);
+        return;
     }
 
     if (server->generalHandler) {
@@ -216,12 +735,23 @@ void http_connection::handle_request(request* req) {
         return;
     }
 
-    request r;
-    r.uri = req->uri;
-    r.set_response(HTTP_NOTFOUND, "NOT FOUND");
+    auto r = thread->get_response();
+    r->uri = req->uri;
+    r->set_response(HTTP_NOTFOUND, "NOT FOUND");
     if (req->get_header("Connection") == "close")
-        r.set_header("Connection", "close");
-    r.send_to(get_write_buffer());
+        r->set_header("Connection", "close");
+    r->send_to(get_write_buffer());
+    thread->release_request(std::move(r));
+    output_added();
+}
+
+/* the output queued after a handler is all written */
+void http_connection::written() {
+    uint64_t now = cycle_clock::now();
+    thread->get_latencies()->record(queuedRoute, LATENCY_WRITE,
+                                    cycle_clock::to_ns(now - queuedAt));
+    queuedAt = 0;
+    trace::emit(TRACE_RESPONSE, TRACE_END, fd, queuedRoute);
 }
 
 }  // namespace wxg
\ No newline at end of file
@@ -5,7 +5,10 @@
 #include <core/epoll.hh>
 #include <model/reactor.hh>
 
+#include "http2.hh"
 #include "request.hh"
+#include "stream_writer.hh"
+#include "websocket.hh"
 
 #include <queue>
 #include <string>
@@ -15,20 +18,77 @@ namespace wxg {
 enum connection_status_t { CONNECTED = 0, CLOSING, CLOSED };
 
 class http_thread;
+class http_connection;
+
+/* called with true when output crosses the high watermark, false when it
+ * drains to the low watermark */
+using WatermarkHandler = std::function<void(http_connection*, bool paused)>;
+/* relayed body fully sent, or not when either side failed */
+using RelayHandler = std::function<void(bool ok)>;
+using CloseHandler = std::function<void(http_connection*)>;
+
 class http_connection : public connection {
+   private:
+    size_t highWatermark = 0;
+    size_t lowWatermark = 0;
+    bool paused = false;
+    WatermarkHandler watermarkcb;
+
+    /* streaming of the incoming body */
+    const route* incomingRoute = nullptr;
+    bool started = false;  // headers of incoming were dispatched
+    bool readPaused = false;
+    bool parsing = false;
+    int bodyFd = -1;
+    int pipefd[2] = {-1, -1};
+
+    std::unique_ptr<stream_writer> writer;
+
+    /* body moved from another socket, see relay_from */
+    int relayFd = -1;
+    size_t relayLeft = 0;   // bytes not written to the socket yet
+    size_t relayPiped = 0;  // of those, bytes waiting in the pipe
+    RelayHandler relaycb;
+
+    CloseHandler closecb;
+
+    std::unique_ptr<websocket> websock;  // after an upgrade
+
+    std::unique_ptr<http2_session> h2;  // after the preface or an upgrade
+    http2_stream* stream = nullptr;     // for the handlers of a stream
+
+    /* cycle_clock ticks for the latency histograms of the thread */
+    uint64_t readAt = 0;     // of the last read
+    uint64_t startedAt = 0;  // first byte of incoming
+    uint64_t queuedAt = 0;   // output after a handler, not written yet
+    int queuedRoute = 0;
+
+    friend class stream_writer;
+    friend class websocket;
+    friend class http2_session;
+
    public:
     http_thread* thread = nullptr;
 
-    std::queue<std::unique_ptr<request>> requests;
+    /* request being parsed, taken from the thread's request pool */
+    std::unique_ptr<request> incoming;
 
     connection_status_t status = CLOSED;
 
+    uint64_t acceptedAt = 0;  // until the first request is parsed
+
    public:
     http_connection(http_thread* thread, int _fd, const std::string& _addr,
                     unsigned short _port);
+    /* without a socket, for the streams of http/2 connections */
+    explicit http_connection(http_thread* thread);
     ~http_connection();
 
     void setup_new_events();
+    /* carry stream s of the http/2 connection parent */
+    void setup_stream(http2_stream* s, const http_connection* parent);
+    /* a stream of an http/2 connection, there is no socket to relay to */
+    inline bool is_stream() const { return stream != nullptr; }
 
     reactor<epoll>* get_reactor() const;
 
@@ -41,15 +101,107 @@ class http_connection : public connection {
 
     void send_request(request* req);
 
+    /* raw bytes after the output so far, for bodies built in pieces */
+    void send_data(const char* data, size_t length);
+    /* shared bytes, queued without copying */
+    void send_data(const std::shared_ptr<const std::string>& data);
+    /* length bytes of f from offset, written with sendfile(2) */
+    void send_file(const std::shared_ptr<const file>& f, off_t offset,
+                   size_t length);
+
+    /*
+     * begin a chunked response, the returned writer stays valid until
+     * the next start_stream or close
+     */
+    stream_writer* start_stream(http_code_t code, const std::string& reason);
+
+    /*
+     * answer a websocket handshake with 101, from here on the connection
+     * carries frames. null after replying with an error when req is no
+     * valid handshake. the websocket lives until the connection closes
+     */
+    websocket* upgrade_websocket(request* req,
+                                 const std::string& protocol = "");
+
+    /*
+     * chunked response without coalescing, see start_stream. send_chunk
+     * and send_chunk_end also frame a body whose chunked head was sent
+     * with send_request
+     */
     void send_chunk_start(http_code_t code, const std::string& reason);
 
     void send_chunk(wxg::buffer* buf);
     void send_chunk_end();
 
+    /*
+     * above high bytes of pending output the connection stops reading and
+     * parsing requests, it resumes when output drains to low.
+     * 0 for high disables the limit
+     */
+    void set_output_watermarks(size_t high, size_t low);
+    void set_watermark_handler(WatermarkHandler&& handler);
+    inline bool output_paused() const { return paused; }
+
+    /*
+     * flow control for streaming handlers, while paused nothing is read
+     * from the socket and no body is delivered
+     */
+    void pause_reading();
+    void resume_reading();
+
+    /*
+     * from a streaming headers handler: write the rest of the body to fd,
+     * with a known length it is moved with splice(2) and never copied to
+     * user space. the complete handler runs when the body is written
+     */
+    int splice_body_to(int fd);
+
+    /*
+     * after the output so far, move length bytes from the socket fd to
+     * this one with splice(2) through a pipe. the caller watches fd for
+     * reading and calls relay_pump when it is readable. a failed relay
+     * closes this connection after done ran
+     */
+    int relay_from(int fd, size_t length, RelayHandler&& done);
+    void relay_pump();
+    inline bool relaying() const { return relayFd >= 0; }
+
+    /* runs once when the connection closes, for work still pending on it */
+    void set_close_handler(CloseHandler&& handler) {
+        closecb = std::move(handler);
+    }
+    /* like set_close_handler, after the handler set so far */
+    void add_close_handler(CloseHandler&& handler) {
+        if (!closecb) {
+            closecb = std::move(handler);
+            return;
+        }
+        closecb = [first = std::move(closecb),
+                   then = std::move(handler)](http_connection* c) {
+            first(c);
+            then(c);
+        };
+    }
+
     void close();
 
    private:
     void handle_request(request* req);
+    void dispatch(request* req, const route* matched);
+    void written();
+    int upgrade_http2(request* req);
+    void release_idle_buffers();
+    void reset_state();
+
+    void output_added();
+    void output_drained();
+
+    bool parse_ready() const;
+    void start_request(request* req);
+    bool splice_pending() const;
+    void splice_body();
+    bool open_pipe();
+    void relay_done(bool ok);
 };
 
 }  // namespace wxg
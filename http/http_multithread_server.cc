@@ -1,6 +1,10 @@
 #include "http_multithread_server.hh"
 #include "http_thread.hh"
 
+#include <fcntl.h>
+
+#include <csignal>
+
 namespace wxg {
 
 void http_multithread_server::wakeup_random(int n) {
@@ -8,6 +12,36 @@ void http_multithread_server::wakeup_random(int n) {
     for (int i = 0; i < n; i++) threads[rand() % size]->wakeup();
 }
 
+RequestHandler http_multithread_server::metrics_handler() {
+    return [this](request *req, http_connection *conn) {
+        auto r = conn->thread->get_response();
+        r->get_buffer()->push(render_metrics());
+        r->set_response(HTTP_OK, "OK");
+        r->set_header("Content-Type", "text/plain; version=0.0.4");
+        conn->send_request(r.get());
+        conn->thread->release_request(std::move(r));
+    };
+}
+
+RequestHandler http_multithread_server::trace_handler() {
+    return [](request *req, http_connection *conn) {
+        auto r = conn->thread->get_response();
+        r->get_buffer()->push(trace::dump());
+        r->set_response(HTTP_OK, "OK");
+        r->set_header("Content-Type", "application/json");
+        conn->send_request(r.get());
+        conn->thread->release_request(std::move(r));
+    };
+}
+
+int http_multithread_server::set_access_log(const std::string &path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0644);
+    if (fd < 0) return -1;
+    logger::set_access_log(fd);
+    return 0;
+}
+
 void http_multithread_server::init() {
     pool_->resize(size);
 
@@ -18,19 +52,22 @@ void http_multithread_server::init() {
 void http_multithread_server::start(const std::string &address,
                                     unsigned short port) {
     init();
+    logger::start();
+    // a client gone in the middle of a response fails the write with
+    // EPIPE, instead of killing the process
+    ::signal(SIGPIPE, SIG_IGN);
 
     int fd = tcp::get_nonblock_socket();
     tcp::bind(fd, address, port);
     tcp::listen(fd);
 
     reactor_->set_read_handler(fd, [fd, this]() {
-        std::string addr;
-        unsigned short port;
-        int clientfd = tcp::accept(fd, addr, port);
-        if (clientfd <= 0) return;
+        accepted_client client;
+        client.fd = tcp::accept(fd, client.address, client.port);
+        if (client.fd <= 0) return;
+        client.acceptedAt = cycle_clock::now();
 
-        threads[index]->clientQueue.push(
-            std::make_pair(clientfd, std::make_pair(addr, port)));
+        threads[index]->clientQueue.push(std::move(client));
 
         threads[index]->wakeup();
 
@@ -38,9 +75,20 @@ void http_multithread_server::start(const std::string &address,
     });
 
     for (int i = 0; i < size; i++)
-        pool_->push([this, i]() { threads[i]->loop(); });
+        pool_->push([this, i]() {
+            trace::set_thread_name("http " + std::to_string(i));
+            threads[i]->loop();
+        });
+
+    if (stallMs && watchdogMs) {
+        for (int i = 0; i < size; i++)
+            watchdog.watch("thread " + std::to_string(i),
+                           threads[i]->get_reactor()->get_profile());
+        watchdog.start(watchdogMs);
+    }
 
     cout << "running on " << address << ":" << port << endl;
+    trace::set_thread_name("accept");
     reactor_->loop();
 }
 
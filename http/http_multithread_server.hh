@@ -6,6 +6,8 @@
 #include <model/reactor.hh>
 
 #include "http_thread.hh"
+#include "metrics.hh"
+#include "router.hh"
 
 #include <functional>
 #include <string>
@@ -15,9 +17,6 @@ using std::string;
 
 namespace wxg {
 
-class request;
-using RequestHandler = std::function<void(request *, http_connection *)>;
-
 class http_multithread_server {
    private:
     std::unique_ptr<thread_pool> pool_ = nullptr;
@@ -31,9 +30,29 @@ class http_multithread_server {
     /* <fd, <address, port>> */
     // lock_queue<pair<int, pair<string, unsigned short>>> clientQueue;
 
-    std::map<string, RequestHandler> requestHandlers;
+    router routes;
     RequestHandler generalHandler;
 
+    metrics_registry metrics;
+
+    /* per thread pool limits, read when threads are created */
+    size_t maxIdleConnections = 1024;
+    size_t maxIdleBuffers = 4096;
+    size_t maxBufferBlock = 16 * 1024;
+    size_t maxIdleRequests = 1024;
+
+    /* per connection output limits, see http_connection */
+    size_t outputHighWatermark = 4 * 1024 * 1024;
+    size_t outputLowWatermark = 1024 * 1024;
+
+    /* cleartext http/2 by prior knowledge or Upgrade: h2c */
+    bool http2 = true;
+
+    /* loop profiling, see set_loop_profiling */
+    uint64_t stallMs = 0;
+    uint64_t watchdogMs = 0;
+    loop_watchdog watchdog;
+
    public:
     http_multithread_server() {
         pool_ = std::make_unique<thread_pool>();
@@ -43,14 +62,89 @@ class http_multithread_server {
 
     inline void resize(int n) { size = n; }
 
+    /* keep at most n closed connections per thread for reuse */
+    inline void set_connection_pool_size(size_t n) { maxIdleConnections = n; }
+    /*
+     * keep at most n idle buffers per thread, a buffer grown beyond
+     * maxBlock bytes has its storage freed before it is pooled
+     */
+    inline void set_buffer_pool_size(size_t n, size_t maxBlock = 16 * 1024) {
+        maxIdleBuffers = n;
+        maxBufferBlock = maxBlock;
+    }
+    /* keep at most n recycled request objects per thread */
+    inline void set_request_pool_size(size_t n) { maxIdleRequests = n; }
+    /* default output watermarks of new connections, 0 disables */
+    inline void set_output_watermarks(size_t high, size_t low) {
+        outputHighWatermark = high;
+        outputLowWatermark = low;
+    }
+
+    inline void set_http2(bool on) { http2 = on; }
+
+    /*
+     * profile the loops of the threads, callbacks running over stall ms
+     * are reported when they return. with watchdog ms, a thread checks
+     * that no loop stays away from listen longer and reports it while it
+     * is stuck. 0 for stall disables both, set before start
+     */
+    inline void set_loop_profiling(uint64_t stall, uint64_t watchdog = 0) {
+        stallMs = stall;
+        watchdogMs = watchdog;
+    }
+
+    /*
+     * append a line in the combined log format to path for each request,
+     * written by the log writer thread. -1 when path cannot be opened
+     */
+    int set_access_log(const std::string &path);
+
     inline void set_request_handler(const std::string &uri,
                                     RequestHandler &&handler) {
-        requestHandlers[uri] = handler;
+        routes.add(router::ANY, uri, std::move(handler));
+    }
+    inline void set_request_handler(request_type_t method,
+                                    const std::string &uri,
+                                    RequestHandler &&handler) {
+        routes.add(method, uri, std::move(handler));
+    }
+    /*
+     * streaming route: headers runs once the request headers are parsed,
+     * body for each piece of the body as it arrives, complete after the
+     * last piece. any of them may be empty
+     */
+    inline void set_stream_handler(request_type_t method,
+                                   const std::string &uri,
+                                   RequestHandler &&headers, BodyHandler &&body,
+                                   RequestHandler &&complete) {
+        route r;
+        r.headers = std::move(headers);
+        r.body = std::move(body);
+        r.complete = std::move(complete);
+        routes.add(method, uri, std::move(r));
     }
     inline void set_general_handler(RequestHandler &&handler) {
         generalHandler = handler;
     }
 
+    /* the metrics of all threads in the prometheus text format */
+    std::string render_metrics() const {
+        return metrics.render(threads, routes,
+                              watchdogMs ? &watchdog : nullptr);
+    }
+    /* add the latencies of a route id and phase on every thread to into */
+    void merge_latency(int route, latency_phase_t phase,
+                       latency_histogram *into) const {
+        metrics_registry::merge_latency(threads, route, phase, into);
+    }
+    /* a handler answering with render_metrics, for a /metrics route */
+    RequestHandler metrics_handler();
+    /*
+     * a handler answering with trace::dump, for loading into a trace
+     * viewer. records are kept only while trace::enable(true)
+     */
+    RequestHandler trace_handler();
+
     void wakeup_random(int n);
     void init();
     void start(const std::string &address, unsigned short port);
@@ -0,0 +1,678 @@
+#include "http_proxy.hh"
+#include "http_connection.hh"
+#include "http_thread.hh"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+namespace wxg {
+
+/* per thread state of one proxy, every callback runs on that thread */
+class proxy_pool {
+   private:
+    http_proxy *proxy;
+    http_thread *thread;
+    reactor<epoll> *reactor_;
+
+    std::vector<std::unique_ptr<proxy_connection>> conns;
+    std::vector<std::unique_ptr<proxy_call>> freeCalls;
+    std::string head;  // response head being built
+
+    // closed connections, freed on the next turn of the loop
+    std::vector<std::unique_ptr<proxy_connection>> retired;
+    int reapTimer = -1;
+
+   public:
+    proxy_pool(http_proxy *p, http_thread *t)
+        : proxy(p), thread(t), reactor_(t->get_reactor()) {}
+    ~proxy_pool() {
+        for (auto &conn : conns) ::close(conn->fd);
+        for (auto &conn : retired) ::close(conn->fd);
+    }
+
+    std::unique_ptr<proxy_call> get_call();
+    void start(std::unique_ptr<proxy_call> c);
+
+    void on_timeout(proxy_call *c);
+    void on_client_close(proxy_call *c);
+
+   private:
+    proxy_connection *acquire(upstream *up);
+    proxy_connection *open(upstream *up);
+
+    void on_read(proxy_connection *conn);
+    void on_write(proxy_connection *conn);
+
+    void parse(proxy_connection *conn);
+    void reply(proxy_connection *conn, parse_status_t status);
+    void relayed(proxy_connection *conn, bool ok);
+    void done(proxy_connection *conn);
+    void broken(proxy_connection *conn, bool refused);
+    void retry(std::unique_ptr<proxy_call> c);
+
+    void fail(std::unique_ptr<proxy_call> c, http_code_t code,
+              const std::string &reason);
+    void release(std::unique_ptr<proxy_call> c);
+    void close(proxy_connection *conn);
+    void reap();
+};
+
+/* headers that describe one connection and are not forwarded */
+static bool hop_by_hop(const string_ref &name, const string &connection) {
+    static const char *const names[] = {
+        "Connection", "Keep-Alive",        "Proxy-Connection", "TE",
+        "Trailer",    "Transfer-Encoding", "Upgrade",          "Content-Length",
+    };
+    for (auto n : names)
+        if (equal_nocase(name, n)) return true;
+
+    // and those the Connection header names
+    return has_token(connection, name);
+}
+
+/* fnv-1a with a final mix, ring points of one upstream spread evenly */
+static uint32_t hash32(const string_ref &s) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < s.size(); i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static const char *method_name(request_type_t type) {
+    switch (type) {
+        case POST:
+            return "POST";
+        case HEAD:
+            return "HEAD";
+        default:
+            return "GET";
+    }
+}
+
+http_proxy::http_proxy(balance_t b) : balance(b) {
+    static std::atomic<int> ids{0};
+    id = ids++;
+}
+
+int http_proxy::add_upstream(const std::string &address, unsigned short port) {
+    auto up = std::make_unique<upstream>();
+    up->address = address;
+    up->port = port;
+    up->hostPort = address + ":" + std::to_string(port);
+
+    std::memset(&up->addr, 0, sizeof(up->addr));
+    up->addr.sin_family = AF_INET;
+    up->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &up->addr.sin_addr) != 1) {
+        struct addrinfo hints, *res = nullptr;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (::getaddrinfo(address.c_str(), nullptr, &hints, &res) != 0)
+            return -1;
+        up->addr.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    }
+
+    for (int i = 0; i < VNODES; i++)
+        ring.emplace_back(hash32(up->hostPort + "#" + std::to_string(i)),
+                          up.get());
+    std::sort(ring.begin(), ring.end(),
+              [](const std::pair<uint32_t, upstream *> &a,
+                 const std::pair<uint32_t, upstream *> &b) {
+                  return a.first < b.first;
+              });
+
+    upstreams.push_back(std::move(up));
+    return 0;
+}
+
+upstream *http_proxy::select(request *req) {
+    return pick(balance == CONSISTENT_HASH ? hash32(req->uri) : 0);
+}
+
+/* upstreams that refused a connection lately are skipped unless all did */
+upstream *http_proxy::pick(uint32_t hash) {
+    size_t n = upstreams.size();
+    if (n == 0) return nullptr;
+
+    time_t now = ::time(nullptr);
+    auto alive = [now](const upstream *up) { return up->downUntil <= now; };
+
+    if (balance == CONSISTENT_HASH) {
+        auto it = std::lower_bound(
+            ring.begin(), ring.end(), hash,
+            [](const std::pair<uint32_t, upstream *> &p, uint32_t h) {
+                return p.first < h;
+            });
+        for (size_t i = 0; i < ring.size(); i++, ++it) {
+            if (it == ring.end()) it = ring.begin();
+            if (alive(it->second)) return it->second;
+        }
+        return it == ring.end() ? ring.front().second : it->second;
+    }
+
+    size_t start = next++;
+    upstream *best = nullptr;
+    for (size_t i = 0; i < n; i++) {
+        upstream *up = upstreams[(start + i) % n].get();
+        if (!alive(up)) continue;
+        if (balance == ROUND_ROBIN) return up;
+        if (!best || up->active < best->active) best = up;
+    }
+    return best ? best : upstreams[start % n].get();
+}
+
+proxy_pool *http_proxy::get_pool(http_thread *thread) {
+    static thread_local std::unordered_map<int, std::unique_ptr<proxy_pool>>
+        pools;
+    auto &p = pools[id];
+    if (!p) p = std::make_unique<proxy_pool>(this, thread);
+    return p.get();
+}
+
+void http_proxy::forward(request *req, http_connection *conn) {
+    uint32_t hash = balance == CONSISTENT_HASH ? hash32(req->uri) : 0;
+    upstream *up = pick(hash);
+    if (!up) {
+        conn->send_reply(HTTP_BADGATEWAY, "Bad Gateway", "502 Bad Gateway");
+        return;
+    }
+
+    proxy_pool *pool = get_pool(conn->thread);
+    auto c = pool->get_call();
+    c->client = conn;
+    c->up = up;
+    c->hash = hash;
+    c->head = req->type == HEAD;
+    c->idempotent = req->type != POST;
+
+    // the request line as received, hop-by-hop headers dropped
+    buffer *out = &c->data;
+    out->push(method_name(req->type));
+    out->push((void *)" ", 1);
+    out->push(req->target.empty() ? req->uri : req->target);
+    out->push((void *)" HTTP/1.1\r\n", 11);
+
+    const string &connection = req->get_header("Connection");
+    bool host = false;
+    string forwarded;
+    for (const auto &kv : req->get_headers()) {
+        if (hop_by_hop(kv.first, connection)) continue;
+        if (equal_nocase(kv.first, "X-Forwarded-For")) {
+            forwarded = kv.second + ", ";
+            continue;
+        }
+        if (equal_nocase(kv.first, "Host")) host = true;
+        out->push(kv.first);
+        out->push((void *)": ", 2);
+        out->push(kv.second);
+        out->push((void *)"\r\n", 2);
+    }
+    if (!host) out->push("Host: " + up->hostPort + "\r\n");
+    out->push("X-Forwarded-For: " + forwarded + conn->address + "\r\n");
+
+    buffer *body = req->get_buffer();
+    if (req->type == POST || body->length() > 0)
+        out->push("Content-Length: " + std::to_string(body->length()) +
+                  "\r\n");
+    out->push((void *)"\r\n", 2);
+    out->push(body);
+
+    up->active++;
+    conn->pause_reading();
+    proxy_call *p = c.get();
+    conn->set_close_handler(
+        [pool, p](http_connection *) { pool->on_client_close(p); });
+
+    if (timeoutMs > 0)
+        c->timerId = conn->get_reactor()->get_time_manager()->set_timer(
+            timeoutMs / 1000, timeoutMs % 1000 * 1000, false,
+            [pool, p]() {
+                p->timerId = -1;
+                pool->on_timeout(p);
+            });
+
+    pool->start(std::move(c));
+}
+
+std::unique_ptr<proxy_call> proxy_pool::get_call() {
+    if (freeCalls.empty()) return std::make_unique<proxy_call>();
+
+    auto c = std::move(freeCalls.back());
+    freeCalls.pop_back();
+    return c;
+}
+
+void proxy_pool::start(std::unique_ptr<proxy_call> c) {
+    proxy_connection *conn = acquire(c->up);
+    if (!conn) {
+        c->up->downUntil = ::time(nullptr) + http_proxy::DOWN_SECONDS;
+        if (c->idempotent && !c->retried) {
+            retry(std::move(c));
+            return;
+        }
+        fail(std::move(c), HTTP_BADGATEWAY, "Bad Gateway");
+        return;
+    }
+
+    // an idempotent request keeps its copy for a retry
+    if (c->idempotent && !c->retried)
+        conn->get_write_buffer()->push((void *)c->data.get(),
+                                       c->data.length());
+    else
+        conn->get_write_buffer()->push(&c->data);
+
+    c->conn = conn;
+    conn->call = std::move(c);
+    if (conn->connected) reactor_->add_write(conn->fd);
+}
+
+proxy_connection *proxy_pool::acquire(upstream *up) {
+    for (auto &conn : conns) {
+        if (conn->up != up || conn->call || conn->closing) continue;
+        conn->reused = true;
+        return conn.get();
+    }
+    return open(up);
+}
+
+proxy_connection *proxy_pool::open(upstream *up) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_WARN("socket: %s", strerror(errno));
+        return nullptr;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(fd, (struct sockaddr *)&up->addr, sizeof(up->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    auto conn = std::make_unique<proxy_connection>();
+    conn->fd = fd;
+    conn->address = up->address;
+    conn->port = up->port;
+    conn->pool = thread->get_buffer_pool();
+    conn->up = up;
+
+    proxy_connection *p = conn.get();
+    reactor_->set_read_handler(fd, [this, p]() { on_read(p); });
+    reactor_->set_write_handler(fd, [this, p]() { on_write(p); });
+
+    conns.push_back(std::move(conn));
+    return p;
+}
+
+void proxy_pool::on_write(proxy_connection *conn) {
+    if (!conn->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+            err != 0) {
+            broken(conn, true);
+            return;
+        }
+        conn->connected = true;
+    }
+
+    if (conn->has_output()) {
+        int n = conn->write();
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            broken(conn, false);
+            return;
+        }
+    }
+    if (!conn->has_output()) reactor_->remove_write(conn->fd);
+}
+
+void proxy_pool::on_read(proxy_connection *conn) {
+    // the client takes the body straight from the socket
+    if (conn->call && conn->call->client->relaying()) {
+        conn->call->client->relay_pump();
+        return;
+    }
+
+    // a refused connect may be noticed here before on_write
+    int n = conn->read();
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR) broken(conn, !conn->connected);
+        return;
+    }
+
+    if (!conn->call) {  // an idle connection closed or said something
+        close(conn);
+        return;
+    }
+
+    if (n > 0) {
+        parse(conn);
+        return;
+    }
+
+    // a body without length ends with the connection
+    request *r = conn->response.get();
+    if (r && conn->call->replied && r->body_until_close()) {
+        conn->call->client->send_data("0\r\n\r\n", 5);
+        conn->keepalive = false;
+        done(conn);
+        return;
+    }
+    broken(conn, false);
+}
+
+void proxy_pool::parse(proxy_connection *conn) {
+    while (conn->call && conn->has_input()) {
+        if (!conn->response) {
+            conn->response = thread->get_response();
+            conn->response->stopAtBody = true;
+        }
+
+        request *r = conn->response.get();
+        parse_status_t status = r->parse(conn->get_read_buffer());
+        if (status == CORRUPTED) {
+            broken(conn, false);
+            return;
+        }
+        if (status == NEEDMORE) return;
+
+        if (conn->call->replied) {  // the body ended
+            if (conn->call->rechunk)
+                conn->call->client->send_data("0\r\n\r\n", 5);
+            done(conn);
+            return;
+        }
+
+        if (r->response_code < 200) {  // interim response
+            thread->release_request(std::move(conn->response));
+            continue;
+        }
+
+        reply(conn, status);
+        return;
+    }
+}
+
+/*
+ * send the response head to the client. a known length is relayed with
+ * splice once the bytes read with the head are out, other bodies go
+ * through a sink that chunks them again
+ */
+void proxy_pool::reply(proxy_connection *conn, parse_status_t status) {
+    proxy_call *c = conn->call.get();
+    request *r = conn->response.get();
+    http_connection *client = c->client;
+
+    c->replied = true;
+    if (c->timerId >= 0) {
+        reactor_->get_time_manager()->remove(c->timerId);
+        c->timerId = -1;
+    }
+
+    const string &connection = r->get_header("Connection");
+    conn->keepalive = !r->body_until_close() &&
+                      (r->minor == 1 ? !equal_nocase(connection, "close")
+                                     : equal_nocase(connection, "keep-alive"));
+
+    bool bodyless = c->head || status == ALLREAD;
+    long length = bodyless ? 0 : r->body_remaining();
+
+    head.assign("HTTP/1.1 ");
+    append_int(head, r->response_code);
+    head.push_back(' ');
+    head.append(r->response_line);
+    head.append("\r\n");
+    for (const auto &kv : r->get_headers()) {
+        // a bodyless response keeps the length it describes
+        if (hop_by_hop(kv.first, connection) &&
+            !(bodyless && equal_nocase(kv.first, "Content-Length")))
+            continue;
+        head.append(kv.first);
+        head.append(": ");
+        head.append(kv.second);
+        head.append("\r\n");
+    }
+    head.append(client->status == CONNECTED ? "Connection: keep-alive\r\n"
+                                            : "Connection: close\r\n");
+    if (!bodyless) {
+        if (length >= 0) {
+            head.append("Content-Length: ");
+            append_int(head, length);
+            head.append("\r\n");
+        } else {
+            head.append("Transfer-Encoding: chunked\r\n");
+        }
+    }
+    head.append("\r\n");
+    client->send_data(head.data(), head.size());
+
+    if (bodyless) {
+        done(conn);
+        return;
+    }
+
+    // a stream of an http/2 connection has no socket to splice into, a
+    // known length is copied through the sink as it is
+    c->rechunk = length < 0;
+    if (length == 0) {
+        done(conn);
+        return;
+    }
+    if (length > 0 && !client->is_stream()) {
+        buffer *in = conn->get_read_buffer();
+        long n = std::min(length, (long)in->length());
+        client->send_data((const char *)in->get(), n);
+        in->drain(n);
+        r->body_consumed(n);
+        length -= n;
+
+        if (length == 0) {
+            done(conn);
+            return;
+        }
+        if (client->relay_from(conn->fd, length, [this, conn](bool ok) {
+                relayed(conn, ok);
+            }) == -1)
+            broken(conn, false);
+        return;
+    }
+
+    r->set_body_sink([client, c](const char *data, size_t n) {
+        if (!c->rechunk) {
+            client->send_data(data, n);
+            return;
+        }
+        char size[32];
+        int k = snprintf(size, sizeof(size), "%zx\r\n", n);
+        client->send_data(size, k);
+        client->send_data(data, n);
+        client->send_data("\r\n", 2);
+    });
+    // stop reading the upstream while the client is behind
+    client->set_watermark_handler(
+        [this, conn](http_connection *, bool paused) {
+            if (paused)
+                reactor_->remove_read(conn->fd);
+            else
+                reactor_->add_read(conn->fd);
+        });
+    parse(conn);
+}
+
+void proxy_pool::relayed(proxy_connection *conn, bool ok) {
+    if (ok) {
+        done(conn);
+        return;
+    }
+
+    // the client closes after what it got, the upstream is out of step
+    auto c = std::move(conn->call);
+    close(conn);
+    release(std::move(c));
+}
+
+/* the response is complete, the upstream connection is idle again */
+void proxy_pool::done(proxy_connection *conn) {
+    auto c = std::move(conn->call);
+    http_connection *client = c->client;
+    thread->release_request(std::move(conn->response));
+
+    size_t idle = 0;
+    for (auto &other : conns)
+        if (other->up == conn->up && !other->call && !other->closing) idle++;
+
+    if (conn->keepalive && !conn->has_input() && idle <= proxy->maxIdle) {
+        reactor_->add_read(conn->fd);  // to notice the upstream closing it
+        conn->release_buffers();
+    } else {
+        close(conn);
+    }
+
+    release(std::move(c));
+    client->resume_reading();
+}
+
+/*
+ * the upstream failed. before any response byte an idempotent request is
+ * sent once more, to another upstream when this one refused it
+ */
+void proxy_pool::broken(proxy_connection *conn, bool refused) {
+    auto c = std::move(conn->call);
+    bool reused = conn->reused;
+    bool started = conn->response != nullptr;
+    close(conn);
+    if (!c) return;
+
+    if (refused) c->up->downUntil = ::time(nullptr) + http_proxy::DOWN_SECONDS;
+
+    if (c->replied) {
+        // the client has part of the response, it can only be cut off
+        http_connection *client = c->client;
+        if (client->is_stream()) {
+            client->close();
+        } else {
+            client->status = CLOSING;
+            client->get_reactor()->add_write(client->fd);
+        }
+        release(std::move(c));
+        return;
+    }
+
+    if (c->idempotent && !c->retried && !started && (reused || refused)) {
+        if (refused)
+            retry(std::move(c));
+        else {
+            c->retried = true;
+            start(std::move(c));
+        }
+        return;
+    }
+
+    fail(std::move(c), HTTP_BADGATEWAY, "Bad Gateway");
+}
+
+/* once more on the upstream picked now that the last one is down */
+void proxy_pool::retry(std::unique_ptr<proxy_call> c) {
+    c->retried = true;
+    c->up->active--;
+    c->up = proxy->pick(c->hash);
+    c->up->active++;
+    start(std::move(c));
+}
+
+void proxy_pool::on_timeout(proxy_call *c) {
+    proxy_connection *conn = c->conn;
+    if (!conn || conn->call.get() != c || c->replied) return;
+
+    auto p = std::move(conn->call);
+    close(conn);
+    fail(std::move(p), HTTP_GATEWAYTIMEOUT, "Gateway Timeout");
+}
+
+/* the client went away, the half read response is of no use */
+void proxy_pool::on_client_close(proxy_call *c) {
+    proxy_connection *conn = c->conn;
+    if (!conn || conn->call.get() != c) return;
+
+    auto p = std::move(conn->call);
+    p->client = nullptr;
+    close(conn);
+    release(std::move(p));
+}
+
+void proxy_pool::fail(std::unique_ptr<proxy_call> c, http_code_t code,
+                      const std::string &reason) {
+    http_connection *client = c->client;
+    release(std::move(c));
+    client->send_reply(code, reason, std::to_string(code) + " " + reason);
+    client->resume_reading();
+}
+
+void proxy_pool::release(std::unique_ptr<proxy_call> c) {
+    if (c->timerId >= 0) reactor_->get_time_manager()->remove(c->timerId);
+    c->up->active--;
+    if (c->client) {
+        c->client->set_close_handler(nullptr);
+        c->client->set_watermark_handler(nullptr);
+    }
+
+    c->client = nullptr;
+    c->up = nullptr;
+    c->conn = nullptr;
+    c->data.reset();
+    c->retried = c->replied = false;
+    c->timerId = -1;
+    freeCalls.push_back(std::move(c));
+}
+
+/*
+ * the fd is closed on the next turn of the loop so its number is not
+ * reused while the reactor still knows it
+ */
+void proxy_pool::close(proxy_connection *conn) {
+    if (conn->closing) return;
+
+    conn->closing = true;
+    reactor_->remove_read_handler(conn->fd);
+    reactor_->remove_write_handler(conn->fd);
+    if (conn->response) thread->release_request(std::move(conn->response));
+
+    for (auto it = conns.begin(); it != conns.end(); ++it) {
+        if (it->get() != conn) continue;
+        retired.push_back(std::move(*it));
+        conns.erase(it);
+        break;
+    }
+    if (reapTimer < 0)
+        reapTimer = reactor_->get_time_manager()->set_timer(0, [this]() {
+            reapTimer = -1;
+            reap();
+        });
+}
+
+void proxy_pool::reap() {
+    for (auto &conn : retired) {
+        ::close(conn->fd);
+        conn->release_buffers(true);
+    }
+    retired.clear();
+}
+
+}  // namespace wxg
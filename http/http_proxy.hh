@@ -0,0 +1,134 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <core/buffer.hh>
+#include <core/connection.hh>
+
+#include "http.hh"
+#include "router.hh"
+
+namespace wxg {
+
+class request;
+class http_connection;
+class http_thread;
+class proxy_connection;
+class proxy_pool;
+
+enum balance_t {
+    ROUND_ROBIN = 0,
+    LEAST_CONN,      // fewest requests in flight over all threads
+    CONSISTENT_HASH  // by path, moves few paths when upstreams change
+};
+
+struct upstream {
+    std::string address;
+    unsigned short port = 0;
+    std::string hostPort;
+    struct sockaddr_in addr;
+
+    std::atomic<int> active{0};        // requests in flight, all threads
+    std::atomic<time_t> downUntil{0};  // skipped after a failed connect
+};
+
+/* a forwarded request until its response is relayed to the client */
+struct proxy_call {
+    http_connection *client = nullptr;
+    upstream *up = nullptr;
+    proxy_connection *conn = nullptr;
+
+    buffer data;  // serialized request, kept while it may be retried
+    uint32_t hash = 0;
+    bool head = false;
+    bool idempotent = true;
+    bool retried = false;
+    bool replied = false;  // the response head went to the client
+    bool rechunk = false;  // the body goes out chunked
+    int timerId = -1;
+};
+
+/* keep-alive connection to an upstream, serving one call at a time */
+class proxy_connection : public connection {
+   public:
+    upstream *up = nullptr;
+    std::unique_ptr<proxy_call> call;
+    std::unique_ptr<request> response;  // of call
+
+    bool connected = false;
+    bool reused = false;     // served a call before this one
+    bool keepalive = false;  // of the response being relayed
+    bool closing = false;
+};
+
+/*
+ * reverse proxy handler for http_multithread_server. requests go to one
+ * of the upstreams over per thread pools of keep-alive connections, a
+ * response body of known length is moved from the upstream socket to the
+ * client with splice(2) and never copied to user space, other bodies are
+ * chunked again on the way through.
+ *
+ * an upstream that refused a connection is skipped for DOWN_SECONDS, an
+ * idempotent request that failed before any response byte is retried
+ * once. upstreams are added before the server starts and the proxy
+ * outlives it
+ */
+class http_proxy {
+   private:
+    balance_t balance;
+    int id;
+
+    std::vector<std::unique_ptr<upstream>> upstreams;
+    std::vector<std::pair<uint32_t, upstream *>> ring;  // sorted by point
+    std::atomic<size_t> next{0};
+
+    size_t maxIdle = 16;
+    int timeoutMs = 30000;
+
+    friend class proxy_pool;
+
+   public:
+    static const int VNODES = 160;  // ring points per upstream
+    static const int DOWN_SECONDS = 2;
+
+   public:
+    http_proxy(balance_t balance = ROUND_ROBIN);
+
+    /* -1 when address does not resolve */
+    int add_upstream(const std::string &address, unsigned short port);
+
+    /* idle connections kept per upstream and thread */
+    void set_max_idle(size_t n) { maxIdle = n; }
+    /* time from forwarding to the response head, 0 for none */
+    void set_timeout(int ms) { timeoutMs = ms; }
+
+    /*
+     * send req to an upstream and relay the answer to conn, 502 when no
+     * upstream answers and 504 on timeout. reading conn pauses meanwhile,
+     * its watermark handler is taken while a body is chunked again
+     */
+    void forward(request *req, http_connection *conn);
+
+    RequestHandler handler() {
+        return [this](request *req, http_connection *conn) {
+            forward(req, conn);
+        };
+    }
+
+    /* upstream for req under the balance policy, null without any */
+    upstream *select(request *req);
+
+   private:
+    upstream *pick(uint32_t hash);
+    proxy_pool *get_pool(http_thread *thread);
+};
+
+}  // namespace wxg
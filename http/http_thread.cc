@@ -10,38 +10,120 @@ using std::string;
 
 namespace wxg {
 
-http_thread::http_thread(http_multithread_server* server) : server_(server) {
+http_thread::http_thread(http_multithread_server* server)
+    : server_(server), latencies(server->routes.ids()) {
     reactor_ = std::make_unique<reactor<epoll>>();
     wakeupfd = create_eventfd();
 
     if (!server_ || !reactor_) {
-        cerr << __func__ << ": error nullptr pointer" << endl;
+        LOG_ERROR("%s: error nullptr pointer", __func__);
         exit(-1);
     }
 
+    if (server_->stallMs) {
+        profile = std::make_unique<loop_profile>();
+        profile->stallNs = server_->stallMs * 1000 * 1000;
+        reactor_->set_profile(profile.get());
+    }
+
+    maxIdleConnections = server_->maxIdleConnections;
+    maxIdleRequests = server_->maxIdleRequests;
+    buffers.set_highwater(server_->maxIdleBuffers);
+    buffers.set_max_block(server_->maxBufferBlock);
+
     reactor_->set_read_handler(wakeupfd, [this]() {
-        if (clientQueue.empty()) return;
         char ch[8];
         ::read(wakeupfd, ch, sizeof(ch));
 
-        pair<int, pair<string, unsigned short>> cinfo;
-        while (clientQueue.pop(cinfo)) {
-            auto conn = make_connection(cinfo.first, cinfo.second.first,
-                                        cinfo.second.second);
+        accepted_client client;
+        while (clientQueue.pop(client)) {
+            auto conn = make_connection(client.fd, client.address, client.port);
+            conn->acceptedAt = client.acceptedAt;
             get_reactor()->add_read(conn->fd);
-            hashConnections[cinfo.first] = std::move(conn);
+            hashConnections[client.fd] = std::move(conn);
+            metrics.add(METRIC_ACCEPTS);
+            trace::emit(TRACE_ACCEPT, TRACE_INSTANT, client.fd);
         }
+
+        std::function<void()> task;
+        while (tasks.pop(task)) task();
+    });
+
+    // gauges are sampled once a turn, not on every change
+    reactor_->set_turn_handler([this]() {
+        metrics.add(METRIC_LOOP_TURNS);
+        metrics.set(METRIC_CONNECTIONS, hashConnections.size());
+        metrics.set(METRIC_IDLE_CONNECTIONS, emptyConnections.size());
+        metrics.set(METRIC_IDLE_REQUESTS, freeRequests.size());
+        metrics.set(METRIC_IDLE_BUFFERS, buffers.size());
     });
 }
 
 void http_thread::release_connection(int fd) {
+    retired.reset();
+
     auto it = hashConnections.find(fd);
     if (it != hashConnections.end()) {
-        emptyConnections.push(std::move(it->second));
+        if (emptyConnections.size() < maxIdleConnections)
+            emptyConnections.push(std::move(it->second));
+        else
+            retired = std::move(it->second);
         hashConnections.erase(it);
     }
 }
 
+std::unique_ptr<http_connection> http_thread::make_stream_connection(
+    http2_stream* s, const http_connection* parent) {
+    std::unique_ptr<http_connection> conn;
+    if (emptyConnections.empty()) {
+        conn = std::make_unique<http_connection>(this);
+    } else {
+        conn = std::move(emptyConnections.front());
+        emptyConnections.pop();
+        conn->thread = this;
+        conn->pool = &buffers;
+    }
+    conn->setup_stream(s, parent);
+    return conn;
+}
+
+void http_thread::release_stream_connection(
+    std::unique_ptr<http_connection> conn) {
+    retired.reset();
+
+    if (emptyConnections.size() < maxIdleConnections)
+        emptyConnections.push(std::move(conn));
+    else
+        retired = std::move(conn);
+}
+
+std::unique_ptr<request> http_thread::get_request() {
+    std::unique_ptr<request> req;
+    if (freeRequests.empty())
+        req = std::make_unique<request>();
+    else {
+        req = std::move(freeRequests.back());
+        freeRequests.pop_back();
+    }
+    req->kind = REQUEST;
+    return req;
+}
+
+std::unique_ptr<request> http_thread::get_response() {
+    auto r = get_request();
+    r->kind = RESPONSE;
+    return r;
+}
+
+void http_thread::release_request(std::unique_ptr<request> req) {
+    if (!req || freeRequests.size() >= maxIdleRequests) return;
+
+    req->reset();
+    if (req->get_buffer()->capacity() > server_->maxBufferBlock)
+        req->get_buffer()->reset();
+    freeRequests.push_back(std::move(req));
+}
+
 std::unique_ptr<http_connection> http_thread::make_connection(
     int fd, const std::string& addr, unsigned short port) {
     if (emptyConnections.empty())
@@ -51,6 +133,7 @@ std::unique_ptr<http_connection> http_thread::make_connection(
     emptyConnections.pop();
 
     conn->thread = this;
+    conn->pool = &buffers;
     conn->fd = fd;
     conn->address = addr;
     conn->port = port;
@@ -1,25 +1,38 @@
 #pragma once
 
+#include <functional>
 #include <list>
 #include <memory>
 #include <string>
 #include <unordered_map>
 
+#include <core/buffer_pool.hh>
 #include <core/epoll.hh>
 #include <core/lock.hh>
 #include <model/reactor.hh>
 
+#include "http_client.hh"
 #include "http_connection.hh"
+#include "metrics.hh"
 
 using std::pair;
 
 namespace wxg {
 
+/* a socket accepted by the server, handed to one of its threads */
+struct accepted_client {
+    int fd = -1;
+    std::string address;
+    unsigned short port = 0;
+    uint64_t acceptedAt = 0;  // cycle_clock ticks
+};
+
 class http_multithread_server;
 class http_thread {
    private:
     http_multithread_server* server_ = nullptr;
     std::unique_ptr<reactor<epoll>> reactor_ = nullptr;
+    std::unique_ptr<http_client> client_ = nullptr;  // created on first use
 
     int wakeupfd = -1;
 
@@ -28,9 +41,26 @@ class http_thread {
     // fd -> unique_ptr<http_connection>
     std::unordered_map<int, std::unique_ptr<http_connection>> hashConnections;
     std::queue<std::unique_ptr<http_connection>> emptyConnections;
+    size_t maxIdleConnections = 1024;
+
+    // closed connection beyond maxIdleConnections, freed on the next release
+    std::unique_ptr<http_connection> retired;
+
+    buffer_pool buffers;
+
+    // recycled request objects, see get_request
+    std::vector<std::unique_ptr<request>> freeRequests;
+    size_t maxIdleRequests = 1024;
+
+    // work handed over by other threads, run on the next wakeup
+    lock_queue<std::function<void()>> tasks;
+
+    thread_metrics metrics;
+    route_latencies latencies;
+    std::unique_ptr<loop_profile> profile;  // with server->stallMs
 
    public:
-    lock_queue<pair<int, pair<string, unsigned short>>> clientQueue;
+    lock_queue<accepted_client> clientQueue;
 
    public:
     http_thread(http_multithread_server* server);
@@ -43,13 +73,44 @@ class http_thread {
 
     inline reactor<epoll>* get_reactor() const { return reactor_.get(); }
     inline http_multithread_server* get_server() const { return server_; }
+    inline buffer_pool* get_buffer_pool() { return &buffers; }
+    inline thread_metrics* get_metrics() { return &metrics; }
+    inline const thread_metrics* get_metrics() const { return &metrics; }
+    inline route_latencies* get_latencies() { return &latencies; }
+    inline const route_latencies* get_latencies() const { return &latencies; }
+
+    /* client on this thread's reactor, for handlers calling upstreams */
+    http_client* get_client() {
+        if (!client_) client_ = std::make_unique<http_client>(reactor_.get());
+        return client_.get();
+    }
 
     void wakeup() { write(wakeupfd, wakeupmsg); }
 
+    /* run f on this thread's loop, from any thread */
+    void run_in_loop(std::function<void()>&& f) {
+        tasks.push(std::move(f));
+        wakeup();
+    }
+
     inline void loop() { reactor_->loop(); }
 
     void release_connection(int fd);
 
+    /* connection objects for http/2 streams come from the same pool */
+    std::unique_ptr<http_connection> make_stream_connection(
+        http2_stream* s, const http_connection* parent);
+    void release_stream_connection(std::unique_ptr<http_connection> conn);
+
+    /*
+     * request objects come from a per thread pool and keep their string,
+     * header and body storage between uses, so steady state parsing and
+     * replying do not allocate
+     */
+    std::unique_ptr<request> get_request();
+    std::unique_ptr<request> get_response();
+    void release_request(std::unique_ptr<request> req);
+
    private:
     std::unique_ptr<http_connection> make_connection(int fd,
                                                      const std::string& addr,
@@ -0,0 +1,166 @@
+#include "metrics.hh"
+#include "http_thread.hh"
+
+#include <core/string.hh>
+
+#include <cstdio>
+
+namespace wxg {
+
+struct metric_info {
+    int index;
+    const char *name;
+    const char *help;
+};
+
+static const metric_info counters[] = {
+    {METRIC_ACCEPTS, "libio_accepts_total", "Connections accepted."},
+    {METRIC_REQUESTS, "libio_requests_total", "Requests dispatched."},
+    {METRIC_PARSE_ERRORS, "libio_parse_errors_total",
+     "Requests rejected as malformed."},
+    {METRIC_BYTES_IN, "libio_received_bytes_total",
+     "Bytes read from client sockets."},
+    {METRIC_BYTES_OUT, "libio_sent_bytes_total",
+     "Bytes written to client sockets."},
+    {METRIC_LOOP_TURNS, "libio_loop_turns_total",
+     "Turns of the thread event loops."},
+};
+
+static const metric_info gauges[] = {
+    {METRIC_CONNECTIONS, "libio_connections", "Open client connections."},
+    {METRIC_IDLE_CONNECTIONS, "libio_pooled_connections",
+     "Closed connection objects kept for reuse."},
+    {METRIC_IDLE_REQUESTS, "libio_pooled_requests",
+     "Request objects kept for reuse."},
+    {METRIC_IDLE_BUFFERS, "libio_pooled_buffers",
+     "Buffers kept for reuse."},
+};
+
+static void family(std::string &out, const char *name, const std::string &help,
+                   const char *type, long value) {
+    out.append("# HELP ").append(name).append(" ").append(help);
+    out.append("\n# TYPE ").append(name).append(" ").append(type);
+    out.append("\n").append(name).append(" ");
+    append_int(out, value);
+    out.push_back('\n');
+}
+
+static const char *phaseNames[] = {"accept", "read", "handler", "write"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static void seconds(std::string &out, uint64_t ns) {
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), " %.9f\n", ns / 1e9);
+    out.append(tmp);
+}
+
+static void render_loops(
+    std::string &out,
+    const std::vector<std::unique_ptr<http_thread>> &threads) {
+    uint64_t wait = 0, timers = 0, dispatch = 0, events = 0, maxEvents = 0,
+             stalls = 0;
+    for (const auto &t : threads) {
+        const loop_profile *p = t->get_reactor()->get_profile();
+        if (!p) continue;
+        wait += p->waitNs;
+        timers += p->timerNs;
+        dispatch += p->dispatchNs;
+        events += p->events;
+        stalls += p->stalls;
+        if (p->maxEvents > maxEvents) maxEvents = p->maxEvents;
+    }
+
+    out.append(
+        "# HELP libio_loop_seconds_total Time of the thread loops by part.\n"
+        "# TYPE libio_loop_seconds_total counter\n");
+    out.append("libio_loop_seconds_total{part=\"wait\"}");
+    seconds(out, wait);
+    out.append("libio_loop_seconds_total{part=\"timers\"}");
+    seconds(out, timers);
+    out.append("libio_loop_seconds_total{part=\"dispatch\"}");
+    seconds(out, dispatch);
+    family(out, "libio_loop_events_total", "Ready fds over all loop turns.",
+           "counter", events);
+    family(out, "libio_loop_max_events", "Most ready fds in one loop turn.",
+           "gauge", maxEvents);
+    family(out, "libio_loop_stalls_total",
+           "Callbacks that ran over the stall threshold.", "counter", stalls);
+}
+
+int metrics_registry::add_counter(const std::string &name,
+                                  const std::string &help) {
+    if (customs.size() >= size_t(thread_metrics::MAX_CUSTOM)) return -1;
+    customs.push_back({name, help});
+    return METRIC_COUNTERS + customs.size() - 1;
+}
+
+std::string metrics_registry::render(
+    const std::vector<std::unique_ptr<http_thread>> &threads,
+    const router &routes, const loop_watchdog *watchdog) const {
+    std::string out;
+    out.reserve(2048);
+
+    for (const auto &c : counters) {
+        uint64_t sum = 0;
+        for (const auto &t : threads) sum += t->get_metrics()->counter(c.index);
+        family(out, c.name, c.help, "counter", sum);
+    }
+    for (const auto &g : gauges) {
+        int64_t sum = 0;
+        for (const auto &t : threads)
+            sum += t->get_metrics()->gauge(metric_gauge_t(g.index));
+        family(out, g.name, g.help, "gauge", sum);
+    }
+    for (size_t i = 0; i < customs.size(); i++) {
+        uint64_t sum = 0;
+        for (const auto &t : threads)
+            sum += t->get_metrics()->counter(METRIC_COUNTERS + i);
+        family(out, customs[i].name.c_str(), customs[i].help, "counter", sum);
+    }
+
+    if (!threads.empty() && threads[0]->get_reactor()->get_profile())
+        render_loops(out, threads);
+    if (watchdog)
+        family(out, "libio_loop_stuck_total",
+               "Loops found away from listen too long by the watchdog.",
+               "counter", watchdog->stuck());
+
+    out.append(
+        "# HELP libio_latency_seconds Request latency by route and phase.\n"
+        "# TYPE libio_latency_seconds summary\n");
+    std::unique_ptr<latency_histogram> merged;
+    for (int id = 0; id < routes.ids(); id++) {
+        for (int p = 0; p < LATENCY_PHASES; p++) {
+            merged.reset(new latency_histogram);
+            merge_latency(threads, id, latency_phase_t(p), merged.get());
+            if (merged->count() == 0) continue;
+
+            std::string labels = "{route=\"" + routes.name(id) +
+                                 "\",phase=\"" + phaseNames[p] + "\"";
+            for (double q : quantiles) {
+                char tmp[32];
+                snprintf(tmp, sizeof(tmp), ",quantile=\"%g\"}", q);
+                out.append("libio_latency_seconds").append(labels).append(tmp);
+                seconds(out, merged->quantile(q));
+            }
+            out.append("libio_latency_seconds_sum").append(labels).append("}");
+            seconds(out, merged->sum());
+            out.append("libio_latency_seconds_count").append(labels);
+            out.append("} ");
+            append_int(out, merged->count());
+            out.push_back('\n');
+        }
+    }
+    return out;
+}
+
+void metrics_registry::merge_latency(
+    const std::vector<std::unique_ptr<http_thread>> &threads, int route,
+    latency_phase_t phase, latency_histogram *into) {
+    for (const auto &t : threads) {
+        const latency_histogram *h = t->get_latencies()->get(route, phase);
+        if (h) into->merge(*h);
+    }
+}
+
+}  // namespace wxg
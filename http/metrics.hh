@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <core/histogram.hh>
+
+namespace wxg {
+
+class http_thread;
+class router;
+class loop_watchdog;
+
+enum metric_counter_t {
+    METRIC_ACCEPTS = 0,
+    METRIC_REQUESTS,
+    METRIC_PARSE_ERRORS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_LOOP_TURNS,
+    METRIC_COUNTERS  // custom counters follow
+};
+
+enum metric_gauge_t {
+    METRIC_CONNECTIONS = 0,
+    METRIC_IDLE_CONNECTIONS,
+    METRIC_IDLE_REQUESTS,
+    METRIC_IDLE_BUFFERS,
+    METRIC_GAUGES
+};
+
+/* where the time of a request goes, see route_latencies */
+enum latency_phase_t {
+    LATENCY_ACCEPT = 0,  // accept to the first byte, first request only
+    LATENCY_READ,        // first byte to the request parsed
+    LATENCY_HANDLER,     // in the handler, until it returns
+    LATENCY_WRITE,       // response queued to its last byte written
+    LATENCY_PHASES
+};
+
+/*
+ * latency histograms of one http_thread by route id and phase, written
+ * by that thread only. the histograms of a route are allocated when it is
+ * first recorded and stay until the thread ends
+ */
+class route_latencies {
+   private:
+    struct phases {
+        latency_histogram phase[LATENCY_PHASES];
+    };
+    std::unique_ptr<std::atomic<phases *>[]> routes;
+    int size_ = 0;
+
+   public:
+    explicit route_latencies(int ids)
+        : routes(new std::atomic<phases *>[ids]), size_(ids) {
+        for (int i = 0; i < size_; i++) routes[i].store(nullptr);
+    }
+    ~route_latencies() {
+        for (int i = 0; i < size_; i++) delete routes[i].load();
+    }
+
+    inline int size() const { return size_; }
+
+    /* nanoseconds, routes added after the thread started are not kept */
+    inline void record(int route, latency_phase_t phase, uint64_t ns) {
+        if (route < 0 || route >= size_) return;
+        phases *p = routes[route].load(std::memory_order_relaxed);
+        if (!p) {
+            p = new phases;
+            routes[route].store(p, std::memory_order_release);
+        }
+        p->phase[phase].record(ns);
+    }
+
+    /* from any thread, nullptr while nothing was recorded for route */
+    const latency_histogram *get(int route, latency_phase_t phase) const {
+        if (route < 0 || route >= size_) return nullptr;
+        phases *p = routes[route].load(std::memory_order_acquire);
+        return p ? &p->phase[phase] : nullptr;
+    }
+};
+
+/*
+ * counters and gauges of one http_thread. only that thread writes them,
+ * with plain relaxed loads and stores, a scrape reads them from another
+ * thread. the padding keeps them off cache lines shared with anything
+ * else, so counting on the request path never touches a line another
+ * core writes
+ */
+class thread_metrics {
+   public:
+    static const int MAX_CUSTOM = 32;
+
+   private:
+    char before[64];
+    std::atomic<uint64_t> counters[METRIC_COUNTERS + MAX_CUSTOM];
+    std::atomic<int64_t> gauges[METRIC_GAUGES];
+    char after[64];
+
+   public:
+    thread_metrics() {
+        for (auto &c : counters) c.store(0, std::memory_order_relaxed);
+        for (auto &g : gauges) g.store(0, std::memory_order_relaxed);
+    }
+
+    /* from the owning thread only */
+    inline void add(int counter, uint64_t n = 1) {
+        auto &c = counters[counter];
+        c.store(c.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+    inline void set(metric_gauge_t gauge, int64_t v) {
+        gauges[gauge].store(v, std::memory_order_relaxed);
+    }
+
+    /* from any thread */
+    inline uint64_t counter(int counter) const {
+        return counters[counter].load(std::memory_order_relaxed);
+    }
+    inline int64_t gauge(metric_gauge_t gauge) const {
+        return gauges[gauge].load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ * names of the metrics of a server and its custom counters. values are
+ * summed over the threads when they are rendered, in the prometheus text
+ * exposition format. latencies are merged over the threads and rendered
+ * as a summary with quantiles by route and phase, loop profiles and the
+ * watchdog are included when the server has them
+ */
+class metrics_registry {
+   private:
+    struct custom {
+        std::string name;
+        std::string help;
+    };
+    std::vector<custom> customs;
+
+   public:
+    /*
+     * a counter for handlers to add to with thread_metrics::add, register
+     * before the server starts. -1 once MAX_CUSTOM are registered
+     */
+    int add_counter(const std::string &name, const std::string &help);
+
+    std::string render(
+        const std::vector<std::unique_ptr<http_thread>> &threads,
+        const router &routes, const loop_watchdog *watchdog) const;
+
+    /* add the latencies of route and phase on all threads to into */
+    static void merge_latency(
+        const std::vector<std::unique_ptr<http_thread>> &threads, int route,
+        latency_phase_t phase, latency_histogram *into);
+};
+
+}  // namespace wxg
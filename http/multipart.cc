@@ -0,0 +1,263 @@
+#include "multipart.hh"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace wxg {
+
+int multipart_parser::start(const std::string &boundary) {
+    if (boundary.empty() || boundary.size() > MAX_BOUNDARY ||
+        boundary.back() == ' ' ||
+        boundary.find_first_of("\r\n") != std::string::npos)
+        return -1;
+
+    delimiter = "\r\n--" + boundary;
+    size_t n = delimiter.size();
+    for (size_t i = 0; i < 256; i++) skip[i] = n;
+    for (size_t i = 0; i + 1 < n; i++)
+        skip[(unsigned char)delimiter[i]] = n - 1 - i;
+
+    // the first delimiter may open the body without a line break before it
+    state = PREAMBLE;
+    carry = "\r\n";
+    line.clear();
+    headers.clear();
+    fileFd = -1;
+    return 0;
+}
+
+int multipart_parser::feed(const char *data, size_t length) {
+    const char *p = data, *end = data + length;
+    while (p < end) {
+        int r = 0;
+        switch (state) {
+            case PREAMBLE:
+            case BODY:
+                r = scan(p, end);
+                break;
+            case DELIMITER:
+                r = delimiter_tail(p, end);
+                break;
+            case HEADERS:
+                r = header_lines(p, end);
+                break;
+            case EPILOGUE:
+                return 0;
+            case FAILED:
+                return -1;
+        }
+        if (r < 0) return fail();
+    }
+    return state == FAILED ? -1 : 0;
+}
+
+size_t multipart_parser::search(const char *p, size_t n) const {
+    size_t m = delimiter.size();
+    const char *d = delimiter.data();
+    size_t i = 0;
+    while (i + m <= n) {
+        size_t j = m - 1;
+        while (p[i + j] == d[j])
+            if (j-- == 0) return i;
+        i += skip[(unsigned char)p[i + m - 1]];
+    }
+    return std::string::npos;
+}
+
+int multipart_parser::emit(const char *data, size_t length) {
+    if (state != BODY || length == 0) return 0;
+    if (fileFd < 0) {
+        if (ondata) ondata(data, length);
+        return 0;
+    }
+
+    while (length > 0) {
+        ssize_t w = ::write(fileFd, data, length);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += w;
+        length -= w;
+    }
+    return 0;
+}
+
+int multipart_parser::found() {
+    if (state == BODY) {
+        fileFd = -1;
+        if (onend) onend();
+    }
+    state = DELIMITER;
+    line.clear();
+    return 0;
+}
+
+int multipart_parser::scan(const char *&p, const char *end) {
+    size_t n = delimiter.size();
+    const char *d = delimiter.data();
+
+    // a delimiter may begin in the bytes held back from the last input
+    if (!carry.empty()) {
+        size_t c = carry.size();
+        line.assign(carry);
+        line.append(p, std::min(n - 1, size_t(end - p)));
+        for (size_t k = 0; k < c; k++) {
+            size_t len = std::min(n, line.size() - k);
+            if (std::memcmp(line.data() + k, d, len) != 0) continue;
+            if (emit(carry.data(), k) < 0) return -1;
+            if (len == n) {
+                p += k + n - c;
+                carry.clear();
+                return found();
+            }
+            // still only the start of one, the input was short
+            carry.assign(line, k, std::string::npos);
+            p = end;
+            return 0;
+        }
+        if (emit(carry.data(), c) < 0) return -1;
+        carry.clear();
+    }
+
+    size_t avail = end - p;
+    size_t m = search(p, avail);
+    if (m != std::string::npos) {
+        if (emit(p, m) < 0) return -1;
+        p += m + n;
+        return found();
+    }
+
+    // hold back the longest tail that is the start of a delimiter
+    size_t keep = 0;
+    for (size_t l = std::min(n - 1, avail); l > 0; l--) {
+        if (end[-l] == '\r' && std::memcmp(end - l, d, l) == 0) {
+            keep = l;
+            break;
+        }
+    }
+    if (emit(p, avail - keep) < 0) return -1;
+    carry.assign(end - keep, keep);
+    p = end;
+    return 0;
+}
+
+/* "--" closes the body, otherwise padding and a line break start a part */
+int multipart_parser::delimiter_tail(const char *&p, const char *end) {
+    while (p < end) {
+        char c = *p++;
+        line.push_back(c);
+        if (line == "--") {
+            state = EPILOGUE;
+            p = end;
+            return 0;
+        }
+        if (line.size() == 1 && c == '-') continue;
+
+        if (c == '\n') {
+            size_t n = line.size();
+            if (n < 2 || line[n - 2] != '\r') return -1;
+            for (size_t i = 0; i + 2 < n; i++)
+                if (line[i] != ' ' && line[i] != '\t') return -1;
+            state = HEADERS;
+            line.clear();
+            headers.clear();
+            headerBytes = 0;
+            return 0;
+        }
+        if (c != ' ' && c != '\t' && c != '\r') return -1;
+        if (line.size() > 256) return -1;
+    }
+    return 0;
+}
+
+int multipart_parser::header_lines(const char *&p, const char *end) {
+    while (p < end) {
+        auto nl = (const char *)std::memchr(p, '\n', end - p);
+        const char *stop = nl ? nl + 1 : end;
+        headerBytes += stop - p;
+        if (headerBytes > MAX_HEADERS) return -1;
+        line.append(p, stop - p);
+        p = stop;
+        if (!nl) return 0;
+
+        size_t n = line.size() - 1;
+        if (n > 0 && line[n - 1] == '\r') n--;
+        string_ref l(line.data(), n);
+        if (l.empty()) {
+            state = BODY;
+            line.clear();
+            fileFd = -1;
+            if (onpart) onpart(headers);
+            return 0;
+        }
+
+        if (l[0] == ' ' || l[0] == '\t') {
+            std::string *v = headers.back();
+            if (!v) return -1;
+            string_ref more = trim_ref(l);
+            v->push_back(' ');
+            v->append(more.data(), more.size());
+        } else {
+            size_t colon = l.find(':');
+            if (colon == string_ref::npos || colon == 0) return -1;
+            headers.add(trim_ref(l.substr(0, colon)),
+                        trim_ref(l.substr(colon + 1)));
+        }
+        line.clear();
+    }
+    return 0;
+}
+
+int multipart_parser::fail() {
+    state = FAILED;
+    fileFd = -1;
+    return -1;
+}
+
+std::string multipart_parser::boundary_of(const string_ref &contentType) {
+    if (contentType.size() < 10 ||
+        !equal_nocase(contentType.substr(0, 10), "multipart/"))
+        return "";
+    return parameter(contentType, "boundary");
+}
+
+std::string multipart_parser::parameter(const string_ref &value,
+                                        const string_ref &key) {
+    size_t i = value.find(';'), n = value.size();
+    while (i != string_ref::npos && i < n) {
+        i++;
+        while (i < n && (value[i] == ' ' || value[i] == '\t')) i++;
+        size_t nameStart = i;
+        while (i < n && value[i] != '=' && value[i] != ';') i++;
+        string_ref name = trim_ref(value.substr(nameStart, i - nameStart));
+
+        std::string v;
+        if (i < n && value[i] == '=') {
+            i++;
+            while (i < n && (value[i] == ' ' || value[i] == '\t')) i++;
+            if (i < n && value[i] == '"') {
+                for (i++; i < n && value[i] != '"'; i++) {
+                    if (value[i] == '\\' && i + 1 < n) i++;
+                    v.push_back(value[i]);
+                }
+                i = value.find(';', i);
+            } else {
+                size_t s = i;
+                i = value.find(';', i);
+                size_t e = i == string_ref::npos ? n : i;
+                string_ref t = trim_ref(value.substr(s, e - s));
+                v.assign(t.data(), t.size());
+            }
+        } else if (i >= n) {
+            i = string_ref::npos;
+        }
+        if (equal_nocase(name, key)) return v;
+    }
+    return "";
+}
+
+}  // namespace wxg
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <core/string.hh>
+
+#include "request.hh"
+
+namespace wxg {
+
+/* a part starts, headers are only valid during the call */
+using PartHandler = std::function<void(const header_list &headers)>;
+/* a piece of the body of the current part */
+using PartDataHandler = std::function<void(const char *data, size_t length)>;
+/* the body of the current part is complete */
+using PartEndHandler = std::function<void()>;
+
+/*
+ * incremental multipart/form-data parser, rfc 7578 and rfc 2046 5.1.
+ *
+ * input is fed in pieces as it arrives, for example from the body
+ * handler of a streaming route, and is looked at once. the delimiter is
+ * searched with boyer-moore-horspool, a piece ending in what may be the
+ * start of a delimiter keeps only those bytes back, so memory stays
+ * bounded by the delimiter and MAX_HEADERS whatever the size of the
+ * upload. body bytes are handed on straight from the input, or written
+ * to a file descriptor the part handler chose with save_to
+ */
+class multipart_parser {
+   private:
+    enum state_t { PREAMBLE = 0, DELIMITER, HEADERS, BODY, EPILOGUE, FAILED };
+
+    state_t state = FAILED;
+    std::string delimiter;  // "\r\n--" boundary
+    size_t skip[256];       // horspool shift by the byte under the last one
+
+    std::string carry;  // held back, may begin a delimiter
+    std::string line;   // header line or delimiter tail being read
+    header_list headers;
+    size_t headerBytes = 0;
+    int fileFd = -1;
+
+    PartHandler onpart;
+    PartDataHandler ondata;
+    PartEndHandler onend;
+
+   public:
+    static const size_t MAX_HEADERS = 16 * 1024;  // of one part
+    static const size_t MAX_BOUNDARY = 70;
+
+   public:
+    /* -1 for a boundary rfc 2046 does not allow */
+    int start(const std::string &boundary);
+
+    void set_part_handler(PartHandler &&handler) {
+        onpart = std::move(handler);
+    }
+    void set_data_handler(PartDataHandler &&handler) {
+        ondata = std::move(handler);
+    }
+    void set_end_handler(PartEndHandler &&handler) {
+        onend = std::move(handler);
+    }
+
+    /*
+     * from the part handler: write the body of this part to fd instead of
+     * passing it to the data handler. fd stays open
+     */
+    void save_to(int fd) { fileFd = fd; }
+
+    /* consume length bytes, -1 once the input is malformed */
+    int feed(const char *data, size_t length);
+
+    /* the closing delimiter was seen */
+    inline bool done() const { return state == EPILOGUE; }
+
+    /* boundary parameter of a multipart Content-Type, empty without one */
+    static std::string boundary_of(const string_ref &contentType);
+    /*
+     * parameter key of a header value such as Content-Disposition, with
+     * quotes removed, empty when it is missing
+     */
+    static std::string parameter(const string_ref &value,
+                                 const string_ref &key);
+
+   private:
+    size_t search(const char *p, size_t n) const;
+    int emit(const char *data, size_t length);
+    int scan(const char *&p, const char *end);
+    int found();
+    int delimiter_tail(const char *&p, const char *end);
+    int header_lines(const char *&p, const char *end);
+    int fail();
+};
+
+}  // namespace wxg
@@ -1,8 +1,34 @@
 #include "request.hh"
 #include <core/time.hh>
 
+#include <algorithm>
+
 namespace wxg {
 
+void request::reset() {
+    headers.clear();
+    buf_->clear();
+
+    chunked = false;
+    ntoread = 0;
+    sink = nullptr;
+    stopAtBody = false;
+
+    firstline.clear();
+    kind = RESPONSE;
+    type = GET;
+    status = READING_FIRSTLINE;
+    major = minor = 1;
+
+    target.clear();
+    uri.clear();
+    query.clear();
+    params.clear();
+
+    response_code = HTTP_OK;
+    response_line.clear();
+}
+
 parse_status_t request::parse(buffer *buf) {
     switch (status) {
         case READING_FIRSTLINE:
@@ -20,31 +46,42 @@ parse_status_t request::parse(buffer *buf) {
 }
 
 parse_status_t request::parse_firstline(buffer *buf) {
-    if (buf->empty()) return NEEDMORE;
-    auto line = buf->pop();
-    if (line.empty()) return NEEDMORE;
+    string_ref line;
+    int n;
 
-    switch (kind) {
-        case REQUEST:
-            if (parse_request_line(line) == -1) return CORRUPTED;
-            break;
-        case RESPONSE:
-            if (parse_response_line(line) == -1) return CORRUPTED;
-            break;
+    while ((n = buf->find_line(line)) > 0) {
+        if (line.empty()) {  // empty lines before a message are ignored
+            buf->drain(n);
+            continue;
+        }
 
-        default:
-            break;
+        switch (kind) {
+            case REQUEST:
+                if (parse_request_line(line) == -1) return CORRUPTED;
+                break;
+            case RESPONSE:
+                if (parse_response_line(line) == -1) return CORRUPTED;
+                break;
+
+            default:
+                break;
+        }
+        buf->drain(n);
+
+        status = READING_HEADERS;
+        return parse_headers(buf);
     }
 
-    status = READING_HEADERS;
-    return parse_headers(buf);
+    return NEEDMORE;
 }
 
 parse_status_t request::parse_headers(buffer *buf) {
-    string k, v;
-    while (!buf->empty()) {
-        auto line = buf->pop();
+    string_ref line;
+    int n;
+
+    while ((n = buf->find_line(line)) > 0) {
         if (line.empty()) {  // finish headers
+            buf->drain(n);
 
             switch (kind) {
                 case REQUEST:
@@ -63,7 +100,9 @@ parse_status_t request::parse_headers(buffer *buf) {
             }
 
             if (status == READING_HEADERS) {
+                if (get_body_length() == -1) return CORRUPTED;
                 status = READING_BODY;
+                if (stopAtBody) return HEADERSREAD;
                 return parse_body(buf);
             } else if (status == READING_TRAILER)
                 return ALLREAD;
@@ -73,73 +112,106 @@ parse_status_t request::parse_headers(buffer *buf) {
 
         /* Check if this is a continuation line */
         if (line[0] == ' ' || line[0] == '\t') {
-            if (k.empty()) return CORRUPTED;
-            this->headers[k] = v + ltrim(line, " \t");
+            string *v = headers.back();
+            if (!v) return CORRUPTED;
+            string_ref more = trim_ref(line);
+            v->append(more.data(), more.size());
+            buf->drain(n);
             continue;
         }
 
-        auto pos = line.find(':');
-        if (pos == string::npos) return CORRUPTED;
+        size_t pos = line.find(':');
+        if (pos == string_ref::npos) return CORRUPTED;
 
-        k = line.substr(0, pos);
-        v = line.substr(pos + 1);
-        this->headers[trim(k)] = trim(v);
+        headers.add(trim_ref(line.substr(0, pos)),
+                    trim_ref(line.substr(pos + 1)));
+        buf->drain(n);
     }
 
     return NEEDMORE;
 }
 
+/*
+ * body bytes are moved to buf_ as they arrive, ntoread counts what is
+ * left of the body or current chunk. while chunked, -1 means a chunk
+ * size line is expected and -2 the "\r\n" closing a chunk
+ */
 parse_status_t request::parse_body(buffer *buf) {
-    if (headers["Transfer-Encoding"] == "chunked")
-        chunked = true, ntoread = -1;
-    else {
-        if (get_body_length() == -1) return CORRUPTED;
-    }
-
     if (chunked) {
         while (!buf->empty()) {
-            if (ntoread < 0) {
-                auto line = buf->pop();
-                // read chunk size
-                ntoread = std::stol(line, 0, 16);
-                if (line.empty() || ntoread < 0) return CORRUPTED;
+            if (ntoread == -1) {
+                string_ref line;
+                int n = buf->find_line(line);
+                if (n == 0) return NEEDMORE;
+
+                // read chunk size, extensions are ignored
+                size_t ext = line.find(';');
+                if (ext != string_ref::npos) line = line.substr(0, ext);
+                ntoread = to_long(trim_ref(line), 16);
+                buf->drain(n);
+                if (ntoread < 0) return CORRUPTED;
 
                 if (ntoread == 0) {  // read chunk finished
                     status = READING_TRAILER;
                     return parse_trailer(buf);
                 }
-            } else {
-                if (static_cast<int>(buf->length()) < ntoread) break;
-
-                buf_->push(buf, ntoread + 2);  // 2 means "\r\n"
+            } else if (ntoread == -2) {
+                if (buf->length() < 2) return NEEDMORE;
+                buf->drain(2);
                 ntoread = -1;
+            } else {
+                long n = std::min(static_cast<long>(buf->length()), ntoread);
+                take_body(buf, n);
+                ntoread -= n;
+                if (ntoread == 0) ntoread = -2;
             }
         }
         return NEEDMORE;
     } else if (ntoread < 0) {
-        buf_->push(buf);  // read until connection close
-    } else if (static_cast<int>(buf->length()) >= ntoread) {
-        buf_->push(buf, ntoread);
-        return ALLREAD;
+        take_body(buf, buf->length());  // read until connection close
+        return NEEDMORE;
     }
 
-    return NEEDMORE;
+    long n = std::min(static_cast<long>(buf->length()), ntoread);
+    take_body(buf, n);
+    ntoread -= n;
+
+    return ntoread == 0 ? ALLREAD : NEEDMORE;
+}
+
+void request::take_body(buffer *buf, long n) {
+    if (n <= 0) return;
+    if (sink) {
+        sink((const char *)buf->get(), n);
+        buf->drain(n);
+    } else
+        buf_->push(buf, n);
 }
 
 parse_status_t request::parse_trailer(buffer *buf) {
     return parse_headers(buf);
 }
 
+int request::parse_protocol(const string_ref &protocol) {
+    if (protocol == "HTTP/1.0")
+        major = 1, minor = 0;
+    else if (protocol == "HTTP/1.1")
+        major = minor = 1;
+    else
+        return -1;
+    return 0;
+}
+
 /* request format: method uri protocol */
-int request::parse_request_line(const string &line) {
+int request::parse_request_line(const string_ref &line) {
     size_t k1 = line.find(' ');
-    if (k1 == string::npos) return -1;
+    if (k1 == string_ref::npos) return -1;
     size_t k2 = line.find(' ', k1 + 1);
-    if (k2 == string::npos) return -1;
+    if (k2 == string_ref::npos) return -1;
 
-    string method = line.substr(0, k1);
-    string uri = line.substr(k1 + 1, k2 - k1 - 1);
-    string protocol = line.substr(k2 + 1);
+    string_ref method = line.substr(0, k1);
+    string_ref target = line.substr(k1 + 1, k2 - k1 - 1);
+    string_ref protocol = line.substr(k2 + 1);
 
     if (method == "GET")
         this->type = GET;
@@ -150,56 +222,64 @@ int request::parse_request_line(const string &line) {
     else
         return -1;
 
-    size_t k3 = uri.find('?');
-    if (k3 != string::npos) {
-        this->uri = uri.substr(0, k3);
-        this->query = uri.substr(k3 + 1);
-    } else
-        this->uri = uri;
+    this->target.assign(target.data(), target.size());
 
-    this->uri = string_from_utf8(this->uri);
+    size_t k3 = target.find('?');
+    if (k3 != string_ref::npos) {
+        this->uri.assign(target.data(), k3);
+        string_ref q = target.substr(k3 + 1);
+        this->query.assign(q.data(), q.size());
+    } else {
+        this->uri.assign(target.data(), target.size());
+        this->query.clear();
+    }
 
-    if (protocol == "HTTP/1.0")
-        major = 1, minor = 0;
-    else if (protocol == "HTTP/1.1")
-        major = minor = 1;
-    else
-        return -1;
+    percent_decode(this->uri);
 
-    return 0;
+    return parse_protocol(protocol);
 }
 
 /* response format: protocol response_code response_line */
-int request::parse_response_line(const string &line) {
+int request::parse_response_line(const string_ref &line) {
     size_t k1 = line.find(' ');
-    if (k1 == string::npos) return -1;
+    if (k1 == string_ref::npos) return -1;
     size_t k2 = line.find(' ', k1 + 1);
-    if (k2 == string::npos) return -1;
+    if (k2 == string_ref::npos) return -1;
 
-    string protocol = line.substr(0, k1);
-    string code = line.substr(k1 + 1, k2 - k1 - 1);
-    string response_line = line.substr(k2 + 1);
+    string_ref protocol = line.substr(0, k1);
+    string_ref code = line.substr(k1 + 1, k2 - k1 - 1);
+    string_ref reason = line.substr(k2 + 1);
 
-    if (protocol == "HTTP/1.0")
-        major = 1, minor = 0;
-    else if (protocol == "HTTP/1.1")
-        major = minor = 1;
-    else
-        return -1;
+    if (parse_protocol(protocol) == -1) return -1;
 
-    this->response_code = static_cast<http_code_t>(std::stoi(code));
-    this->response_line = response_line;
+    long c = to_long(code);
+    if (c < 100 || c > 999) return -1;
+
+    this->response_code = static_cast<http_code_t>(c);
+    this->response_line.assign(reason.data(), reason.size());
     return 0;
 }
 
 int request::get_body_length() {
-    string content_length = headers["Content-Length"];
-    string connection = headers["Connection"];
+    // these responses end with the headers whatever they announce
+    if (kind == RESPONSE && (response_code < 200 || response_code == 204 ||
+                             response_code == 304)) {
+        ntoread = 0;
+        return 0;
+    }
 
-    if (content_length.empty())
+    const string *te = headers.find("Transfer-Encoding");
+    if (te && equal_nocase(*te, "chunked")) {
+        chunked = true;
+        ntoread = -1;
+        return 0;
+    }
+
+    const string *content_length = headers.find("Content-Length");
+    if (!content_length || content_length->empty())
         ntoread = -1;
     else {
-        ntoread = std::stol(content_length);
+        ntoread = to_long(trim_ref(*content_length));
         if (ntoread < 0) return -1;
     }
     return 0;
@@ -209,11 +289,11 @@ void request::set_response(http_code_t code, const std::string &reason,
                            buffer *content) {
     this->kind = RESPONSE;
     this->response_code = code;
-    this->response_line = reason;
+    this->response_line.assign(reason);
 
     if (content)
         buf_->push(content);
-    else {
+    else if (buf_->empty()) {
         switch (code) {
             case HTTP_OK:
                 break;
@@ -221,6 +301,9 @@ void request::set_response(http_code_t code, const std::string &reason,
                 push_not_found();
                 break;
             case HTTP_NOCONTENT:
+            case HTTP_PARTIAL:
+            case HTTP_NOTMODIFIED:
+            case HTTP_RANGENOTSATISFIABLE:
                 break;
             default:
                 push_error(code, reason);
@@ -228,45 +311,50 @@ void request::set_response(http_code_t code, const std::string &reason,
         }
     }
 
-    firstline = "HTTP/" + std::to_string(major) + "." + std::to_string(minor) +
-                " " + std::to_string(response_code) + " " + response_line +
-                "\r\n";
+    firstline.assign("HTTP/");
+    append_int(firstline, major);
+    firstline.push_back('.');
+    append_int(firstline, minor);
+    firstline.push_back(' ');
+    append_int(firstline, response_code);
+    firstline.push_back(' ');
+    firstline.append(response_line);
+    firstline.append("\r\n");
 
     headers.clear();
-    if (major == 1) {
-        if (minor == 1) {
-            if (headers["Date"].empty()) headers["Date"] = time::get_date();
-            headers["Connection"] = "keep-alive";
-        }
-
-        if (headers["Connection"] == "keep-alive")
-            headers["Content-Length"] = std::to_string(buf_->length());
+    bool keepalive = false;
+    if (major == 1 && minor == 1) {
+        headers.set("Date", time::get_date());
+        headers.set("Connection", "keep-alive");
+        keepalive = true;
     }
 
-    if (buf_->length() > 0) {
-        headers["Content-Length"] = std::to_string(buf_->length());
-        headers["Content-Type"] = "text/html; charset=utf-8";
-    }
+    if (keepalive || buf_->length() > 0)
+        append_int(headers.set("Content-Length"), buf_->length());
+
+    if (buf_->length() > 0)
+        headers.set("Content-Type", "text/html; charset=utf-8");
 }
 
 void request::set_request(request_type_t type, const std::string &uri,
                           buffer *content) {
+    this->kind = REQUEST;
     this->type = type;
-    this->uri = uri;
+    this->uri.assign(uri);
 
     if (content) buf_->push(content);
 
     headers.clear();
-    headers["Content-Type"] = "text/html; charset=utf-8";
+    headers.set("Content-Type", "text/html; charset=utf-8");
 
-    string method;
+    const char *method = "";
     switch (type) {
         case GET:
             method = "GET";
             break;
         case POST:
             method = "POST";
-            headers["Content-Length"] = std::to_string(buf_->length());
+            append_int(headers.set("Content-Length"), buf_->length());
             break;
         case HEAD:
             method = "HEAD";
@@ -274,17 +362,29 @@ void request::set_request(request_type_t type, const std::string &uri,
         default:
             break;
     }
-    firstline = method + " " + uri + " HTTP/" + std::to_string(major) + "." +
-                std::to_string(minor) + "\r\n";
+
+    firstline.assign(method);
+    firstline.push_back(' ');
+    firstline.append(uri);
+    firstline.append(" HTTP/");
+    append_int(firstline, major);
+    firstline.push_back('.');
+    append_int(firstline, minor);
+    firstline.append("\r\n");
 }
 
 void request::send_to(buffer *buf) {
     buf->push(firstline);
 
-    for (const auto &kv : headers)
-        if (!kv.second.empty()) buf->push(kv.first + ": " + kv.second + "\r\n");
+    for (const auto &kv : headers) {
+        if (kv.second.empty()) continue;
+        buf->push(kv.first);
+        buf->push((void *)": ", 2);
+        buf->push(kv.second);
+        buf->push((void *)"\r\n", 2);
+    }
 
-    buf->push("\r\n");
+    buf->push((void *)"\r\n", 2);
 
     if (this->buf_->length() > 0) buf->push(this->buf_.get());
 }
@@ -1,13 +1,17 @@
 #pragma once
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <core/buffer.hh>
 #include <core/string.hh>
 
 #include "http.hh"
+#include "router.hh"
 
 using std::cout;
 using std::endl;
@@ -16,7 +20,6 @@ using std::string;
 
 namespace wxg {
 
-enum request_type_t { GET = 0, POST, HEAD };
 enum request_kind_t { REQUEST = 0, RESPONSE };
 enum request_status_t {
     READING_FIRSTLINE = 0,
@@ -25,17 +28,88 @@ enum request_status_t {
     READING_TRAILER
 };
 
-enum parse_status_t { ALLREAD = 0, NEEDMORE, CORRUPTED, CANCELD };
+enum parse_status_t {
+    ALLREAD = 0,
+    NEEDMORE,
+    CORRUPTED,
+    CANCELD,
+    HEADERSREAD
+};
+
+/* receives body bytes instead of the request buffer */
+using BodySink = std::function<void(const char *data, size_t length)>;
+
+/*
+ * header fields in arrival order, names compare case insensitively.
+ * clear() keeps the strings so a reused request does not allocate
+ */
+class header_list {
+   private:
+    std::vector<std::pair<string, string>> entries;
+    size_t size_ = 0;
+
+   public:
+    using const_iterator = std::vector<std::pair<string, string>>::const_iterator;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() { size_ = 0; }
+
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.begin() + size_; }
+
+    const string *find(const string_ref &key) const {
+        for (size_t i = 0; i < size_; i++)
+            if (equal_nocase(entries[i].first, key)) return &entries[i].second;
+        return nullptr;
+    }
+    string *find(const string_ref &key) {
+        for (size_t i = 0; i < size_; i++)
+            if (equal_nocase(entries[i].first, key)) return &entries[i].second;
+        return nullptr;
+    }
+
+    /* set key to an empty value and return it for filling in */
+    string &set(const string_ref &key) {
+        string *v = find(key);
+        if (!v) {
+            add(key, string_ref());
+            v = &entries[size_ - 1].second;
+        }
+        v->clear();
+        return *v;
+    }
+
+    void set(const string_ref &key, const string_ref &value) {
+        string *v = find(key);
+        if (v)
+            v->assign(value.data(), value.size());
+        else
+            add(key, value);
+    }
+
+    void add(const string_ref &key, const string_ref &value) {
+        if (size_ == entries.size()) entries.emplace_back();
+        entries[size_].first.assign(key.data(), key.size());
+        entries[size_].second.assign(value.data(), value.size());
+        size_++;
+    }
+
+    /* value of the last field, for continuation lines */
+    string *back() { return size_ ? &entries[size_ - 1].second : nullptr; }
+};
 
 class request {
    private:
-    map<string, string> headers;
+    header_list headers;
     std::unique_ptr<buffer> buf_;
 
     /* chunked */
     bool chunked = false;
     long ntoread = 0;
 
+    BodySink sink;
+
    public:
     string firstline;
 
@@ -47,8 +121,13 @@ class request {
     int minor = 1;
 
     /* for request */
+    string target;  // as received, uri is target decoded without query
     string uri;
     string query;
+    route_params params;  // captures of the matched route
+
+    /* parse returns HEADERSREAD once before a body is read */
+    bool stopAtBody = false;
 
     /* for response */
     http_code_t response_code;
@@ -58,12 +137,55 @@ class request {
     request() { buf_ = std::make_unique<buffer>(); }
     ~request() {}
 
+    /*
+     * make the request ready to parse or build a new message, the
+     * storage of strings, headers and body is kept for reuse
+     */
+    void reset();
+
     inline buffer *get_buffer() const { return buf_.get(); }
-    inline string get_header(const string &key) const {
-        return headers.count(key) ? headers.at(key) : "";
+    inline const string &get_header(const string_ref &key) const {
+        static const string none;
+        auto v = headers.find(key);
+        return v ? *v : none;
+    }
+    inline void set_header(const string_ref &key, const string_ref &value) {
+        headers.set(key, value);
+    }
+    /* one more field, an existing one of the same name is kept */
+    inline void add_header(const string_ref &key, const string_ref &value) {
+        headers.add(key, value);
+    }
+    inline const header_list &get_headers() const { return headers; }
+    inline string_ref get_param(const string_ref &name) const {
+        return params.get(name);
+    }
+
+    /*
+     * deliver the rest of the body to sink as it is parsed instead of
+     * collecting it in the request buffer
+     */
+    inline void set_body_sink(BodySink &&s) { sink = std::move(s); }
+    inline bool has_body_sink() const { return bool(sink); }
+    /* body bytes framed elsewhere, http/2 DATA, to the sink or buffer */
+    inline void push_body(const char *data, size_t length) {
+        if (sink)
+            sink(data, length);
+        else
+            buf_->push((void *)data, length);
+    }
+
+    /* body bytes still expected with a known length, -1 otherwise */
+    inline long body_remaining() const {
+        return status == READING_BODY && !chunked ? ntoread : -1;
+    }
+    /* the body has no length and ends when the connection closes */
+    inline bool body_until_close() const {
+        return status == READING_BODY && !chunked && ntoread < 0;
     }
-    inline void set_header(const string &key, const string &value) {
-        headers[key] = value;
+    /* n body bytes were consumed from the socket by the caller */
+    inline void body_consumed(long n) {
+        if (body_remaining() >= n) ntoread -= n;
     }
 
     inline void set_protocol(int major, int minor) {
@@ -82,15 +204,17 @@ class request {
     parse_status_t parse_trailer(buffer *buf);
 
     /* request format: method uri protocol */
-    int parse_request_line(const string &line);
+    int parse_request_line(const string_ref &line);
     /* response format: protocol response_code response_line */
-    int parse_response_line(const string &line);
+    int parse_response_line(const string_ref &line);
 
     int get_body_length();
 
     void send_to(buffer *buf);
 
    private:
+    int parse_protocol(const string_ref &protocol);
+    void take_body(buffer *buf, long n);
     void push_not_found();
     void push_error(int error, const std::string &reason);
 };
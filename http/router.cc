@@ -0,0 +1,139 @@
+#include "router.hh"
+
+#include <core/log.hh>
+
+namespace wxg {
+
+void router::add(int method, const std::string &pattern,
+                 RequestHandler &&handler) {
+    route r;
+    r.handler = std::move(handler);
+    add(method, pattern, std::move(r));
+}
+
+void router::add(int method, const std::string &pattern, route &&r) {
+    if (method < 0 || method > ANY) return;
+
+    node *n = root.get();
+    string_ref p(pattern);
+    size_t literal = 0;  // start of pending literal text
+    size_t i = 0;
+
+    while (i < p.size()) {
+        size_t end = p.find('/', i);
+        if (end == string_ref::npos) end = p.size();
+        string_ref segment = p.substr(i, end - i);
+
+        if (segment == "*" || (segment.size() > 1 && segment[0] == ':')) {
+            n = insert_literal(n, p.substr(literal, i - literal));
+
+            if (segment[0] == '*') {
+                if (!n->wildcard) n->wildcard = std::make_unique<node>();
+                n = n->wildcard.get();
+            } else {
+                string_ref name = segment.substr(1);
+                if (!n->param) {
+                    n->param = std::make_unique<node>();
+                    n->param->paramName = name.str();
+                } else if (n->param->paramName != name.str()) {
+                    LOG_WARN("route %s: param %s shadowed by :%s",
+                             pattern.c_str(), name.str().c_str(),
+                             n->param->paramName.c_str());
+                }
+                n = n->param.get();
+            }
+            literal = end;
+        }
+        i = end + 1;
+    }
+    if (literal < p.size()) n = insert_literal(n, p.substr(literal));
+
+    static const char *methods[] = {"GET", "POST", "HEAD", "ANY"};
+    names.push_back(std::string(methods[method]) + " " + pattern);
+    r.id = names.size();
+
+    if (!n->routes[method]) size_++;
+    n->routes[method] = std::move(r);
+}
+
+const std::string &router::name(int id) const {
+    static const std::string none = "none";
+    return id > 0 && id <= int(names.size()) ? names[id - 1] : none;
+}
+
+router::node *router::insert_literal(node *n, const string_ref &s) {
+    if (s.empty()) return n;
+
+    size_t i = n->indices.find(s[0]);
+    if (i == std::string::npos) {
+        auto child = std::make_unique<node>();
+        child->path = s.str();
+        n->indices.push_back(s[0]);
+        n->children.push_back(std::move(child));
+        return n->children.back().get();
+    }
+
+    node *child = n->children[i].get();
+    size_t l = 0, max = std::min(child->path.size(), s.size());
+    while (l < max && child->path[l] == s[l]) l++;
+
+    if (l < child->path.size()) {  // split the edge at the common prefix
+        auto mid = std::make_unique<node>();
+        mid->path = child->path.substr(0, l);
+        child->path.erase(0, l);
+        mid->indices.push_back(child->path[0]);
+        mid->children.push_back(std::move(n->children[i]));
+        n->children[i] = std::move(mid);
+        child = n->children[i].get();
+    }
+
+    return insert_literal(child, s.substr(l));
+}
+
+const route *router::lookup(request_type_t method, const string_ref &uri,
+                            route_params *params) const {
+    if (params) params->clear();
+    route_params ignored;
+    return match(root.get(), method, uri, params ? params : &ignored);
+}
+
+const route *router::match(const node *n, request_type_t method,
+                           const string_ref &rest,
+                           route_params *params) const {
+    if (rest.empty()) {
+        if (n->routes[method]) return &n->routes[method];
+        if (n->routes[ANY]) return &n->routes[ANY];
+        return nullptr;
+    }
+
+    size_t i = n->indices.find(rest[0]);
+    if (i != std::string::npos) {
+        const node *child = n->children[i].get();
+        if (rest.starts_with(child->path)) {
+            auto h = match(child, method, rest.substr(child->path.size()),
+                           params);
+            if (h) return h;
+        }
+    }
+
+    if (!n->param && !n->wildcard) return nullptr;
+
+    size_t end = rest.find('/');
+    if (end == string_ref::npos) end = rest.size();
+    if (end == 0) return nullptr;
+
+    string_ref segment = rest.substr(0, end);
+    if (n->param && params->push(n->param->paramName, segment)) {
+        auto h = match(n->param.get(), method, rest.substr(end), params);
+        if (h) return h;
+        params->pop();
+    }
+    if (n->wildcard && params->push("*", segment)) {
+        auto h = match(n->wildcard.get(), method, rest.substr(end), params);
+        if (h) return h;
+        params->pop();
+    }
+    return nullptr;
+}
+
+}  // namespace wxg
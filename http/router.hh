@@ -0,0 +1,140 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <core/string.hh>
+
+#include "http.hh"
+
+namespace wxg {
+
+class request;
+class http_connection;
+using RequestHandler = std::function<void(request *, http_connection *)>;
+using BodyHandler = std::function<void(request *, http_connection *,
+                                       const char *data, size_t length)>;
+
+/*
+ * handlers of one route and method. a plain route gets the whole request
+ * once the body is buffered, a streaming route gets the headers first,
+ * then body pieces as they arrive, then complete
+ */
+struct route {
+    int id = 0;  // from 1 in the order of adding, 0 for no route
+
+    RequestHandler handler;
+
+    RequestHandler headers;
+    BodyHandler body;
+    RequestHandler complete;
+
+    bool streaming() const { return bool(body) || bool(complete); }
+    explicit operator bool() const { return bool(handler) || streaming(); }
+};
+
+struct route_param {
+    string_ref name;
+    string_ref value;
+};
+
+/*
+ * captures of one lookup, values point into the matched uri
+ */
+class route_params {
+   public:
+    static const int MAX_PARAMS = 8;
+
+   private:
+    route_param params_[MAX_PARAMS];
+    int size_ = 0;
+
+   public:
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() { size_ = 0; }
+
+    const route_param &operator[](int i) const { return params_[i]; }
+
+    bool push(const string_ref &name, const string_ref &value) {
+        if (size_ == MAX_PARAMS) return false;
+        params_[size_].name = name;
+        params_[size_].value = value;
+        size_++;
+        return true;
+    }
+    void pop() {
+        if (size_ > 0) size_--;
+    }
+
+    string_ref get(const string_ref &name) const {
+        for (int i = 0; i < size_; i++)
+            if (params_[i].name == name) return params_[i].value;
+        return string_ref();
+    }
+};
+
+/*
+ * radix tree of routes, built once when handlers are registered.
+ *
+ * a route is a '/' separated pattern, a segment can be:
+ *   literal   /user/list
+ *   :name     captures one non-empty segment as a param named "name"
+ *   *         matches one non-empty segment, captured as param "*"
+ *
+ * lookup walks the uri once, preferring literal edges over :name over *,
+ * and never allocates.
+ */
+class router {
+   public:
+    /* handler slot used for any method */
+    static const int ANY = HEAD + 1;
+
+   private:
+    struct node {
+        std::string path;      // literal edge label
+        std::string indices;   // first byte of each child label
+        std::vector<std::unique_ptr<node>> children;
+
+        std::unique_ptr<node> param;  // ":name" child
+        std::string paramName;
+        std::unique_ptr<node> wildcard;  // "*" child
+
+        route routes[ANY + 1];
+    };
+
+    std::unique_ptr<node> root;
+    int size_ = 0;
+    std::vector<std::string> names;  // of route ids, "GET /user/:id"
+
+   public:
+    router() { root = std::make_unique<node>(); }
+    ~router() {}
+
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /* route ids are below ids(), 0 stands for requests without a route */
+    int ids() const { return names.size() + 1; }
+    const std::string &name(int id) const;
+
+    /* method: GET/POST/HEAD or ANY */
+    void add(int method, const std::string &pattern, RequestHandler &&handler);
+    void add(int method, const std::string &pattern, route &&r);
+
+    /*
+     * find route of method for uri, captures are stored in params,
+     * nullptr if no route matches
+     */
+    const route *lookup(request_type_t method, const string_ref &uri,
+                        route_params *params) const;
+
+   private:
+    node *insert_literal(node *n, const string_ref &s);
+    const route *match(const node *n, request_type_t method,
+                       const string_ref &rest, route_params *params) const;
+};
+
+}  // namespace wxg
@@ -0,0 +1,171 @@
+#include "sse.hh"
+#include "http_connection.hh"
+#include "http_thread.hh"
+
+#include <core/time.hh>
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace wxg {
+
+/* subscribers of one hub on one thread, touched only by that thread */
+class sse_topics {
+   private:
+    sse_hub *hub;
+    std::unordered_map<std::string, std::vector<http_connection *>> topics;
+    // topics of each subscriber, removed from all of them on close
+    std::unordered_map<http_connection *, std::vector<std::string>> joined;
+    std::vector<http_connection *> slow;
+
+   public:
+    std::atomic<size_t> count{0};  // read by publishers to skip this thread
+
+   public:
+    sse_topics(sse_hub *h) : hub(h) {}
+
+    inline bool subscribed(http_connection *conn) const {
+        return joined.count(conn) != 0;
+    }
+
+    void add(const std::string &topic, http_connection *conn) {
+        auto &mine = joined[conn];
+        if (std::find(mine.begin(), mine.end(), topic) != mine.end()) return;
+        mine.push_back(topic);
+
+        topics[topic].push_back(conn);
+        count++;
+        hub->subscribers_++;
+    }
+
+    void remove(http_connection *conn) {
+        auto it = joined.find(conn);
+        if (it == joined.end()) return;
+        for (const std::string &topic : it->second) leave(topic, conn);
+        joined.erase(it);
+    }
+
+    void leave(const std::string &topic, http_connection *conn) {
+        auto it = topics.find(topic);
+        if (it == topics.end()) return;
+        auto &subs = it->second;
+        auto s = std::find(subs.begin(), subs.end(), conn);
+        if (s == subs.end()) return;
+
+        *s = subs.back();
+        subs.pop_back();
+        if (subs.empty()) topics.erase(it);
+        count--;
+        hub->subscribers_--;
+    }
+
+    void deliver(const std::string &topic,
+                 const std::shared_ptr<const std::string> &frame) {
+        auto it = topics.find(topic);
+        if (it == topics.end()) return;
+
+        for (http_connection *conn : it->second) {
+            if (conn->output_length() > hub->dropBytes)
+                slow.push_back(conn);
+            else
+                conn->send_data(frame);
+        }
+
+        // closing removes them from the topic, not while it is walked
+        for (http_connection *conn : slow) {
+            hub->dropped_++;
+            conn->close();
+        }
+        slow.clear();
+    }
+};
+
+sse_hub::sse_hub() {
+    static std::atomic<int> ids{0};
+    id = ids++;
+}
+
+sse_topics *sse_hub::get_topics(http_thread *thread) {
+    static thread_local std::unordered_map<int, std::unique_ptr<sse_topics>>
+        all;
+    auto &t = all[id];
+    if (!t) {
+        t = std::make_unique<sse_topics>(this);
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.emplace_back(thread, t.get());
+    }
+    return t.get();
+}
+
+void sse_hub::subscribe(const std::string &topic, request *req,
+                        http_connection *conn) {
+    sse_topics *t = get_topics(conn->thread);
+    if (t->subscribed(conn)) {
+        t->add(topic, conn);
+        return;
+    }
+
+    // the body lasts until the connection closes, there is no length
+    std::string head =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n"
+        "Date: " +
+        time::get_date() + "\r\n\r\n";
+    conn->send_data(head.data(), head.size());
+
+    t->add(topic, conn);
+    conn->add_close_handler([t](http_connection *c) { t->remove(c); });
+}
+
+/* a field of one line, a line break would end it early */
+static void append_field(std::string &s, const char *name,
+                         const std::string &value) {
+    s.append(name);
+    for (char c : value)
+        if (c != '\r' && c != '\n') s.push_back(c);
+    s.push_back('\n');
+}
+
+std::shared_ptr<const std::string> sse_hub::format(const std::string &data,
+                                                   const std::string &event,
+                                                   const std::string &id) {
+    auto s = std::make_shared<std::string>();
+    s->reserve(data.size() + event.size() + id.size() + 32);
+    if (!event.empty()) append_field(*s, "event: ", event);
+    if (!id.empty()) append_field(*s, "id: ", id);
+
+    // lines end with CRLF, LF or CR as in the event stream grammar
+    size_t start = 0;
+    while (true) {
+        size_t end = data.find_first_of("\r\n", start);
+        s->append("data: ");
+        s->append(data, start, end - start);
+        s->push_back('\n');
+        if (end == std::string::npos) break;
+        start = end + 1;
+        if (data[end] == '\r' && start < data.size() && data[start] == '\n')
+            start++;
+    }
+    s->push_back('\n');
+    return s;
+}
+
+void sse_hub::publish(const std::string &topic, const std::string &data,
+                      const std::string &event, const std::string &id) {
+    publish(topic, format(data, event, id));
+}
+
+void sse_hub::publish(const std::string &topic,
+                      const std::shared_ptr<const std::string> &frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &t : threads) {
+        sse_topics *topics = t.second;
+        if (topics->count == 0) continue;
+        t.first->run_in_loop(
+            [topics, topic, frame]() { topics->deliver(topic, frame); });
+    }
+}
+
+}  // namespace wxg
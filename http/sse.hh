@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace wxg {
+
+class request;
+class http_connection;
+class http_thread;
+class sse_topics;
+
+/*
+ * server-sent events, publish/subscribe over all threads of a server.
+ *
+ * a handler subscribes its connection to a topic, the connection then
+ * carries a text/event-stream body until it closes. an event is
+ * formatted once and every subscriber gets the same shared string as an
+ * output segment, written with writev and never copied per connection.
+ * publishing may happen on any thread, each thread delivers to its own
+ * subscribers on its next turn of the loop.
+ *
+ * a subscriber with more than dropBytes of output still pending when an
+ * event arrives is closed. the hub outlives the server
+ */
+class sse_hub {
+   private:
+    int id;
+    size_t dropBytes = 1024 * 1024;
+
+    std::mutex mutex;  // guards threads
+    std::vector<std::pair<http_thread *, sse_topics *>> threads;
+
+    std::atomic<size_t> subscribers_{0};
+    std::atomic<size_t> dropped_{0};
+
+    friend class sse_topics;
+
+   public:
+    sse_hub();
+
+    /* pending output at which a subscriber is dropped */
+    void set_drop_watermark(size_t bytes) { dropBytes = bytes; }
+
+    /*
+     * answer req with an event stream and add conn to topic, it stays
+     * subscribed until the connection closes. a connection subscribed
+     * already joins topic on the stream it has, once
+     */
+    void subscribe(const std::string &topic, request *req,
+                   http_connection *conn);
+
+    /*
+     * from any thread. data of several lines is sent as several fields,
+     * line breaks in event and id are dropped
+     */
+    void publish(const std::string &topic, const std::string &data,
+                 const std::string &event = "", const std::string &id = "");
+    /* a formatted event, the string must not change afterwards */
+    void publish(const std::string &topic,
+                 const std::shared_ptr<const std::string> &frame);
+
+    /* the event stream form of one event, ending with a blank line */
+    static std::shared_ptr<const std::string> format(
+        const std::string &data, const std::string &event = "",
+        const std::string &id = "");
+
+    inline size_t subscribers() const { return subscribers_; }
+    /* subscribers closed for falling behind, since the start */
+    inline size_t dropped() const { return dropped_; }
+
+   private:
+    sse_topics *get_topics(http_thread *thread);
+};
+
+}  // namespace wxg
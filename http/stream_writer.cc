@@ -0,0 +1,117 @@
+#include "stream_writer.hh"
+#include "http_connection.hh"
+#include "http_thread.hh"
+
+#include <cstdio>
+
+namespace wxg {
+
+void stream_writer::start(http_code_t code, const std::string &reason) {
+    cancel();
+    active_ = true;
+
+    auto r = conn->thread->get_response();
+    r->set_response(code, reason);
+    r->set_header("Transfer-Encoding", "chunked");
+    r->set_header("Content-Length", "");
+    conn->send_request(r.get());
+    conn->thread->release_request(std::move(r));
+}
+
+void stream_writer::set_coalesce(size_t bytes, int usec) {
+    coalesceBytes = bytes;
+    coalesceUsec = usec;
+}
+
+void stream_writer::set_drain_handler(DrainHandler &&handler) {
+    drain = std::move(handler);
+}
+
+bool stream_writer::writable() const {
+    return active_ && !conn->output_paused();
+}
+
+int stream_writer::write(const char *data, size_t length) {
+    if (!active_) return -1;
+    if (length == 0) return 0;  // an empty chunk would end the body
+
+    pending.push((void *)data, length);
+    if (pending.length() >= coalesceBytes)
+        flush();
+    else
+        arm_timer();
+    return 0;
+}
+
+int stream_writer::write(buffer *buf) {
+    if (!active_) return -1;
+    int n = write((const char *)buf->get(), buf->length());
+    buf->clear();
+    return n;
+}
+
+int stream_writer::write(const std::shared_ptr<const std::string> &data) {
+    if (!active_) return -1;
+    if (!data || data->empty()) return 0;
+
+    flush();
+    push_chunk_head(data->size());
+    conn->push(data);
+    conn->get_write_buffer()->push((void *)"\r\n", 2);
+    conn->output_added();
+    return 0;
+}
+
+void stream_writer::flush() {
+    if (timerId >= 0) {
+        conn->get_reactor()->get_time_manager()->remove(timerId);
+        timerId = -1;
+    }
+    if (pending.empty()) return;
+
+    push_chunk_head(pending.length());
+    conn->get_write_buffer()->push(&pending);
+    conn->get_write_buffer()->push((void *)"\r\n", 2);
+    conn->output_added();
+}
+
+void stream_writer::end() {
+    if (!active_) return;
+
+    flush();
+    active_ = false;
+    conn->get_write_buffer()->push((void *)"0\r\n\r\n", 5);
+    conn->output_added();
+}
+
+void stream_writer::drained() {
+    if (active_ && drain) drain(this);
+}
+
+void stream_writer::cancel() {
+    if (timerId >= 0) {
+        conn->get_reactor()->get_time_manager()->remove(timerId);
+        timerId = -1;
+    }
+    pending.clear();
+    active_ = false;
+    drain = nullptr;
+}
+
+void stream_writer::push_chunk_head(size_t length) {
+    char head[24];
+    int n = std::snprintf(head, sizeof(head), "%zx\r\n", length);
+    conn->get_write_buffer()->push(head, n);
+}
+
+void stream_writer::arm_timer() {
+    if (timerId >= 0 || coalesceUsec <= 0) return;
+
+    timerId = conn->get_reactor()->get_time_manager()->set_timer(
+        coalesceUsec / 1000000, coalesceUsec % 1000000, false, [this]() {
+            timerId = -1;
+            flush();
+        });
+}
+
+}  // namespace wxg
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <core/buffer.hh>
+
+#include "http.hh"
+
+namespace wxg {
+
+class http_connection;
+class stream_writer;
+
+using DrainHandler = std::function<void(stream_writer *)>;
+
+/*
+ * chunked response body written by a producer, owned by the connection.
+ *
+ * the producer writes while writable() and is called back through the
+ * drain handler whenever the connection output drops to its low
+ * watermark. small writes are coalesced into one chunk until
+ * coalesceBytes are pending or coalesceUsec passed, shared strings are
+ * queued as chunks without being copied.
+ */
+class stream_writer {
+   private:
+    http_connection *conn = nullptr;
+
+    buffer pending;  // small writes not sent yet
+    size_t coalesceBytes = 0;
+    int coalesceUsec = 0;
+    int timerId = -1;
+
+    bool active_ = false;
+    DrainHandler drain;
+
+   public:
+    stream_writer(http_connection *c) : conn(c) {}
+    ~stream_writer() { cancel(); }
+
+    /* send the response head, the body follows with write */
+    void start(http_code_t code, const std::string &reason);
+
+    /* 0 bytes and 0 usec send every write as its own chunk */
+    void set_coalesce(size_t bytes, int usec);
+    void set_drain_handler(DrainHandler &&handler);
+
+    inline bool active() const { return active_; }
+    bool writable() const;
+
+    int write(const char *data, size_t length);
+    int write(const std::string &s) { return write(s.data(), s.size()); }
+    int write(buffer *buf);
+    /* zero copy, data must not change until it is written */
+    int write(const std::shared_ptr<const std::string> &data);
+
+    /* send coalesced bytes now */
+    void flush();
+    /* flush and terminate the body */
+    void end();
+
+    /* connection output reached the low watermark */
+    void drained();
+    /* connection is closing, drop everything */
+    void cancel();
+
+   private:
+    void push_chunk_head(size_t length);
+    void arm_timer();
+};
+
+}  // namespace wxg
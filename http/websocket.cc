@@ -0,0 +1,360 @@
+#include "websocket.hh"
+#include "http_connection.hh"
+#include "http_thread.hh"
+
+#include <core/sha1.hh>
+#include <core/string.hh>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace wxg {
+
+static const char *const GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+/*
+ * xor payload with the 4 byte masking key. the key repeats every 4 bytes
+ * so whole 16 and 8 byte words take a widened key, every step keeps the
+ * offset a multiple of 4
+ */
+static void unmask(unsigned char *p, size_t n, const unsigned char key[4]) {
+    uint32_t k32;
+    std::memcpy(&k32, key, 4);
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i k = _mm_set1_epi32((int)k32);
+    for (; i + 64 <= n; i += 64) {
+        __m128i *q = (__m128i *)(p + i);
+        __m128i a = _mm_loadu_si128(q), b = _mm_loadu_si128(q + 1),
+                c = _mm_loadu_si128(q + 2), d = _mm_loadu_si128(q + 3);
+        _mm_storeu_si128(q, _mm_xor_si128(a, k));
+        _mm_storeu_si128(q + 1, _mm_xor_si128(b, k));
+        _mm_storeu_si128(q + 2, _mm_xor_si128(c, k));
+        _mm_storeu_si128(q + 3, _mm_xor_si128(d, k));
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i *q = (__m128i *)(p + i);
+        _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), k));
+    }
+#endif
+
+    const uint64_t k64 = (uint64_t)k32 << 32 | k32;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, p + i, 8);
+        v ^= k64;
+        std::memcpy(p + i, &v, 8);
+    }
+    for (; i < n; i++) p[i] ^= key[i & 3];
+}
+
+/* codes a peer may send, rfc 6455 7.4 */
+static bool valid_close_code(int code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+           (code >= 3000 && code <= 4999);
+}
+
+std::string websocket::accept_key(const std::string &key) {
+    return base64_encode(sha1::hash(key + GUID).data(), sha1::DIGEST);
+}
+
+int websocket::start(request *req, const std::string &protocol) {
+    const string &key = req->get_header("Sec-WebSocket-Key");
+    if (req->type != GET ||
+        !has_token(req->get_header("Upgrade"), "websocket") ||
+        !has_token(req->get_header("Connection"), "upgrade") ||
+        key.size() != 24) {
+        conn->send_reply(HTTP_BADREQUEST, "Bad Request", "400 Bad Request");
+        return -1;
+    }
+
+    if (req->get_header("Sec-WebSocket-Version") != "13") {
+        auto r = conn->thread->get_response();
+        r->get_buffer()->push("426 Upgrade Required");
+        r->set_response(HTTP_UPGRADEREQUIRED, "Upgrade Required");
+        r->set_header("Sec-WebSocket-Version", "13");
+        conn->send_request(r.get());
+        conn->thread->release_request(std::move(r));
+        return -1;
+    }
+
+    std::string head =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: " +
+        accept_key(key) + "\r\n";
+    if (!protocol.empty())
+        head += "Sec-WebSocket-Protocol: " + protocol + "\r\n";
+    head += "\r\n";
+    conn->send_data(head.data(), head.size());
+
+    open_ = true;
+    closeSent = false;
+    heard = true;
+    closeCode = WS_ABNORMAL;
+    return 0;
+}
+
+void websocket::set_ping_interval(int ms) {
+    auto timers = conn->get_reactor()->get_time_manager();
+    if (pingTimer >= 0) timers->remove(pingTimer);
+    pingTimer = -1;
+    if (ms <= 0 || !open_) return;
+
+    heard = true;
+    pingTimer = timers->set_timer(ms / 1000, ms % 1000 * 1000, true, [this]() {
+        if (!heard) {  // closing cancels this timer
+            conn->close();
+            return;
+        }
+        heard = false;
+        ping();
+    });
+}
+
+bool websocket::writable() const {
+    return is_open() && !conn->output_paused();
+}
+
+void websocket::push_head(int opcode, bool fin, size_t length) {
+    unsigned char h[10];
+    size_t n = 2;
+    h[0] = (fin ? 0x80 : 0) | opcode;
+    if (length < 126) {
+        h[1] = length;
+    } else if (length <= 0xFFFF) {
+        h[1] = 126;
+        h[2] = length >> 8;
+        h[3] = length;
+        n = 4;
+    } else {
+        h[1] = 127;
+        for (int i = 0; i < 8; i++) h[2 + i] = (uint64_t)length >> (56 - 8 * i);
+        n = 10;
+    }
+    conn->get_write_buffer()->push(h, n);
+}
+
+int websocket::send(ws_opcode_t opcode, const char *data, size_t length) {
+    if (!is_open()) return -1;
+
+    size_t frame = fragmentSize && !(opcode & 0x8) ? fragmentSize : length;
+    size_t off = 0;
+    int op = opcode;
+    do {
+        size_t n = std::min(frame, length - off);
+        push_head(op, off + n == length, n);
+        conn->get_write_buffer()->push((void *)(data + off), n);
+        off += n;
+        op = WS_CONTINUATION;
+    } while (off < length);
+
+    conn->output_added();
+    return 0;
+}
+
+int websocket::send(ws_opcode_t opcode,
+                    const std::shared_ptr<const std::string> &data) {
+    if (!is_open() || !data) return -1;
+
+    push_head(opcode, true, data->size());
+    conn->push(data);
+    conn->output_added();
+    return 0;
+}
+
+int websocket::ping(const std::string &payload) {
+    if (payload.size() > 125) return -1;
+    return send(WS_PING, payload.data(), payload.size());
+}
+
+void websocket::send_close(int code, const std::string &reason) {
+    unsigned char body[125];
+    size_t n = 0;
+    if (code != WS_NOSTATUS) {
+        body[0] = code >> 8;
+        body[1] = code;
+        n = 2 + std::min(reason.size(), sizeof(body) - 2);
+        std::memcpy(body + 2, reason.data(), n - 2);
+    }
+    push_head(WS_CLOSE, true, n);
+    conn->get_write_buffer()->push(body, n);
+    conn->output_added();
+    closeSent = true;
+}
+
+void websocket::close(int code, const std::string &reason) {
+    if (!is_open()) return;
+
+    send_close(code, reason);
+    closeTimer = conn->get_reactor()->get_time_manager()->set_timer(
+        CLOSE_WAIT_SEC, 0, false, [this]() {
+            closeTimer = -1;
+            conn->close();
+        });
+}
+
+void websocket::parse(buffer *in) {
+    while (open_ && conn->status == CONNECTED && in->length() >= 2) {
+        auto p = (unsigned char *)in->get();
+        size_t avail = in->length();
+
+        bool fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0F;
+        uint64_t length = p[1] & 0x7F;
+        size_t head = 2;
+        if (length == 126) {
+            if (avail < 4) return;
+            length = p[2] << 8 | p[3];
+            head = 4;
+        } else if (length == 127) {
+            if (avail < 10) return;
+            length = 0;
+            for (int i = 0; i < 8; i++) length = length << 8 | p[2 + i];
+            head = 10;
+        }
+
+        // clients mask every frame and use no extension
+        bool isControl = opcode & 0x8;
+        if ((p[0] & 0x70) || !(p[1] & 0x80) ||
+            (isControl ? !fin || length > 125 || opcode > WS_PONG
+                     : opcode > WS_BINARY)) {
+            fail(WS_PROTOCOLERROR);
+            return;
+        }
+        if (length > maxMessage) {
+            fail(WS_TOOBIG);
+            return;
+        }
+        if (avail < head + 4 + length) return;
+
+        unsigned char *data = p + head + 4;
+        unmask(data, length, p + head);
+        heard = true;
+
+        if (isControl) {
+            if (control((ws_opcode_t)opcode, (const char *)data, length) ==
+                -1)
+                return;
+        } else if (closeSent) {
+            // data after our close frame is dropped
+        } else if (opcode == WS_CONTINUATION) {
+            if (messageOpcode == WS_CONTINUATION) {
+                fail(WS_PROTOCOLERROR);
+                return;
+            }
+            if (message.size() + length > maxMessage) {
+                fail(WS_TOOBIG);
+                return;
+            }
+            message.append((const char *)data, length);
+            if (fin) {
+                ws_opcode_t op = messageOpcode;
+                messageOpcode = WS_CONTINUATION;
+                deliver(op, message.data(), message.size());
+                message.clear();
+            }
+        } else {
+            if (messageOpcode != WS_CONTINUATION) {
+                fail(WS_PROTOCOLERROR);
+                return;
+            }
+            if (fin) {
+                deliver((ws_opcode_t)opcode, (const char *)data, length);
+            } else {
+                messageOpcode = (ws_opcode_t)opcode;
+                message.assign((const char *)data, length);
+            }
+        }
+
+        // the handler may have closed the connection and its buffers
+        if (!open_) return;
+        in->drain(head + 4 + length);
+    }
+
+    if (open_ && in->empty() && messageOpcode == WS_CONTINUATION)
+        conn->release_idle_buffers();
+}
+
+void websocket::deliver(ws_opcode_t opcode, const char *data, size_t length) {
+    if (opcode == WS_TEXT && !valid_utf8(data, length)) {
+        fail(WS_INVALIDDATA);
+        return;
+    }
+    if (onmessage) onmessage(this, opcode, data, length);
+}
+
+/* -1 when parsing stops */
+int websocket::control(ws_opcode_t opcode, const char *data, size_t length) {
+    switch (opcode) {
+        case WS_PING:
+            if (!closeSent) send(WS_PONG, data, length);
+            return 0;
+        case WS_PONG:
+            return 0;
+        default:
+            break;
+    }
+
+    int code = WS_NOSTATUS;
+    if (length >= 2) {
+        code = (unsigned char)data[0] << 8 | (unsigned char)data[1];
+        if (!valid_close_code(code)) {
+            fail(WS_PROTOCOLERROR);
+            return -1;
+        }
+        if (!valid_utf8(data + 2, length - 2)) {
+            fail(WS_INVALIDDATA);
+            return -1;
+        }
+    } else if (length == 1) {
+        fail(WS_PROTOCOLERROR);
+        return -1;
+    }
+
+    closeCode = code;
+    if (!closeSent) send_close(code, "");  // echo the code
+    shutdown();
+    return -1;
+}
+
+/* fail the connection, rfc 6455 7.1.7 */
+void websocket::fail(int code) {
+    if (!closeSent) send_close(code, "");
+    closeCode = code;
+    shutdown();
+}
+
+/* close the tcp connection once the close frame is out */
+void websocket::shutdown() {
+    conn->status = CLOSING;
+    conn->get_reactor()->remove_read(conn->fd);
+    conn->get_reactor()->add_write(conn->fd);
+}
+
+void websocket::cancel() {
+    if (pingTimer >= 0 || closeTimer >= 0) {
+        auto timers = conn->get_reactor()->get_time_manager();
+        if (pingTimer >= 0) timers->remove(pingTimer);
+        if (closeTimer >= 0) timers->remove(closeTimer);
+        pingTimer = closeTimer = -1;
+    }
+
+    message.clear();
+    messageOpcode = WS_CONTINUATION;
+    if (!open_) return;
+
+    open_ = false;
+    onmessage = nullptr;
+    auto cb = std::move(onclose);
+    onclose = nullptr;
+    if (cb) cb(this, closeCode);
+}
+
+}  // namespace wxg
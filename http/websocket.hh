@@ -0,0 +1,134 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <core/buffer.hh>
+
+namespace wxg {
+
+class http_connection;
+class request;
+class websocket;
+
+enum ws_opcode_t {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA
+};
+
+/* status codes of a close frame, rfc 6455 7.4.1 */
+enum ws_close_t {
+    WS_NORMAL = 1000,
+    WS_GOINGAWAY = 1001,
+    WS_PROTOCOLERROR = 1002,
+    WS_UNSUPPORTED = 1003,
+    WS_NOSTATUS = 1005,  // close frame without a code
+    WS_ABNORMAL = 1006,  // closed without a close frame
+    WS_INVALIDDATA = 1007,
+    WS_TOOBIG = 1009
+};
+
+/* a complete message, data is only valid during the call */
+using MessageHandler = std::function<void(websocket *, ws_opcode_t opcode,
+                                          const char *data, size_t length)>;
+/* the connection is gone, code is the one the peer sent or WS_ABNORMAL */
+using WebSocketCloseHandler = std::function<void(websocket *, int code)>;
+
+/*
+ * rfc 6455 endpoint on an upgraded http_connection, owned by it and
+ * living in the same reactor.
+ *
+ * frames are parsed straight from the read buffer and unmasked in place
+ * 16 bytes at a time, an unfragmented message reaches the handler
+ * without being copied. fragments are joined up to maxMessage bytes.
+ * pings and the closing handshake are answered here, with a ping
+ * interval a peer silent for a whole interval is dropped
+ */
+class websocket {
+   private:
+    http_connection *conn = nullptr;
+
+    MessageHandler onmessage;
+    WebSocketCloseHandler onclose;
+
+    std::string message;  // fragments so far
+    ws_opcode_t messageOpcode = WS_CONTINUATION;  // none in progress
+    size_t maxMessage = 16 << 20;
+    size_t fragmentSize = 0;
+
+    int pingTimer = -1;
+    int closeTimer = -1;
+    bool heard = true;  // from the peer since the last ping
+    bool closeSent = false;
+    bool open_ = false;
+    int closeCode = WS_ABNORMAL;
+
+   public:
+    /* after our close frame, time for the peer to answer */
+    static const int CLOSE_WAIT_SEC = 5;
+
+   public:
+    websocket(http_connection *c) : conn(c) {}
+
+    /* Sec-WebSocket-Accept for a Sec-WebSocket-Key */
+    static std::string accept_key(const std::string &key);
+
+    /*
+     * answer the upgrade request req with 101 and protocol as the chosen
+     * subprotocol, -1 after replying 400 or 426 when req is no valid
+     * handshake
+     */
+    int start(request *req, const std::string &protocol);
+
+    void set_message_handler(MessageHandler &&handler) {
+        onmessage = std::move(handler);
+    }
+    void set_close_handler(WebSocketCloseHandler &&handler) {
+        onclose = std::move(handler);
+    }
+    /* larger messages fail the connection with WS_TOOBIG */
+    void set_max_message(size_t n) { maxMessage = n; }
+    /* messages above n bytes go out as several frames, 0 for one frame */
+    void set_fragment_size(size_t n) { fragmentSize = n; }
+    /* ping every ms, 0 stops */
+    void set_ping_interval(int ms);
+
+    inline bool is_open() const { return open_ && !closeSent; }
+    /* false while the connection output is above its high watermark */
+    bool writable() const;
+
+    int send(ws_opcode_t opcode, const char *data, size_t length);
+    int send_text(const std::string &s) {
+        return send(WS_TEXT, s.data(), s.size());
+    }
+    int send_binary(const char *data, size_t length) {
+        return send(WS_BINARY, data, length);
+    }
+    /* one frame, zero copy, data must not change until it is written */
+    int send(ws_opcode_t opcode,
+             const std::shared_ptr<const std::string> &data);
+    int ping(const std::string &payload = "");
+
+    /* start the closing handshake, the connection closes on the answer */
+    void close(int code = WS_NORMAL, const std::string &reason = "");
+
+    /* parse the frames in the read buffer */
+    void parse(buffer *in);
+    /* the connection closed, drop everything */
+    void cancel();
+
+   private:
+    void push_head(int opcode, bool fin, size_t length);
+    void send_close(int code, const std::string &reason);
+    int control(ws_opcode_t opcode, const char *data, size_t length);
+    void deliver(ws_opcode_t opcode, const char *data, size_t length);
+    void fail(int code);
+    void shutdown();
+};
+
+}  // namespace wxg
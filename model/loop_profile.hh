@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cxxabi.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include <core/log.hh>
+#include <core/time.hh>
+
+namespace wxg {
+
+/* one callback that held the loop longer than the stall threshold */
+struct loop_stall {
+    int fd = -1;  // -1 for timers
+    const char *kind = "";  // "read", "write" or "timers"
+    std::string handler;    // type of the callback, demangled
+    uint64_t ns = 0;
+};
+
+using StallHandler = std::function<void(const loop_stall &stall)>;
+
+/*
+ * where the time of one reactor goes, see reactor::set_profile. the loop
+ * thread writes it with relaxed loads and stores, a scrape or a watchdog
+ * reads it from another thread.
+ *
+ * each turn is split into the time blocked in listen, running timers and
+ * dispatching the ready fds. a callback running over stallNs is reported
+ * to the stall handler, on the loop thread once it returned
+ */
+struct loop_profile {
+    std::atomic<uint64_t> turns{0};
+    std::atomic<uint64_t> events{0};     // ready fds over all turns
+    std::atomic<uint64_t> maxEvents{0};  // in one turn
+    std::atomic<uint64_t> waitNs{0};
+    std::atomic<uint64_t> timerNs{0};
+    std::atomic<uint64_t> dispatchNs{0};
+    std::atomic<uint64_t> stalls{0};
+
+    /* cycle_clock ticks since the loop left listen, 0 while it waits */
+    std::atomic<uint64_t> busySince{0};
+    /* callback running now, for the watchdog */
+    std::atomic<int> runningFd{-1};
+    std::atomic<const std::type_info *> runningType{nullptr};
+
+    uint64_t stallNs = 50 * 1000 * 1000;
+    StallHandler onstall;
+
+    static inline void add(std::atomic<uint64_t> &c, uint64_t n) {
+        c.store(c.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+
+    static std::string demangle(const std::type_info *type) {
+        if (!type) return "";
+        int status = 0;
+        char *name = abi::__cxa_demangle(type->name(), nullptr, nullptr,
+                                         &status);
+        std::string s = status == 0 && name ? name : type->name();
+        std::free(name);
+        return s;
+    }
+
+    /* run cb of fd, timing it */
+    void run(int fd, const char *kind, const std::function<void()> &cb) {
+        const std::type_info *type = &cb.target_type();
+        runningFd.store(fd, std::memory_order_relaxed);
+        runningType.store(type, std::memory_order_relaxed);
+
+        uint64_t start = cycle_clock::now();
+        cb();
+        uint64_t ns = cycle_clock::to_ns(cycle_clock::now() - start);
+
+        runningFd.store(-1, std::memory_order_relaxed);
+        runningType.store(nullptr, std::memory_order_relaxed);
+        if (ns > stallNs) stalled(fd, kind, type, ns);
+    }
+
+    void stalled(int fd, const char *kind, const std::type_info *type,
+                 uint64_t ns) {
+        add(stalls, 1);
+
+        loop_stall s;
+        s.fd = fd;
+        s.kind = kind;
+        s.handler = demangle(type);
+        s.ns = ns;
+        if (onstall) {
+            onstall(s);
+            return;
+        }
+        LOG_WARN("loop stall: %s handler of fd %d ran %llums %s", s.kind, s.fd,
+                 (unsigned long long)(s.ns / 1000000), s.handler.c_str());
+    }
+};
+
+/*
+ * a thread checking that watched loops keep turning. a loop away from
+ * listen for longer than the limit is reported once for that turn, with
+ * the fd and callback it is in. stuck callbacks are reported while they
+ * still run, unlike stalls, which are known only when they return
+ */
+class loop_watchdog {
+   public:
+    using StuckHandler = std::function<void(
+        const std::string &name, uint64_t ns, int fd, const std::string &)>;
+
+   private:
+    struct watched {
+        std::string name;
+        const loop_profile *profile;
+        uint64_t reported;  // busySince of the turn reported last
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<watched> loops;
+    std::thread worker;
+    bool stopping = false;
+    uint64_t limitNs = 0;
+    StuckHandler onstuck;
+
+    std::atomic<uint64_t> stuck_{0};
+
+   public:
+    ~loop_watchdog() { stop(); }
+
+    void watch(const std::string &name, const loop_profile *profile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loops.push_back({name, profile, 0});
+    }
+
+    /* runs on the watchdog thread */
+    void set_stuck_handler(StuckHandler &&handler) {
+        onstuck = std::move(handler);
+    }
+
+    /* check about four times per limit */
+    void start(uint64_t limitMs) {
+        if (worker.joinable()) return;
+        limitNs = limitMs * 1000 * 1000;
+        stopping = false;
+        worker = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    /* reports since the start */
+    inline uint64_t stuck() const { return stuck_; }
+
+   private:
+    void run() {
+        auto period = std::chrono::nanoseconds(limitNs / 4);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, period, [this]() { return stopping; })) {
+            uint64_t now = cycle_clock::now();
+            for (auto &w : loops) check(w, now);
+        }
+    }
+
+    void check(watched &w, uint64_t now) {
+        uint64_t since = w.profile->busySince.load(std::memory_order_relaxed);
+        if (since == 0 || since == w.reported || now < since) return;
+
+        uint64_t ns = cycle_clock::to_ns(now - since);
+        if (ns < limitNs) return;
+
+        w.reported = since;
+        stuck_++;
+        int fd = w.profile->runningFd.load(std::memory_order_relaxed);
+        std::string handler = loop_profile::demangle(
+            w.profile->runningType.load(std::memory_order_relaxed));
+        if (onstuck) {
+            onstuck(w.name, ns, fd, handler);
+            return;
+        }
+        LOG_WARN("loop %s stuck for %llums in fd %d %s", w.name.c_str(),
+                 (unsigned long long)(ns / 1000000), fd, handler.c_str());
+    }
+};
+
+}  // namespace wxg
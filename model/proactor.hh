@@ -50,7 +50,7 @@ class proactor {
 
     template <typename F, typename... Args>
     void async_write(int socket, F &&f, Args &&... args) {
-        cout << "write handler " << socket << endl;
+        LOG_DEBUG("write handler %d", socket);
         if (socket < 0) return;
 
         Lock lock(mutex);
@@ -87,7 +87,7 @@ class proactor {
         ops[socket]->read_queue.push([f, args...]() { f(args...); });
 
         task_->set_read_handler(socket, [this, socket]() {
-            cout << "read handler " << socket << endl;
+            LOG_DEBUG("read handler %d", socket);
             if (!ops.count(socket)) return;
 
             auto &read_queue = ops[socket]->read_queue;
@@ -97,14 +97,14 @@ class proactor {
             read_queue.pop();
 
             if (read_queue.empty()) {
-                cout << "remove read handler" << endl;
+                LOG_DEBUG("remove read handler %d", socket);
                 task_->remove_read_handler(socket);
             }
 
             if (ops[socket]->read_queue.empty() &&
                 ops[socket]->write_queue.empty()) {
                 ops.erase(socket);
-                cout << "erase" << endl;
+                LOG_DEBUG("erase %d", socket);
             }
         });
     }
@@ -112,10 +112,9 @@ class proactor {
     void run() {
         Callback cb;
         while (!stopped) {
-            cout << "enter while" << endl;
+            LOG_DEBUG("enter while");
             if (!op_queue.empty()) {
-                cout << std::this_thread::get_id() << ":op_queue not empty"
-                     << endl;
+                LOG_DEBUG("op_queue not empty");
                 bool isPop = op_queue.pop(cb);
                 if (!op_queue.empty()) {
                     Lock lock(mutex);
@@ -123,13 +122,13 @@ class proactor {
                 }
                 if (isPop) cb();
             } else if (!ops.empty() && !inloop) {
-                cout << std::this_thread::get_id() << ":ops not empty" << endl;
+                LOG_DEBUG("ops not empty");
                 Lock lock(mutex);
                 inloop = true;
                 task_->loop(false, true);
                 inloop = false;
             } else {
-                cout << std::this_thread::get_id() << ":wait" << endl;
+                LOG_DEBUG("wait");
                 Lock lock(mutex);
                 cv.wait(lock,
                         [this]() { return !op_queue.empty() || stopped; });
@@ -1,13 +1,19 @@
 #pragma once
 
+#include <cerrno>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <unordered_map>
 #include <vector>
 
+#include <core/log.hh>
 #include <core/socket.hh>
 #include <core/time.hh>
+#include <core/trace.hh>
+
+#include "loop_profile.hh"
 
 namespace wxg {
 
@@ -32,6 +38,10 @@ class reactor {
 
     bool terminated = false;
 
+    Callback turncb;  // after the events of each turn of the loop
+
+    loop_profile *profile = nullptr;
+
    public:
     reactor() {
         timeManager = std::make_unique<wxg::time>();
@@ -45,6 +55,13 @@ class reactor {
 
     void set_terminated() { terminated = true; }
 
+    /* run f after every turn of the loop, once its events are handled */
+    void set_turn_handler(Callback &&f) { turncb = std::move(f); }
+
+    /* time the loop into p, which must outlive it. nullptr turns it off */
+    void set_profile(loop_profile *p) { profile = p; }
+    loop_profile *get_profile() const { return profile; }
+
    public:
     wxg::time *get_time_manager() const { return timeManager.get(); }
 
@@ -99,8 +116,9 @@ class reactor {
         remove_write(fd);
     }
 
-    void add_read(int fd) { io->add(fd, io->RD); }
-    void add_write(int fd) { io->add(fd, io->WR); }
+    /* -1 when the multiplexer cannot take fd */
+    int add_read(int fd) { return io->add(fd, io->RD); }
+    int add_write(int fd) { return io->add(fd, io->WR); }
     void remove_read(int fd) { io->remove(fd, io->RD); }
     void remove_write(int fd) { io->remove(fd, io->WR); }
 
@@ -119,33 +137,90 @@ class reactor {
             else if (!timeManager->empty())
                 timeout = timeManager->shortest_time();
 
-            int res = io->listen(timeout);
-
-            if (res == -1) {
-                std::cerr << "listen error res = -1" << std::endl;
-            }
-
-            timeManager->process();
-
-            for (const auto &fd : io->get_active_fd()) {
-                if (io->is_readable(fd) && channels[fd]->readcb)
-                    channels[fd]->readcb();
-                if (io->is_writeable(fd) && channels[fd]->writecb)
-                    channels[fd]->writecb();
+            if (profile) {
+                profiled_turn(timeout);
+            } else {
+                trace::emit(TRACE_LISTEN, TRACE_BEGIN, -1);
+                if (io->listen(timeout) == -1)
+                    LOG_ERROR("listen error: %s", strerror(errno));
+                trace::emit(TRACE_LISTEN, TRACE_END, -1,
+                            io->get_active_fd().size());
+
+                trace::emit(TRACE_TIMERS, TRACE_BEGIN, -1);
+                timeManager->process();
+                trace::emit(TRACE_TIMERS, TRACE_END, -1);
+
+                for (const auto &fd : io->get_active_fd()) {
+                    if (io->is_readable(fd) && channels[fd]->readcb) {
+                        trace::emit(TRACE_READ, TRACE_BEGIN, fd);
+                        channels[fd]->readcb();
+                        trace::emit(TRACE_READ, TRACE_END, fd);
+                    }
+                    if (io->is_writeable(fd) && channels[fd]->writecb) {
+                        trace::emit(TRACE_WRITE, TRACE_BEGIN, fd);
+                        channels[fd]->writecb();
+                        trace::emit(TRACE_WRITE, TRACE_END, fd);
+                    }
+                }
             }
 
             for (const auto &fd : needclean) erase(fd);
 
             std::vector<int>().swap(needclean);
 
+            if (turncb) turncb();
+
             if (once || terminated) return;
         }
     }
 
    private:
+    /* one turn as in loop, with each part timed into profile */
+    void profiled_turn(int timeout) {
+        loop_profile *p = profile;
+        uint64_t t0 = cycle_clock::now();
+        p->busySince.store(0, std::memory_order_relaxed);
+        trace::emit(TRACE_LISTEN, TRACE_BEGIN, -1);
+        if (io->listen(timeout) == -1)
+            LOG_ERROR("listen error: %s", strerror(errno));
+        uint64_t t1 = cycle_clock::now();
+        p->busySince.store(t1, std::memory_order_relaxed);
+        trace::emit(TRACE_LISTEN, TRACE_END, -1, io->get_active_fd().size());
+
+        trace::emit(TRACE_TIMERS, TRACE_BEGIN, -1);
+        timeManager->process();
+        trace::emit(TRACE_TIMERS, TRACE_END, -1);
+        uint64_t t2 = cycle_clock::now();
+        uint64_t timers = cycle_clock::to_ns(t2 - t1);
+        if (timers > p->stallNs) p->stalled(-1, "timers", nullptr, timers);
+
+        const auto &active = io->get_active_fd();
+        for (const auto &fd : active) {
+            if (io->is_readable(fd) && channels[fd]->readcb) {
+                trace::emit(TRACE_READ, TRACE_BEGIN, fd);
+                p->run(fd, "read", channels[fd]->readcb);
+                trace::emit(TRACE_READ, TRACE_END, fd);
+            }
+            if (io->is_writeable(fd) && channels[fd]->writecb) {
+                trace::emit(TRACE_WRITE, TRACE_BEGIN, fd);
+                p->run(fd, "write", channels[fd]->writecb);
+                trace::emit(TRACE_WRITE, TRACE_END, fd);
+            }
+        }
+        uint64_t t3 = cycle_clock::now();
+
+        loop_profile::add(p->turns, 1);
+        loop_profile::add(p->events, active.size());
+        if (active.size() > p->maxEvents.load(std::memory_order_relaxed))
+            p->maxEvents.store(active.size(), std::memory_order_relaxed);
+        loop_profile::add(p->waitNs, cycle_clock::to_ns(t1 - t0));
+        loop_profile::add(p->timerNs, timers);
+        loop_profile::add(p->dispatchNs, cycle_clock::to_ns(t3 - t2));
+    }
+
     void init_channel(int fd) {
         if (fd < 0) {
-            cerr << "error init fd < 0" << endl;
+            LOG_ERROR("error init fd %d < 0", fd);
             exit(-1);
         }
         if (!channels.count(fd)) {
@@ -73,7 +73,7 @@ class thread_loop {
             int clientfd = tcp::accept(fd, addr, port);
             if (clientfd <= 0) return;
 
-            std::cout << "client " << addr << ":" << port << std::endl;
+            LOG_DEBUG("client %s:%d", addr.c_str(), port);
             this->clientQueue.push(
                 std::make_unique<client_info>(clientfd, addr, port));
 
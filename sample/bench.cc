@@ -1,113 +1,351 @@
+#include <sys/eventfd.h>
 #include <sys/resource.h>
 
 #include <unistd.h>
 
-#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <core/epoll.hh>
+#include <core/histogram.hh>
 #include <core/poll.hh>
 #include <core/select.hh>
+#include <core/time.hh>
 #include <model/reactor.hh>
 
 using namespace std;
-using namespace chrono;
 
-using Clock = chrono::high_resolution_clock;
+/*
+ * the pass the parcel benchmark of libevent over each multiplexer. a ring
+ * has n pipes, a of them get a byte and every read passes its byte on to
+ * the next pipe, w times in all. the time of a run is from the first
+ * bytes to the last read, it grows with what one turn of the loop costs
+ * with n fds registered and a of them active.
+ *
+ * each combination of backend, threads, n and a is run r times, with one
+ * ring and one reactor per thread when there are more threads, and
+ * printed as a csv row of the run times in microseconds and the reads per
+ * second of all threads together.
+ *
+ * -W measures the wakeup instead: two threads block in their reactors and
+ * pass an eventfd write back and forth, a row per backend of the one way
+ * latency, half the round trip.
+ *
+ *     ./bench [-b backends] [-n pipes,...] [-a active,...] [-w writes]
+ *             [-t threads,...] [-r runs] [-W rounds]
+ */
 
-static int num_pipes, num_active, num_writes;
+template <class IoMultiplex>
+class ring {
+   private:
+    wxg::reactor<IoMultiplex> re;
+    vector<int> fds;  // read and write end of each pipe
+    int pipes, active, writes;
+    int reads = 0, fired = 0, left = 0;
 
-static int *pipes;
+   public:
+    ring(int pipes, int active, int writes)
+        : pipes(pipes), active(active), writes(writes) {}
+    ~ring() {
+        for (int fd : fds) close(fd);
+    }
+
+    /* false with a message when the pipes are more than fit */
+    bool init() {
+        fds.resize(pipes * 2, -1);
+        for (int i = 0; i < pipes; i++) {
+            if (pipe(&fds[i * 2]) == -1) {
+                cerr << "pipe: " << strerror(errno) << endl;
+                return false;
+            }
+            // the backend refuses the fds it cannot take, select those
+            // from FD_SETSIZE on
+            if (re.add_read(fds[i * 2]) == -1) {
+                cerr << "fd " << fds[i * 2] << " refused by the backend"
+                     << endl;
+                return false;
+            }
+            re.set_read_handler(fds[i * 2], [this, i]() { on_read(i); });
+        }
+        return true;
+    }
+
+    /* microseconds from the first bytes written to the last read */
+    double run_once() {
+        reads = fired = 0, left = writes;
+        int space = pipes / active * 2;
 
-static wxg::reactor<wxg::epoll> re;
+        re.loop(true, true);
+        uint64_t t0 = wxg::cycle_clock::monotonic_ns();
+        for (int i = 0; i < active; i++, fired++) send(i * space + 1);
+        do {
+            re.loop(true, true);
+        } while (reads != fired);
+        return (wxg::cycle_clock::monotonic_ns() - t0) / 1e3;
+    }
 
-static int countread = 0, fired = 0, writes = 0;
+    long events() const { return long(writes) + active; }
 
-void readcb(int i) {
-    u_char ch;
-    countread += read(pipes[2 * i], &ch, sizeof(ch));
-    if (writes) {
-        int nexti = i + 1;
-        if (nexti >= num_pipes) nexti -= num_pipes;
-        write(pipes[2 * nexti + 1], "a", 1);
-        writes--, fired++;
+   private:
+    void send(int fd) {
+        ssize_t n = ::write(fds[fd], "a", 1);
+        (void)n;
+    }
+
+    void on_read(int i) {
+        u_char ch;
+        reads += ::read(fds[i * 2], &ch, sizeof(ch));
+        if (left) {
+            int next = i + 1;
+            if (next >= pipes) next -= pipes;
+            send(next * 2 + 1);
+            left--, fired++;
+        }
     }
+};
+
+struct config {
+    int pipes;
+    int active;
+    int writes;
+    int threads;
+    int runs;
+};
+
+static double percentile(const vector<double> &sorted, double q) {
+    return sorted[min(sorted.size() - 1, size_t(q * sorted.size()))];
 }
 
-int run_once() {
-    cout << __func__ << endl;
-    countread = fired = 0, writes = num_writes;
+/* one csv row for c over IoMultiplex, false if it could not run */
+template <class IoMultiplex>
+static bool ring_bench(const char *backend, const config &c) {
+    vector<unique_ptr<ring<IoMultiplex>>> rings;
+    for (int i = 0; i < c.threads; i++) {
+        rings.push_back(
+            make_unique<ring<IoMultiplex>>(c.pipes, c.active, c.writes));
+        if (!rings.back()->init()) return false;
+    }
 
-    int space = num_pipes / num_active;
-    space *= 2;
+    vector<vector<double>> times(c.threads);
+    atomic<int> ready{0};
+    uint64_t t0 = 0;
+    vector<thread> threads;
+    for (int i = 0; i < c.threads; i++)
+        threads.emplace_back([&, i]() {
+            // the rings start together, the wall time covers all of them
+            if (++ready == c.threads) t0 = wxg::cycle_clock::monotonic_ns();
+            while (ready < c.threads) this_thread::yield();
+            for (int r = 0; r < c.runs; r++)
+                times[i].push_back(rings[i]->run_once());
+        });
+    for (auto &t : threads) t.join();
+    double wall = (wxg::cycle_clock::monotonic_ns() - t0) / 1e9;
 
-    re.loop(true, true);
+    vector<double> all;
+    for (auto &t : times) all.insert(all.end(), t.begin(), t.end());
+    sort(all.begin(), all.end());
+    double events = double(rings[0]->events()) * c.runs * c.threads;
+
+    printf("%s,%d,%d,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.0f\n", backend, c.threads,
+           c.pipes, c.active, c.writes, c.runs, all.front(),
+           percentile(all, 0.5), percentile(all, 0.9), all.back(),
+           events / wall);
+    fflush(stdout);
+    return true;
+}
 
-    for (int i = 0; i < num_active; i++, fired++) {
-        write(pipes[i * space + 1], "a", 1);
+/* a reactor of IoMultiplex blocked on an eventfd, in its own thread */
+template <class IoMultiplex>
+struct waker {
+    wxg::reactor<IoMultiplex> re;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    ~waker() { close(fd); }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t n = ::write(fd, &one, sizeof(one));
+        (void)n;
     }
+    void drain() {
+        uint64_t value;
+        ssize_t n = ::read(fd, &value, sizeof(value));
+        (void)n;
+    }
+};
 
-    auto t1 = Clock::now();
+/* one csv row of the cross thread wakeup latency of IoMultiplex */
+template <class IoMultiplex>
+static void wakeup_bench(const char *backend, int rounds) {
+    waker<IoMultiplex> ping, pong;
+    auto latency = make_unique<wxg::latency_histogram>();
+    atomic<bool> done{false};
+    uint64_t sentAt = 0;
+    int left = rounds;
 
-    int xcount = 0;
-    do {
-        re.loop(true, true);
-        xcount++;
-    } while (countread != fired);
+    pong.re.set_read_handler(pong.fd, [&]() {
+        pong.drain();
+        if (done)
+            pong.re.set_terminated();
+        else
+            ping.wake();
+    });
+    ping.re.set_read_handler(ping.fd, [&]() {
+        ping.drain();
+        uint64_t now = wxg::cycle_clock::monotonic_ns();
+        latency->record((now - sentAt) / 2);
+        if (--left == 0) {
+            done = true;
+            ping.re.set_terminated();
+        }
+        sentAt = wxg::cycle_clock::monotonic_ns();
+        pong.wake();
+    });
 
-    auto t2 = Clock::now();
-    auto time_span = duration_cast<duration<double>>(t2 - t1);
+    thread other([&]() { pong.re.loop(); });
+    sentAt = wxg::cycle_clock::monotonic_ns();
+    pong.wake();
+    ping.re.loop();
+    other.join();
 
-    if (xcount != countread)
-        cerr << "Xcount: " << xcount << ", Rcount: " << countread << endl;
+    printf("%s,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n", backend, rounds,
+           latency->quantile(0.5) / 1e3, latency->quantile(0.9) / 1e3,
+           latency->quantile(0.99) / 1e3, latency->quantile(0.999) / 1e3,
+           latency->max() / 1e3);
+    fflush(stdout);
+}
+
+/* comma separated positive numbers */
+static bool parse_list(const char *arg, vector<int> &out) {
+    out.clear();
+    char *end;
+    do {
+        long v = strtol(arg, &end, 10);
+        if (end == arg || v <= 0) return false;
+        out.push_back(int(v));
+        arg = end + 1;
+    } while (*end == ',');
+    return *end == 0;
+}
 
-    return 1000 * 1000 * time_span.count();
+static void usage(const char *name) {
+    cerr << "usage: " << name
+         << " [-b backends] [-n pipes,...] [-a active,...] [-w writes]"
+            " [-t threads,...] [-r runs] [-W rounds]\n"
+            "  -b  of select,poll,epoll, all by default\n"
+            "  -n  pipes in a ring, default 100,1000,10000,100000\n"
+            "  -a  pipes written first, default 1\n"
+            "  -w  reads passed on in a run, default 1000\n"
+            "  -t  rings each in a thread of its own, default 1\n"
+            "  -r  runs of each, default 10\n"
+            "  -W  wakeup latency over rounds instead of the rings"
+         << endl;
 }
 
 int main(int argc, char *const argv[]) {
-    num_pipes = 100;
-    num_active = 1;
-    num_writes = num_pipes / 2;
+    string backends = "select,poll,epoll";
+    vector<int> pipes = {100, 1000, 10000, 100000}, active = {1},
+                threads = {1};
+    int writes = 1000, runs = 10, rounds = 0;
 
     int c;
-    extern char *optarg;
-    while ((c = getopt(argc, argv, "n:a:w:")) != -1) {
+    while ((c = getopt(argc, argv, "b:n:a:w:t:r:W:h")) != -1) {
+        bool ok = true;
         switch (c) {
+            case 'b':
+                backends = optarg;
+                break;
             case 'n':
-                num_pipes = atoi(optarg);
+                ok = parse_list(optarg, pipes);
                 break;
             case 'a':
-                num_active = atoi(optarg);
+                ok = parse_list(optarg, active);
+                break;
+            case 't':
+                ok = parse_list(optarg, threads);
                 break;
             case 'w':
-                num_writes = atoi(optarg);
+                ok = (writes = atoi(optarg)) >= 0;
+                break;
+            case 'r':
+                ok = (runs = atoi(optarg)) > 0;
+                break;
+            case 'W':
+                ok = (rounds = atoi(optarg)) > 0;
                 break;
-
             default:
-                cerr << "illegal argument" << endl;
+                ok = false;
                 break;
         }
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
     }
 
-    struct rlimit rl;
-    rl.rlim_cur = rl.rlim_max = num_pipes * 2 + 50;
-    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
-        cerr << "setrlimit\n";
-        exit(1);
+    vector<string> names;
+    for (size_t at = 0; at <= backends.size();) {
+        size_t comma = min(backends.find(',', at), backends.size());
+        names.push_back(backends.substr(at, comma - at));
+        at = comma + 1;
     }
+    for (const string &name : names)
+        if (name != "select" && name != "poll" && name != "epoll") {
+            cerr << "unknown backend " << name << endl;
+            return 2;
+        }
 
-    pipes = new int[num_pipes * 2];
-
-    for (int *cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
-        if (pipe(cp) == -1) {
-            cerr << "error pipe errno=" << errno << endl;
-            exit(-1);
+    if (rounds) {
+        printf("backend,rounds,p50_us,p90_us,p99_us,p99.9_us,max_us\n");
+        for (const string &name : names) {
+            if (name == "select")
+                wakeup_bench<wxg::select>("select", rounds);
+            else if (name == "poll")
+                wakeup_bench<wxg::poll>("poll", rounds);
+            else
+                wakeup_bench<wxg::epoll>("epoll", rounds);
         }
-        re.set_read_handler(pipes[2 * i], [=]() { readcb(i); });
+        return 0;
     }
 
-    for (int i = 0; i < 25; i++) cout << run_once() << endl;
+    int most = *max_element(pipes.begin(), pipes.end()) *
+               *max_element(threads.begin(), threads.end());
+    // as many as the hard limit allows, rings past it are skipped
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rlim_t hard = rl.rlim_max;
+    rl.rlim_cur = rl.rlim_max = max(rlim_t(most) * 2 + 50, rl.rlim_cur);
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        rl.rlim_cur = rl.rlim_max = hard;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
-    delete[] pipes;
+    printf("backend,threads,pipes,active,writes,runs,min_us,median_us,"
+           "p90_us,max_us,reads_per_s\n");
+    for (const string &name : names)
+        for (int t : threads)
+            for (int n : pipes)
+                for (int a : active) {
+                    if (a > n) continue;
+                    config cfg = {n, a, writes, t, runs};
+                    bool ran;
+                    if (name == "select")
+                        ran = ring_bench<wxg::select>("select", cfg);
+                    else if (name == "poll")
+                        ran = ring_bench<wxg::poll>("poll", cfg);
+                    else
+                        ran = ring_bench<wxg::epoll>("epoll", cfg);
+                    if (!ran)
+                        cerr << name << " skipped " << t << " threads of "
+                             << n << " pipes" << endl;
+                }
     return 0;
 }
@@ -0,0 +1,769 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <core/buffer.hh>
+#include <core/epoll.hh>
+#include <core/histogram.hh>
+#include <core/time.hh>
+#include <http/request.hh>
+#include <model/reactor.hh>
+
+using namespace std;
+
+/*
+ * http load generator: threads each run a reactor over their share of
+ * the connections, every connection sends a request, parses the whole
+ * response and sends the next one, over the same connection with
+ * keep-alive or a new one with -C. latency is from the request to the
+ * last byte of its response.
+ *
+ * by default the load is a closed loop, a connection sends when it got
+ * its last response, so a stalled server is sent less and its stall
+ * hardly shows. with -R the load is an open loop as in wrk2: each
+ * connection sends on a fixed schedule at its share of the rate, and
+ * latency is from the time a request was due, so requests waiting
+ * behind a slow one count the wait. a list of rates runs one after the
+ * other to find where latency turns up.
+ *
+ * -p pipelines, each connection keeps that many requests in flight. -s
+ * sends a weighted mix from a scenario file instead of GET of the url,
+ * one request a line, lines starting with # are comments:
+ *
+ *     # weight method path [body bytes [chunked]]
+ *     80 GET /
+ *     15 POST /upload 4096
+ *     4 POST /upload 65536 chunked
+ *     1 @login.http
+ *
+ * @file is a whole request read from the file and sent byte for byte.
+ * the mix is drawn from a seeded generator, runs with the same options
+ * send the same requests.
+ *
+ *     ./loadgen [-t threads] [-c connections] [-d seconds] [-C]
+ *               [-R rate[,rate...]] [-p depth] [-s scenario] url
+ */
+
+struct options {
+    int threads = 2;
+    int connections = 64;
+    int seconds = 10;
+    bool keepAlive = true;
+    vector<double> rates;  // requests per second, empty for a closed loop
+    int depth = 1;         // requests in flight per connection
+    string scenarioFile;
+
+    string host = "127.0.0.1";
+    unsigned short port = 80;
+    string path = "/";
+    sockaddr_in addr;
+};
+
+/* a weighted request of the mix, built once and sent as is */
+struct scenario_entry {
+    int weight;
+    string name;
+    string request;
+};
+
+struct scenario {
+    vector<scenario_entry> entries;
+    int total = 0;
+
+    void add(int weight, const string &name, const string &request) {
+        entries.push_back({weight, name, request});
+        total += weight;
+    }
+
+    template <typename Random>
+    int pick(Random &rng) const {
+        if (entries.size() == 1) return 0;
+        int w = uniform_int_distribution<int>(0, total - 1)(rng);
+        int i = 0;
+        while (w >= entries[i].weight) w -= entries[i++].weight;
+        return i;
+    }
+};
+
+struct entry_stats {
+    uint64_t responses = 0;
+    uint64_t non2xx = 0;
+    uint64_t failed = 0;
+    wxg::latency_histogram latency;
+};
+
+/* what one thread saw, merged into the report after the run */
+struct load_stats {
+    uint64_t responses = 0;
+    uint64_t non2xx = 0;
+    uint64_t bytes = 0;
+    uint64_t connects = 0;
+    uint64_t connectErrors = 0;
+    uint64_t readErrors = 0;  // reset or closed in the middle of a response
+    uint64_t parseErrors = 0;
+    uint64_t failed = 0;  // requests whose connection closed before answering
+    wxg::latency_histogram latency;  // from when requests were due
+    wxg::latency_histogram service;  // from when they were sent
+    vector<unique_ptr<entry_stats>> entries;  // by scenario entry
+
+    void resize(size_t n) {
+        while (entries.size() < n)
+            entries.push_back(make_unique<entry_stats>());
+    }
+
+    void merge(const load_stats &s) {
+        responses += s.responses;
+        non2xx += s.non2xx;
+        bytes += s.bytes;
+        connects += s.connects;
+        connectErrors += s.connectErrors;
+        readErrors += s.readErrors;
+        parseErrors += s.parseErrors;
+        failed += s.failed;
+        latency.merge(s.latency);
+        service.merge(s.service);
+
+        resize(s.entries.size());
+        for (size_t i = 0; i < s.entries.size(); i++) {
+            entries[i]->responses += s.entries[i]->responses;
+            entries[i]->non2xx += s.entries[i]->non2xx;
+            entries[i]->failed += s.entries[i]->failed;
+            entries[i]->latency.merge(s.entries[i]->latency);
+        }
+    }
+};
+
+class load_thread {
+   private:
+    /* a request queued on a connection, answered in the order sent */
+    struct in_flight {
+        int entry;
+        uint64_t dueAt;
+        uint64_t sentAt;
+    };
+
+    struct client {
+        int fd = -1;
+        bool connected = false;
+        string out;   // requests queued, written up to sent
+        size_t sent = 0;
+        deque<in_flight> inflight;
+        deque<uint64_t> due;  // due times of requests not queued yet
+        uint64_t nextAt = 0;  // due time of the next request
+        wxg::buffer in;
+        wxg::request response;
+    };
+
+    struct later {
+        bool operator()(const client *a, const client *b) const {
+            return a->nextAt > b->nextAt;
+        }
+    };
+
+    const options &opts;
+    const scenario &scene;
+    uint64_t interval;  // ns between the requests of a connection, 0 closed
+    wxg::reactor<wxg::epoll> re;
+    vector<unique_ptr<client>> clients;
+    vector<client *> reopen;  // closed this turn, reconnected after it
+    bool stopping = false;
+    mt19937 rng;  // seeded by the first connection, the mix repeats
+
+    /* connections waiting for their next request to be due */
+    priority_queue<client *, vector<client *>, later> waiting;
+    int timerfd = -1;
+    uint64_t armedAt = 0;
+
+   public:
+    load_stats stats;
+
+    /*
+     * connections from first on of the total, at rate over all of them.
+     * the schedules of the connections are spread over one interval
+     */
+    load_thread(const options &o, const scenario &s, int first,
+                int connections, double rate)
+        : opts(o), scene(s), rng(first) {
+        interval = rate > 0 ? uint64_t(1e9 * o.connections / rate) : 0;
+        stats.resize(s.entries.size());
+        uint64_t now = wxg::cycle_clock::monotonic_ns();
+        for (int i = 0; i < connections; i++) {
+            clients.push_back(make_unique<client>());
+            clients.back()->nextAt =
+                now + interval * (first + i) / o.connections;
+        }
+    }
+
+    void run() {
+        if (interval) {
+            timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC);
+            re.set_read_handler(timerfd, [this]() { on_timer(); });
+            for (auto &c : clients) waiting.push(c.get());
+        }
+        for (auto &c : clients) open(c.get());
+        arm();
+
+        // fds closed in a turn are forgotten by the reactor at its end,
+        // only then may their numbers come back with new sockets
+        re.set_turn_handler([this]() {
+            vector<client *> now;
+            now.swap(reopen);
+            if (!stopping)
+                for (client *c : now) open(c);
+            arm();
+        });
+        re.set_timer(opts.seconds, [this]() {
+            stopping = true;
+            re.set_terminated();
+        });
+        re.loop();
+
+        for (auto &c : clients)
+            if (c->fd >= 0) ::close(c->fd);
+        if (timerfd >= 0) ::close(timerfd);
+    }
+
+   private:
+    /*
+     * queue requests up to the pipeline depth, the due ones with an open
+     * loop, as many as fit with a closed one
+     */
+    void fill(client *c) {
+        if (!c->connected) return;
+        bool queued = false;
+        while (int(c->inflight.size()) < opts.depth) {
+            uint64_t now = wxg::cycle_clock::monotonic_ns(), dueAt = now;
+            if (interval) {
+                if (c->due.empty()) break;
+                dueAt = c->due.front();
+                c->due.pop_front();
+            }
+            int e = scene.pick(rng);
+            c->out.append(scene.entries[e].request);
+            c->inflight.push_back({e, dueAt, now});
+            queued = true;
+        }
+        if (queued) re.add_write(c->fd);
+    }
+
+    void on_timer() {
+        uint64_t expirations;
+        ssize_t n = ::read(timerfd, &expirations, sizeof(expirations));
+        (void)n;
+        armedAt = 0;
+
+        uint64_t now = wxg::cycle_clock::monotonic_ns();
+        while (!waiting.empty() && waiting.top()->nextAt <= now) {
+            client *c = waiting.top();
+            waiting.pop();
+            c->due.push_back(c->nextAt);
+            c->nextAt += interval;
+            waiting.push(c);
+            fill(c);
+        }
+    }
+
+    /* the timer for the first waiting connection, once per turn */
+    void arm() {
+        if (!interval || waiting.empty()) return;
+        uint64_t at = waiting.top()->nextAt;
+        if (armedAt && armedAt <= at) return;
+
+        struct itimerspec its = {};
+        its.it_value.tv_sec = at / 1000000000;
+        its.it_value.tv_nsec = at % 1000000000;
+        timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, nullptr);
+        armedAt = at;
+    }
+
+    void open(client *c) {
+        c->connected = false;
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c->fd < 0) {
+            stats.connectErrors++;
+            return;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (::connect(c->fd, (const sockaddr *)&opts.addr,
+                      sizeof(opts.addr)) == -1 &&
+            errno != EINPROGRESS) {
+            stats.connectErrors++;
+            ::close(c->fd);
+            c->fd = -1;
+            reopen.push_back(c);
+            return;
+        }
+        c->in.clear();
+        start(c);
+        re.set_read_handler(c->fd, [this, c]() { on_read(c); });
+        re.set_write_handler(c->fd, [this, c]() { on_write(c); });
+    }
+
+    void start(client *c) {
+        c->response.reset();
+        c->response.kind = wxg::RESPONSE;
+        // the body is counted, not kept
+        c->response.set_body_sink([](const char *, size_t) {});
+    }
+
+    /*
+     * requests queued on the connection fail with it, not sent again. their
+     * latency up to now is recorded all the same, left out they would hide
+     * the stall that came before
+     */
+    void close(client *c) {
+        uint64_t now = wxg::cycle_clock::monotonic_ns();
+        for (const in_flight &f : c->inflight) {
+            stats.latency.record(now - f.dueAt);
+            stats.failed++;
+            entry_stats &e = *stats.entries[f.entry];
+            e.latency.record(now - f.dueAt);
+            e.failed++;
+        }
+
+        re.remove_read_handler(c->fd);
+        re.remove_write_handler(c->fd);
+        ::close(c->fd);
+        c->fd = -1;
+        c->connected = false;
+        c->out.clear();
+        c->sent = 0;
+        c->inflight.clear();
+        reopen.push_back(c);
+    }
+
+    void on_write(client *c) {
+        if (!c->connected) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error) {
+                stats.connectErrors++;
+                close(c);
+                return;
+            }
+            c->connected = true;
+            stats.connects++;
+            fill(c);
+        }
+
+        while (c->sent < c->out.size()) {
+            ssize_t n = ::send(c->fd, c->out.data() + c->sent,
+                               c->out.size() - c->sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                c->sent += n;
+            } else if (n == -1 && errno == EAGAIN) {
+                return;
+            } else {
+                stats.readErrors++;
+                close(c);
+                return;
+            }
+        }
+        c->out.clear();
+        c->sent = 0;
+        re.remove_write(c->fd);
+    }
+
+    void on_read(client *c) {
+        int n = c->in.read(c->fd);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n > 0) {
+            stats.bytes += n;
+            parse(c);
+            return;
+        }
+
+        // closed, the end of a body without a length
+        if (n == 0 && !c->inflight.empty() && c->response.body_until_close())
+            completed(c);
+        if (n < 0 || !c->inflight.empty() || !c->in.empty())
+            stats.readErrors++;
+        close(c);
+    }
+
+    /* the responses read, pipelined ones one after the other */
+    void parse(client *c) {
+        while (true) {
+            if (c->inflight.empty()) {  // nothing was asked
+                stats.parseErrors++;
+                close(c);
+                return;
+            }
+
+            switch (c->response.parse(&c->in)) {
+                case wxg::ALLREAD:
+                    completed(c);
+                    if (!opts.keepAlive ||
+                        c->response.get_header("Connection") == "close") {
+                        if (!c->inflight.empty()) stats.readErrors++;
+                        close(c);
+                        return;
+                    }
+                    start(c);
+                    fill(c);
+                    if (c->in.empty()) return;
+                    break;
+                case wxg::NEEDMORE:
+                case wxg::HEADERSREAD:
+                    return;
+                default:
+                    stats.parseErrors++;
+                    close(c);
+                    return;
+            }
+        }
+    }
+
+    void completed(client *c) {
+        in_flight f = c->inflight.front();
+        c->inflight.pop_front();
+
+        uint64_t now = wxg::cycle_clock::monotonic_ns();
+        bool ok = c->response.response_code >= 200 &&
+                  c->response.response_code < 300;
+        stats.latency.record(now - f.dueAt);
+        stats.service.record(now - f.sentAt);
+        stats.responses++;
+        stats.non2xx += !ok;
+
+        entry_stats &e = *stats.entries[f.entry];
+        e.latency.record(now - f.dueAt);
+        e.responses++;
+        e.non2xx += !ok;
+    }
+};
+
+static void usage(const char *name) {
+    cerr << "usage: " << name
+         << " [-t threads] [-c connections] [-d seconds] [-C]"
+            " [-R rate[,rate...]] [-p depth] [-s scenario] url\n"
+            "  -t  threads, default 2\n"
+            "  -c  connections over all threads, default 64\n"
+            "  -d  duration in seconds, of each rate, default 10\n"
+            "  -C  close the connection after each response, keep-alive "
+            "by default\n"
+            "  -R  requests per second over all connections, sent on a "
+            "fixed schedule\n"
+            "      with latency from when they were due. each of a list "
+            "runs in turn\n"
+            "  -p  requests pipelined on each connection, default 1\n"
+            "  -s  scenario file of weighted requests, GET of the url by "
+            "default"
+         << endl;
+}
+
+/* http://host[:port][/path] */
+static bool parse_url(const string &url, options &o) {
+    const string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0) return false;
+    string rest = url.substr(scheme.size());
+
+    size_t slash = rest.find('/');
+    if (slash != string::npos) {
+        o.path = rest.substr(slash);
+        rest = rest.substr(0, slash);
+    }
+    size_t colon = rest.find(':');
+    if (colon != string::npos) {
+        o.port = atoi(rest.c_str() + colon + 1);
+        rest = rest.substr(0, colon);
+    }
+    o.host = rest;
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(o.host.c_str(), nullptr, &hints, &res) != 0) return false;
+    o.addr = *(sockaddr_in *)res->ai_addr;
+    o.addr.sin_port = htons(o.port);
+    freeaddrinfo(res);
+    return true;
+}
+
+/* a request built from the options, a body of bytes for POST */
+static string build_request(const options &o, wxg::request_type_t type,
+                            const string &path, size_t bytes, bool chunked) {
+    wxg::buffer body;
+    if (!chunked) body.push(string(bytes, 'x'));
+
+    wxg::request req;
+    req.set_request(type, path, &body);
+    req.set_header("Host", o.host);
+    req.set_header("Connection", o.keepAlive ? "keep-alive" : "close");
+    if (type == wxg::POST)
+        req.set_header("Content-Type", "application/octet-stream");
+    if (chunked) {
+        req.set_header("Content-Length", "");  // empty ones are not sent
+        req.set_header("Transfer-Encoding", "chunked");
+    }
+    wxg::buffer buf;
+    req.send_to(&buf);
+    string request((char *)buf.get(), buf.length());
+
+    for (size_t left = chunked ? bytes : 0; left > 0;) {
+        size_t n = min(left, size_t(4096));
+        char size[16];
+        snprintf(size, sizeof(size), "%zx\r\n", n);
+        request.append(size).append(n, 'x').append("\r\n");
+        left -= n;
+    }
+    if (chunked) request.append("0\r\n\r\n");
+    return request;
+}
+
+static bool read_file(const string &path, string &out) {
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    stringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+/* the lines of a scenario file, false with a message on the first bad one */
+static bool load_scenario(const options &o, scenario &scene) {
+    ifstream in(o.scenarioFile);
+    if (!in) {
+        cerr << o.scenarioFile << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    string line;
+    for (int no = 1; getline(in, line); no++) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') continue;
+        if (line.back() == '\r') line.pop_back();
+
+        istringstream fields(line);
+        string method, path, flag;
+        int weight = 0;
+        long bytes = 0;
+        bool ok = fields >> weight && weight > 0 && fields >> method;
+        if (ok && method[0] == '@') {
+            string request;
+            ok = read_file(method.substr(1), request) && !request.empty();
+            if (ok) scene.add(weight, method, request);
+        } else if (ok) {
+            fields >> path >> bytes >> flag;
+            bool post = method == "POST", chunked = flag == "chunked";
+            ok = (post || method == "GET") && !path.empty() &&
+                 path[0] == '/' && bytes >= 0 && (post || bytes == 0) &&
+                 (flag.empty() || chunked);
+            string name = method + " " + path;
+            if (bytes) name += " " + to_string(bytes);
+            if (chunked) name += " chunked";
+            if (ok)
+                scene.add(weight, name,
+                          build_request(o, post ? wxg::POST : wxg::GET, path,
+                                        bytes, chunked));
+        }
+        if (!ok) {
+            cerr << o.scenarioFile << ":" << no << ": bad request " << line
+                 << endl;
+            return false;
+        }
+    }
+    if (scene.entries.empty()) {
+        cerr << o.scenarioFile << ": no requests" << endl;
+        return false;
+    }
+    return true;
+}
+
+/* comma separated positive numbers */
+static bool parse_rates(const char *arg, vector<double> &rates) {
+    char *end;
+    do {
+        double r = strtod(arg, &end);
+        if (end == arg || r <= 0) return false;
+        rates.push_back(r);
+        arg = end + 1;
+    } while (*end == ',');
+    return *end == 0;
+}
+
+static double ms(uint64_t ns) { return ns / 1e6; }
+
+static void print_latency(const char *name, const wxg::latency_histogram &h) {
+    printf("%s mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, "
+           "max %.3f\n",
+           name, h.count() ? ms(h.sum() / h.count()) : 0.0,
+           ms(h.quantile(0.5)), ms(h.quantile(0.9)), ms(h.quantile(0.99)),
+           ms(h.quantile(0.999)), ms(h.max()));
+}
+
+/* one run at rate, 0 for a closed loop, reported as it ends */
+static unique_ptr<load_stats> run(const options &o, const scenario &scene,
+                                  double rate, double &secs) {
+    vector<unique_ptr<load_thread>> loads;
+    for (int i = 0, first = 0; i < o.threads; i++) {
+        int n = o.connections / o.threads + (i < o.connections % o.threads);
+        loads.push_back(make_unique<load_thread>(o, scene, first, n, rate));
+        first += n;
+    }
+
+    uint64_t t0 = wxg::cycle_clock::monotonic_ns();
+    vector<thread> threads;
+    for (auto &l : loads) threads.emplace_back([&l]() { l->run(); });
+    for (auto &t : threads) t.join();
+    secs = (wxg::cycle_clock::monotonic_ns() - t0) / 1e9;
+
+    unique_ptr<load_stats> total = make_unique<load_stats>();
+    for (auto &l : loads) total->merge(l->stats);
+
+    if (rate > 0)
+        printf("rate         %.1f/s, target %.1f/s\n", total->responses / secs,
+               rate);
+    printf("responses    %llu, %.1f/s\n", (unsigned long long)total->responses,
+           total->responses / secs);
+    printf("transfer     %.2f MB, %.2f MB/s\n", total->bytes / 1e6,
+           total->bytes / 1e6 / secs);
+    printf("connections  %llu opened\n", (unsigned long long)total->connects);
+    printf("errors       %llu connect, %llu read, %llu parse, %llu non-2xx, "
+           "%llu failed\n",
+           (unsigned long long)total->connectErrors,
+           (unsigned long long)total->readErrors,
+           (unsigned long long)total->parseErrors,
+           (unsigned long long)total->non2xx,
+           (unsigned long long)total->failed);
+    print_latency("latency ms  ", total->latency);
+    // from the send, the gap to the above is the queueing a closed loop hides
+    if (rate > 0) print_latency("service ms  ", total->service);
+
+    if (scene.entries.size() > 1) {
+        printf("%-32s %7s %10s %8s %8s %10s %10s\n", "request", "weight",
+               "responses", "non-2xx", "failed", "p50 ms", "p99 ms");
+        for (size_t i = 0; i < scene.entries.size(); i++) {
+            const entry_stats &e = *total->entries[i];
+            printf("%-32s %6.1f%% %10llu %8llu %8llu %10.3f %10.3f\n",
+                   scene.entries[i].name.c_str(),
+                   100.0 * scene.entries[i].weight / scene.total,
+                   (unsigned long long)e.responses,
+                   (unsigned long long)e.non2xx, (unsigned long long)e.failed,
+                   ms(e.latency.quantile(0.5)), ms(e.latency.quantile(0.99)));
+        }
+    }
+    fflush(stdout);
+    return total;
+}
+
+int main(int argc, char *const argv[]) {
+    options o;
+    int c;
+    while ((c = getopt(argc, argv, "t:c:d:CR:p:s:h")) != -1) {
+        switch (c) {
+            case 't':
+                o.threads = atoi(optarg);
+                break;
+            case 'c':
+                o.connections = atoi(optarg);
+                break;
+            case 'd':
+                o.seconds = atoi(optarg);
+                break;
+            case 'C':
+                o.keepAlive = false;
+                break;
+            case 'R':
+                if (!parse_rates(optarg, o.rates)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'p':
+                o.depth = atoi(optarg);
+                break;
+            case 's':
+                o.scenarioFile = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc || o.threads < 1 || o.connections < o.threads ||
+        o.seconds < 1 || o.depth < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!parse_url(argv[optind], o)) {
+        cerr << argv[optind] << " is not a valid url" << endl;
+        return 2;
+    }
+    if (!o.keepAlive && o.depth > 1) {
+        cerr << "-C sends one request a connection, -p needs keep-alive"
+             << endl;
+        return 2;
+    }
+
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = o.connections + 1024;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+        cerr << "setrlimit: " << strerror(errno) << endl;
+
+    scenario scene;
+    if (o.scenarioFile.empty())
+        scene.add(1, "GET " + o.path, build_request(o, wxg::GET, o.path, 0,
+                                                   false));
+    else if (!load_scenario(o, scene))
+        return 2;
+
+    printf("%d threads, %d connections, %ds, %s, pipeline %d, %s%s%s\n",
+           o.threads, o.connections, o.seconds,
+           o.keepAlive ? "keep-alive" : "close", o.depth, argv[optind],
+           o.scenarioFile.empty() ? "" : ", ", o.scenarioFile.c_str());
+
+    double secs;
+    if (o.rates.empty()) {
+        run(o, scene, 0, secs);
+        return 0;
+    }
+
+    // past the knee the achieved rate stays behind and the tail runs away
+    vector<unique_ptr<load_stats>> results;
+    vector<double> achieved;
+    for (double rate : o.rates) {
+        printf("\n-- %.1f requests/s\n", rate);
+        results.push_back(run(o, scene, rate, secs));
+        achieved.push_back(results.back()->responses / secs);
+    }
+    if (o.rates.size() == 1) return 0;
+
+    printf("\n%12s %12s %10s %10s %10s %10s %8s\n", "target/s", "achieved/s",
+           "p50 ms", "p99 ms", "p99.9 ms", "max ms", "errors");
+    for (size_t i = 0; i < results.size(); i++) {
+        const load_stats &t = *results[i];
+        const wxg::latency_histogram &h = t.latency;
+        printf("%12.1f %12.1f %10.3f %10.3f %10.3f %10.3f %8llu\n",
+               o.rates[i], achieved[i], ms(h.quantile(0.5)),
+               ms(h.quantile(0.99)), ms(h.quantile(0.999)), ms(h.max()),
+               (unsigned long long)(t.connectErrors + t.readErrors +
+                                    t.parseErrors + t.non2xx + t.failed));
+    }
+    return 0;
+}
@@ -0,0 +1,290 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <core/buffer.hh>
+#include <core/epoll.hh>
+#include <core/lock.hh>
+#include <core/thread.hh>
+#include <core/time.hh>
+#include <http/request.hh>
+#include <model/reactor.hh>
+
+using namespace std;
+
+/*
+ * microbenchmarks of the core primitives, each reported as ns, heap
+ * allocations and cycle_clock ticks per operation, the best of a few
+ * runs. ticks are tsc cycles where the counter is invariant, ns elsewhere.
+ * reallocs count as allocations, buffers grow with them
+ *
+ *     ./microbench [-s scale] [name filter]
+ */
+
+static atomic<uint64_t> allocations{0};
+
+/*
+ * count the allocations of operator new and the buffers alike, glibc
+ * lets the program define malloc and still reach its own
+ */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+void *realloc(void *p, size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+}
+
+static double scale = 1.0;
+static const char *filter = nullptr;
+
+static long scaled(long ops) {
+    long n = long(ops * scale);
+    return n > 0 ? n : 1;
+}
+
+/* run f(ops), which does ops operations, and print the best of runs */
+template <typename F>
+static void bench(const string &name, long ops, F &&f, int runs = 3) {
+    if (filter && name.find(filter) == string::npos) return;
+
+    double bestNs = 1e30, bestTicks = 0, allocs = 0;
+    for (int i = 0; i < runs; i++) {
+        uint64_t a0 = allocations.load(memory_order_relaxed);
+        uint64_t t0 = wxg::cycle_clock::monotonic_ns();
+        uint64_t c0 = wxg::cycle_clock::now();
+        f(ops);
+        uint64_t c1 = wxg::cycle_clock::now();
+        uint64_t t1 = wxg::cycle_clock::monotonic_ns();
+        uint64_t a1 = allocations.load(memory_order_relaxed);
+
+        double ns = double(t1 - t0) / ops;
+        if (ns < bestNs) {
+            bestNs = ns;
+            bestTicks = double(c1 - c0) / ops;
+            allocs = double(a1 - a0) / ops;
+        }
+    }
+    printf("%-36s %12.1f %10.2f %12.1f\n", name.c_str(), bestNs, allocs,
+           bestTicks);
+    fflush(stdout);
+}
+
+static volatile size_t sink;  // keeps results alive
+
+static void buffer_bench() {
+    string chunk(64, 'x');
+    bench("buffer push/pop 64B", scaled(2000000), [&](long ops) {
+        wxg::buffer buf;
+        char out[64];
+        for (long i = 0; i < ops; i++) {
+            buf.push((void *)chunk.data(), chunk.size());
+            sink = buf.pop(out, sizeof(out));
+        }
+    });
+
+    string page(16 * 1024, 'a');
+    page.replace(page.size() - 4, 4, "\r\n\r\n");
+    bench("buffer find 16KB", scaled(20000), [&](long ops) {
+        wxg::buffer buf;
+        buf.push(page);
+        for (long i = 0; i < ops; i++) sink = (size_t)buf.find("\r\n\r\n", 4);
+    });
+
+    // grows from empty to 1MB in 4KB pushes, the expand path
+    string block(4096, 'b');
+    bench("buffer expand to 1MB", scaled(500), [&](long ops) {
+        for (long i = 0; i < ops; i++) {
+            wxg::buffer buf;
+            for (int j = 0; j < 256; j++) buf.push(block);
+            sink = buf.length();
+        }
+    });
+}
+
+static const string plain =
+    "GET /index.html?lang=en HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+    "Firefox/120.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;"
+    "q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Cookie: session=8f2b9c1d4e5a6b7c; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const string chunked =
+    "POST /upload HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "\r\n"
+    "100\r\n" +
+    string(256, 'c') + "\r\n" + "100\r\n" + string(256, 'c') + "\r\n" +
+    "0\r\n\r\n";
+
+/* parse the requests in corpus, requests each, ops times */
+static void parse_bench(const string &name, const string &corpus,
+                        int requests) {
+    bench(name, scaled(200000 / requests) * requests, [&](long ops) {
+        wxg::buffer buf;
+        wxg::request r;
+        for (long i = 0; i < ops; i += requests) {
+            buf.push(corpus);
+            for (int j = 0; j < requests; j++) {
+                r.reset();
+                r.kind = wxg::REQUEST;
+                if (r.parse(&buf) != wxg::ALLREAD) {
+                    cerr << name << ": parse failed" << endl;
+                    exit(-1);
+                }
+            }
+        }
+    });
+}
+
+static void request_bench() {
+    parse_bench("request parse plain", plain, 1);
+    string pipelined;
+    for (int i = 0; i < 16; i++) pipelined += plain;
+    parse_bench("request parse pipelined x16", pipelined, 16);
+    parse_bench("request parse chunked 512B", chunked, 1);
+}
+
+/* timers one to two minutes out, spread over the microseconds */
+static int spread(wxg::time &tm, long i) {
+    return tm.set_timer(int(60 + i % 60), int(i % 1000000), false, [] {});
+}
+
+static void time_bench() {
+    for (long n = 1000; n <= 1000000; n *= 10) {
+        long timers = scaled(n);
+        string size = to_string(timers);
+        vector<int> ids(timers);
+
+        bench("time insert " + size, timers, [&](long ops) {
+            wxg::time tm;
+            for (long i = 0; i < ops; i++) ids[i] = spread(tm, i);
+        }, 1);
+
+        wxg::time tm;
+        for (long i = 0; i < timers; i++) ids[i] = spread(tm, i);
+        bench("time cancel " + size, timers, [&](long ops) {
+            for (long i = 0; i < ops; i++) tm.remove(ids[i]);
+        }, 1);
+
+        // all of them are due before the clock starts, only running is timed
+        wxg::time due;
+        for (long i = 0; i < timers; i++) due.set_timer(0, 0, false, [] {});
+        bench("time expire " + size, timers, [&](long) { due.process(); }, 1);
+    }
+}
+
+static void lock_queue_bench() {
+    for (int producers : {1, 4}) {
+        string name = "lock_queue " + to_string(producers) + "p1c push+pop";
+        bench(name, scaled(1000000), [&](long ops) {
+            wxg::lock_queue<long> q;
+            long each = ops / producers;
+            vector<thread> threads;
+            for (int p = 0; p < producers; p++)
+                threads.emplace_back([&q, each]() {
+                    for (long i = 0; i < each; i++) q.push(long(i));
+                });
+            long got = 0, v;
+            while (got < each * producers)
+                if (q.pop(v)) got++;
+            for (auto &t : threads) t.join();
+        });
+    }
+}
+
+static void thread_pool_bench() {
+    wxg::thread_pool pool(4);
+
+    // from push to the task running on a worker
+    bench("thread_pool push to run", scaled(50000), [&](long ops) {
+        for (long i = 0; i < ops; i++) {
+            promise<void> ran;
+            auto done = ran.get_future();
+            pool.push([&ran]() { ran.set_value(); });
+            done.wait();
+        }
+    });
+
+    bench("thread_pool push", scaled(200000), [&](long ops) {
+        atomic<long> left{ops};
+        for (long i = 0; i < ops; i++) pool.push([&left]() { left--; });
+        while (left > 0) this_thread::yield();
+    });
+}
+
+/* events fds always readable, one callback per event per turn */
+static void reactor_bench() {
+    for (int events : {1, 64}) {
+        wxg::reactor<wxg::epoll> re;
+        vector<int> fds;
+        long calls = 0;
+        for (int i = 0; i < events; i++) {
+            int fd = eventfd(1, EFD_NONBLOCK);
+            fds.push_back(fd);
+            re.set_read_handler(fd, [&calls]() { calls++; });
+        }
+
+        string name = "reactor dispatch " + to_string(events) + " ready";
+        bench(name, scaled(2000000 / events) * events, [&](long ops) {
+            for (long i = 0; i < ops; i += events) re.loop(true, true);
+        });
+        sink = calls;
+        for (int fd : fds) close(fd);
+    }
+}
+
+int main(int argc, char *const argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "s:")) != -1) {
+        switch (c) {
+            case 's':
+                scale = atof(optarg);
+                break;
+            default:
+                cerr << "usage: " << argv[0] << " [-s scale] [filter]"
+                     << endl;
+                return -1;
+        }
+    }
+    if (optind < argc) filter = argv[optind];
+
+    printf("%-36s %12s %10s %12s\n", "benchmark", "ns/op", "allocs/op",
+           "cycles/op");
+    buffer_bench();
+    request_bench();
+    time_bench();
+    lock_queue_bench();
+    thread_pool_bench();
+    reactor_bench();
+    return 0;
+}
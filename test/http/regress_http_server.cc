@@ -1,16 +1,46 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <csignal>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <http/file_server.hh>
 #include <http/http_multithread_server.hh>
+#include <http/http_proxy.hh>
+#include <http/multipart.hh>
+#include <http/sse.hh>
 
 using namespace std;
 
+/* a /form upload in progress, each thread parses its own */
+struct form_upload {
+    wxg::multipart_parser parser;
+    string summary;
+    bool bad = false;
+    int fd = -1;
+};
+static thread_local form_upload form;
+
 int main(int argc, char const *argv[]) {
     const string fine = "Everything is fine";
     const string funny = "This is funny";
 
     wxg::http_multithread_server server;
     server.resize(4);
+    server.set_output_watermarks(64 * 1024, 16 * 1024);
+    server.set_loop_profiling(100, 200);
+    wxg::trace::enable(true);
+    // a thread whose name has to be escaped in the dump
+    thread([]() {
+        wxg::trace::set_thread_name("quote\" back\\ tab\t");
+        wxg::trace::emit(wxg::TRACE_TASK, wxg::TRACE_INSTANT, -1);
+    }).join();
+    wxg::trace::dump_on_signal(SIGUSR1, "/tmp/libio_trace.json");
+    unlink("/tmp/libio_access.log");
+    server.set_access_log("/tmp/libio_access.log");
 
     server.set_request_handler(
         "/test", [&](wxg::request *req, wxg::http_connection *conn) {
@@ -67,11 +97,383 @@ int main(int argc, char const *argv[]) {
             conn->send_chunk_end();
         });
 
+    server.set_request_handler(
+        "/chunked/raw", [&](wxg::request *req, wxg::http_connection *conn) {
+            wxg::request r;
+            r.set_response(wxg::HTTP_OK, fine);
+            r.set_header("Transfer-Encoding", "chunked");
+            conn->send_request(&r);
+            for (int i = 1; i <= 3; i++) {
+                wxg::buffer buf;
+                buf.push(CHUNKS[i - 1]);
+                conn->send_chunk(&buf);
+            }
+            conn->send_chunk_end();
+        });
+
     server.set_request_handler(
         "/keep/*", [&](wxg::request *req, wxg::http_connection *conn) {
             conn->send_reply(wxg::HTTP_OK, fine, req->uri + "is alive");
         });
 
+    server.set_request_handler(
+        "/headers", [&](wxg::request *req, wxg::http_connection *conn) {
+            string s;
+            for (const auto &h : req->get_headers())
+                if (wxg::equal_nocase(h.first, "x-dup")) s += h.second + ";";
+            conn->send_reply(wxg::HTTP_OK, fine,
+                             s + "|" + req->get_header("x-case"));
+        });
+
+    server.set_request_handler(
+        "/user/:id/posts/:post",
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            conn->send_reply(wxg::HTTP_OK, fine,
+                             req->get_param("id").str() + "," +
+                                 req->get_param("post").str());
+        });
+
+    server.set_request_handler(
+        wxg::GET, "/method", [&](wxg::request *req, wxg::http_connection *conn) {
+            conn->send_reply(wxg::HTTP_OK, fine, "get");
+        });
+
+    server.set_request_handler(
+        wxg::POST, "/method",
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            conn->send_reply(wxg::HTTP_OK, fine, "post");
+        });
+
+    const string large(32 * 1024, 'x');
+
+    server.set_request_handler(
+        "/large", [&](wxg::request *req, wxg::http_connection *conn) {
+            conn->send_reply(wxg::HTTP_OK, fine, large);
+        });
+
+    // produce 64 chunks of 16k, pausing while output is above the watermark
+    server.set_request_handler(
+        "/stream", [&](wxg::request *req, wxg::http_connection *conn) {
+            auto sent = std::make_shared<int>(0);
+            auto produce = [&large, sent](wxg::http_connection *c) {
+                while (*sent < 64 && !c->output_paused()) {
+                    wxg::buffer buf;
+                    buf.push((void *)large.data(), 16 * 1024);
+                    c->send_chunk(&buf);
+                    if (++*sent == 64) c->send_chunk_end();
+                }
+            };
+
+            conn->set_watermark_handler(
+                [produce](wxg::http_connection *c, bool paused) {
+                    if (!paused) produce(c);
+                });
+            conn->send_chunk_start(wxg::HTTP_OK, fine);
+            produce(conn);
+        });
+
+    // 200 batches of 100 coalesced rows and one shared 16k block
+    auto block = std::make_shared<const std::string>(large, 0, 16 * 1024);
+    server.set_request_handler(
+        "/export", [&, block](wxg::request *req, wxg::http_connection *conn) {
+            auto batches = std::make_shared<int>(0);
+            auto w = conn->start_stream(wxg::HTTP_OK, fine);
+            w->set_coalesce(4096, 1000);
+            w->set_drain_handler([batches, block](wxg::stream_writer *w) {
+                while (*batches < 200 && w->writable()) {
+                    for (int i = 0; i < 100; i++) w->write("row....\n", 8);
+                    w->write(block);
+                    if (++*batches == 200) w->end();
+                }
+            });
+            w->drained();
+        });
+
+    // body is spliced into an unnamed temporary file
+    static thread_local int uploadfd = -1;
+    server.set_stream_handler(
+        wxg::POST, "/upload",
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            uploadfd = open("/tmp", O_TMPFILE | O_RDWR, 0600);
+            conn->splice_body_to(uploadfd);
+        },
+        nullptr,
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            struct stat st;
+            fstat(uploadfd, &st);
+            close(uploadfd);
+            conn->send_reply(wxg::HTTP_OK, fine, to_string(st.st_size));
+        });
+
+    // body pieces are counted, reading pauses after each piece
+    static thread_local long counted = 0;
+    server.set_stream_handler(
+        wxg::POST, "/count",
+        [&](wxg::request *req, wxg::http_connection *conn) { counted = 0; },
+        [&](wxg::request *req, wxg::http_connection *conn, const char *data,
+            size_t length) {
+            counted += length;
+            conn->pause_reading();
+            conn->get_reactor()->set_timer(
+                0, [conn]() { conn->resume_reading(); });
+        },
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            conn->send_reply(wxg::HTTP_OK, fine, to_string(counted));
+        });
+
+    int formsParsed =
+        server.metrics.add_counter("regress_forms_total", "Forms parsed.");
+    server.set_request_handler("/metrics", server.metrics_handler());
+    server.set_request_handler("/trace", server.trace_handler());
+    // holds its thread like a blocking read of a slow disk would
+    server.set_request_handler(
+        "/block", [&](wxg::request *req, wxg::http_connection *conn) {
+            usleep(400 * 1000);
+            conn->send_reply(wxg::HTTP_OK, fine, "blocked");
+        });
+
+    // multipart form, fed in slices of the size in the query, files go to
+    // unnamed temporary files and are answered with size and byte sum
+    server.set_stream_handler(
+        wxg::POST, "/form",
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            form.summary.clear();
+            form.bad = form.parser.start(wxg::multipart_parser::boundary_of(
+                           req->get_header("Content-Type"))) < 0;
+            form.parser.set_part_handler([](const wxg::header_list &headers) {
+                const string *d = headers.find("Content-Disposition");
+                string cd = d ? *d : "";
+                string name = wxg::multipart_parser::parameter(cd, "name");
+                string file = wxg::multipart_parser::parameter(cd, "filename");
+                if (!form.summary.empty()) form.summary += "&";
+                form.summary += name + "=";
+                if (!file.empty()) {
+                    form.summary += file + ":";
+                    form.fd = open("/tmp", O_TMPFILE | O_RDWR, 0600);
+                    form.parser.save_to(form.fd);
+                }
+            });
+            form.parser.set_data_handler([](const char *data, size_t length) {
+                form.summary.append(data, length);
+            });
+            form.parser.set_end_handler([]() {
+                if (form.fd < 0) return;
+                unsigned long sum = 0;
+                char tmp[4096];
+                ssize_t n;
+                off_t off = 0;
+                while ((n = pread(form.fd, tmp, sizeof(tmp), off)) > 0) {
+                    for (ssize_t i = 0; i < n; i++) sum += (uint8_t)tmp[i];
+                    off += n;
+                }
+                close(form.fd);
+                form.fd = -1;
+                form.summary += to_string(off) + ":" + to_string(sum);
+            });
+        },
+        [&](wxg::request *req, wxg::http_connection *conn, const char *data,
+            size_t length) {
+            size_t step = atoi(req->query.c_str());
+            if (step == 0) step = length;
+            for (size_t i = 0; i < length && !form.bad; i += step) {
+                size_t n = min(step, length - i);
+                form.bad = form.parser.feed(data + i, n) < 0;
+            }
+        },
+        [&](wxg::request *req, wxg::http_connection *conn) {
+            if (form.fd >= 0) close(form.fd);
+            form.fd = -1;
+            if (form.bad || !form.parser.done())
+                conn->send_reply(wxg::HTTP_BADREQUEST, "Bad Request",
+                                 "bad form");
+            else {
+                conn->thread->get_metrics()->add(formsParsed);
+                conn->send_reply(wxg::HTTP_OK, fine, form.summary);
+            }
+        });
+
+    // calls back into this server through the thread's client
+    server.set_request_handler("/hang", [&](wxg::request *req,
+                                            wxg::http_connection *conn) {});
+    server.set_request_handler(
+        "/fanout", [&](wxg::request *req, wxg::http_connection *conn) {
+            auto client = conn->thread->get_client();
+            client->set_max_connections(2);
+            client->set_max_pipeline(4);
+
+            auto results = make_shared<vector<string>>(10);
+            auto left = make_shared<int>(10);
+            auto done = [=](int i, wxg::request *resp,
+                            wxg::client_error_t error) {
+                if (error == wxg::CLIENT_TIMEOUT)
+                    (*results)[i] = "timeout";
+                else if (error != wxg::CLIENT_OK)
+                    (*results)[i] = "error";
+                else
+                    (*results)[i].assign((char *)resp->get_buffer()->get(),
+                                         resp->get_buffer()->length());
+                if (--*left > 0) return;
+
+                string body;
+                for (auto &s : *results) body += s + "|";
+                if (client->connections("127.0.0.1", 8082) > 2)
+                    body = "too many connections";
+                conn->send_reply(wxg::HTTP_OK, fine, body);
+            };
+
+            for (int i = 0; i < 8; i++) {
+                wxg::request r;
+                r.set_request(wxg::GET, "/user/" + to_string(i) + "/posts/x");
+                client->send("127.0.0.1", 8082, &r,
+                             [=](wxg::request *resp, wxg::client_error_t e) {
+                                 done(i, resp, e);
+                             });
+            }
+
+            wxg::request hang;
+            hang.set_request(wxg::GET, "/hang");
+            client->send("127.0.0.1", 8083, &hang,
+                         [=](wxg::request *resp, wxg::client_error_t e) {
+                             done(8, resp, e);
+                         });
+            client->send("127.0.0.1", 8082, &hang,
+                         [=](wxg::request *resp, wxg::client_error_t e) {
+                             done(9, resp, e);
+                         },
+                         100);
+        });
+
+    // websocket echo, "close" makes the server close first
+    server.set_request_handler(
+        "/ws/echo", [&](wxg::request *req, wxg::http_connection *conn) {
+            auto ws = conn->upgrade_websocket(req);
+            if (!ws) return;
+            ws->set_fragment_size(4096);
+            ws->set_message_handler([](wxg::websocket *ws,
+                                       wxg::ws_opcode_t opcode,
+                                       const char *data, size_t length) {
+                if (string(data, length) == "close")
+                    ws->close(wxg::WS_GOINGAWAY, "bye");
+                else
+                    ws->send(opcode, data, length);
+            });
+        });
+    server.set_request_handler(
+        "/ws/ping", [&](wxg::request *req, wxg::http_connection *conn) {
+            auto ws = conn->upgrade_websocket(req);
+            if (ws) ws->set_ping_interval(100);
+        });
+
+    // files for the range tests, byte i of range.txt is 'a' + i % 26.
+    // app.js is compressed on the fly, style.css has a .br next to it
+    mkdir("/tmp/libio_regress", 0755);
+    string pattern, script, style = "body { margin: 0 }\n";
+    for (int i = 0; i < 100000; i++) pattern.push_back('a' + i % 26);
+    for (int i = 0; i < 1000; i++)
+        script += "console.log(" + to_string(i % 10) + ");\n";
+    for (auto &f : vector<pair<string, string>>{{"range.txt", pattern},
+                                                {"app.js", script},
+                                                {"style.css", style},
+                                                {"style.css.br", "brotli"}}) {
+        int fd = open(("/tmp/libio_regress/" + f.first).c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, f.second.data(), f.second.size()) !=
+                          (ssize_t)f.second.size()) {
+            cerr << "fail to write " << f.first << endl;
+            return -1;
+        }
+        close(fd);
+    }
+
+    wxg::file_server files("/tmp/libio_regress");
+    server.set_request_handler(
+        "/files/*", [&](wxg::request *req, wxg::http_connection *conn) {
+            files.serve(req, conn, req->uri.substr(6));
+        });
+
+    // stand-in upstreams for the proxy, answering by the last path segment.
+    // byte i of big is 'A' + i % 26, it is large enough to be spliced
+    string big;
+    for (int i = 0; i < 1 << 20; i++) big.push_back('A' + i % 26);
+    for (unsigned short p : {8084, 8085}) {
+        auto up = new wxg::http_multithread_server();
+        up->resize(1);
+        string name = "up" + to_string(p);
+        up->set_general_handler([name, &big](wxg::request *req,
+                                             wxg::http_connection *conn) {
+            string what = req->uri.substr(req->uri.rfind('/') + 1);
+            if (what == "big") {
+                conn->send_reply(wxg::HTTP_OK, "OK", big);
+            } else if (what == "chunked") {
+                auto w = conn->start_stream(wxg::HTTP_OK, "OK");
+                for (int i = 0; i < 1000; i++)
+                    w->write(name + " row " + to_string(i) + "\n");
+                w->end();
+            } else if (what == "peer") {
+                conn->send_reply(wxg::HTTP_OK, "OK",
+                                 name + ":" + to_string(conn->port));
+            } else if (what == "echo") {
+                string body((char *)req->get_buffer()->get(),
+                            req->get_buffer()->length());
+                conn->send_reply(wxg::HTTP_OK, "OK",
+                                 body + "|" + req->get_header("X-Forwarded-For") +
+                                     "|" + req->query);
+            } else if (what != "hang") {
+                conn->send_reply(wxg::HTTP_OK, "OK", name);
+            }
+        });
+        thread([up, p]() { up->start("127.0.0.1", p); }).detach();
+    }
+
+    wxg::http_proxy roundrobin, leastconn(wxg::LEAST_CONN),
+        hashed(wxg::CONSISTENT_HASH), single, dead;
+    for (auto proxy : {&roundrobin, &leastconn, &hashed}) {
+        proxy->add_upstream("127.0.0.1", 8084);
+        proxy->add_upstream("127.0.0.1", 8085);
+    }
+    single.add_upstream("127.0.0.1", 8084);
+    single.set_timeout(100);
+    dead.add_upstream("127.0.0.1", 8086);  // nothing listens there
+    dead.add_upstream("127.0.0.1", 8085);
+
+    server.set_request_handler("/proxy/*", roundrobin.handler());
+    server.set_request_handler("/leastconn/*", leastconn.handler());
+    server.set_request_handler("/hash/*", hashed.handler());
+    server.set_request_handler("/single/*", single.handler());
+    server.set_request_handler("/dead/*", dead.handler());
+
+    // server-sent events, 64 events of 64k are more than a subscriber
+    // that never reads may have pending
+    wxg::sse_hub hub;
+    hub.set_drop_watermark(256 * 1024);
+    server.set_request_handler(
+        "/sse/sub", [&](wxg::request *req, wxg::http_connection *conn) {
+            hub.subscribe("news", req, conn);
+            // joins on the same stream, the repeated topic only once
+            if (req->query == "twice") {
+                hub.subscribe("news", req, conn);
+                hub.subscribe("other", req, conn);
+            }
+        });
+    server.set_request_handler(
+        "/sse/pub", [&](wxg::request *req, wxg::http_connection *conn) {
+            hub.publish("news", "line one\r\n" + req->query + "\rthree",
+                        "no\nte", "7\r");
+            conn->send_reply(wxg::HTTP_OK, fine, to_string(hub.subscribers()));
+        });
+    server.set_request_handler(
+        "/sse/flood", [&](wxg::request *req, wxg::http_connection *conn) {
+            auto frame = wxg::sse_hub::format(string(64 * 1024, 'f'));
+            for (int i = 0; i < 64; i++) hub.publish("news", frame);
+            conn->send_reply(wxg::HTTP_OK, fine, "flooded");
+        });
+    server.set_request_handler(
+        "/sse/stats", [&](wxg::request *req, wxg::http_connection *conn) {
+            conn->send_reply(
+                wxg::HTTP_OK, fine,
+                to_string(hub.subscribers()) + "," + to_string(hub.dropped()));
+        });
+
     server.start("127.0.0.1", 8082);
 
     return 0;